@@ -85,6 +85,18 @@ typedef struct Message
 // but the character buffer is not random but and ISO-8601 time string
 // with precision of seconds. It usese 'C' as its type.
 
+// The byte forms on the wire. fill_byte_buffer_measurement writes a
+// Measurement as PIRDS_MEASUREMENT_SIZE bytes: event, type, loc, num,
+// then ms and val in network order. Sent on its own, as a datagram or
+// a TCP frame, it is padded to PIRDS_MEASUREMENT_PACKET bytes.
+// fill_byte_buffer_message writes a Message as PIRDS_MESSAGE_HEADER
+// bytes (event, type, ms in network order and b_size) followed by
+// b_size bytes of text, at most PIRDS_MESSAGE_MAX bytes in all.
+#define PIRDS_MEASUREMENT_SIZE 12
+#define PIRDS_MEASUREMENT_PACKET 14
+#define PIRDS_MESSAGE_HEADER 7
+#define PIRDS_MESSAGE_MAX 263
+
 
 #define FLOW_TOO_HIGH "FLOW OUT OF RANGE HIGH"
 #define FLOW_TOO_LOW  "FLOW OUT OF RANGE LOW"
@@ -110,6 +122,102 @@ uint16_t fill_JSON_buffer_measurement(Measurement* m,char* buff,uint16_t blim);
 // Note: This is this IS DESTRUCTIVE of buff!
 Measurement get_measurement_from_JSON(char* buff,uint16_t blim);
 
+// A MultiMeasurement is several Measurements taken at the same ms, such
+// as the pressure, differential pressure and flow a VentMon samples
+// together, in one record that carries the time once. Its event is 'N'.
+// As bytes it is 'N', the number of channels and ms (4 bytes), then for
+// each channel its type, loc, num and val (4 bytes), with ms and val in
+// network order as in a Measurement: MULTI_HEADER_SIZE plus
+// MULTI_CHANNEL_SIZE per channel, 27 bytes for three channels.
+
+#define MULTI_MAX_CHANNELS 16
+#define MULTI_HEADER_SIZE 6
+#define MULTI_CHANNEL_SIZE 7
+
+typedef struct Channel
+{
+  char     type;
+  char     loc;
+  uint8_t  num;
+  int32_t  val;
+} Channel;
+
+typedef struct MultiMeasurement
+{
+  char     event; // 'N'
+  uint8_t  count; // channels in use
+  uint32_t ms;
+  Channel  ch[MULTI_MAX_CHANNELS];
+} MultiMeasurement;
+
+static inline void pirds_put32(uint8_t* b,uint32_t v) {
+  b[0] = v >> 24; b[1] = v >> 16; b[2] = v >> 8; b[3] = v;
+}
+
+static inline uint32_t pirds_get32(const uint8_t* b) {
+  return (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 | (uint32_t) b[2] << 8 | b[3];
+}
+
+// The number of bytes of the MultiMeasurement at the start of buff, or
+// 0 if buff does not start with a whole one.
+static inline uint16_t multi_measurement_size(const uint8_t* buff,uint16_t blim) {
+  if (blim < MULTI_HEADER_SIZE || buff[0] != 'N' ||
+      buff[1] == 0 || buff[1] > MULTI_MAX_CHANNELS)
+    return 0;
+  uint16_t size = MULTI_HEADER_SIZE + MULTI_CHANNEL_SIZE * buff[1];
+  return size <= blim ? size : 0;
+}
+
+// Returns the number of bytes written, or 0 if they do not fit in blim.
+static inline uint16_t fill_byte_buffer_multi_measurement(MultiMeasurement* m,uint8_t* buff,uint16_t blim) {
+  if (m->count == 0 || m->count > MULTI_MAX_CHANNELS ||
+      blim < MULTI_HEADER_SIZE + MULTI_CHANNEL_SIZE * m->count)
+    return 0;
+  buff[0] = 'N';
+  buff[1] = m->count;
+  pirds_put32(buff + 2,m->ms);
+  uint8_t* b = buff + MULTI_HEADER_SIZE;
+  for (int i = 0; i < m->count; i++, b += MULTI_CHANNEL_SIZE) {
+    b[0] = m->ch[i].type;
+    b[1] = m->ch[i].loc;
+    b[2] = m->ch[i].num;
+    pirds_put32(b + 3,(uint32_t) m->ch[i].val);
+  }
+  return b - buff;
+}
+
+// A count of 0 means buff did not hold a MultiMeasurement.
+static inline MultiMeasurement get_multi_measurement_from_buffer(uint8_t* buff,uint16_t blim) {
+  MultiMeasurement m;
+  m.event = 'N';
+  m.count = 0;
+  m.ms = 0;
+  if (!multi_measurement_size(buff,blim))
+    return m;
+  m.count = buff[1];
+  m.ms = pirds_get32(buff + 2);
+  const uint8_t* b = buff + MULTI_HEADER_SIZE;
+  for (int i = 0; i < m.count; i++, b += MULTI_CHANNEL_SIZE) {
+    m.ch[i].type = b[0];
+    m.ch[i].loc = b[1];
+    m.ch[i].num = b[2];
+    m.ch[i].val = (int32_t) pirds_get32(b + 3);
+  }
+  return m;
+}
+
+// Channel i of m as a Measurement of its own.
+static inline Measurement get_measurement_from_multi(MultiMeasurement* m,uint8_t i) {
+  Measurement r;
+  r.event = 'M';
+  r.type = m->ch[i].type;
+  r.loc = m->ch[i].loc;
+  r.num = m->ch[i].num;
+  r.ms = m->ms;
+  r.val = m->ch[i].val;
+  return r;
+}
+
 uint16_t fill_byte_buffer_message(Message* m,uint8_t* buff,uint16_t blim);
 
 Message get_message_from_buffer(uint8_t* buff,uint16_t blim);
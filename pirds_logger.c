@@ -59,6 +59,9 @@ Our basic strategy will be:
 1) If we receive HW_TOLERANCE samples earlier than the HIGH_WATER_MARK_MS,
 we will reset the HIGH_WATER_MARK_MS.
 
+Each device has its own ms clock, so all of this state is kept per
+peer (see struct peer_state); one device's marks never apply to another.
+
 Note: This strategy is subject to a disruptive hacking attack that sends
 ms numbers that are too high or too low. However, we are using completely
 open UDP anyway; when the time comes to provide security, we will have to use
@@ -78,11 +81,30 @@ TCP transmission or some other approach to security.
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <limits.h> // IOV_MAX, LLONG_MAX
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
 #if __linux__
-#include <sys/prctl.h> // prctl(), PR_SET_PDEATHSIG
+#include <linux/filter.h> // SO_ATTACH_REUSEPORT_CBPF
 #endif
-#include <stdbool.h>
 #include "PIRDS.h"
+#include "pirds_store.h"
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
 
 #define SAVE_LOG_TO_FILE "SAVE_LOG_TO_FILE:"
@@ -107,7 +129,7 @@ struct {
   'K', "Unknown K",
   'L', "Limits",
   'M', "Measurement",
-  'N', "Unknown N",
+  'N', "Multi-channel Measurement",
   'O', "Unknown O",
   'P', "PARAMETERS",
   'Q', "Unknown Q",
@@ -128,37 +150,182 @@ struct {
 
 uint8_t gDEBUG = 1;
 
-#define USESELECT
-#ifdef USESELECT
 #define DATA_TIMEOUT 60 // for TCP connections
-#endif
+#define TCP_CONNS_DEFAULT 4096
+#define TCP_EVENTS 256
+// Per connection receive buffer; must hold at least one complete frame.
+#define TCP_CONN_BUFFER (8*1024)
+int gMAX_CONNS = TCP_CONNS_DEFAULT;
 
 #define BSIZE 65*1024
-uint8_t buffer[BSIZE];
+// Everything a receive loop touches is thread local, so that with -w
+// each worker thread has its own buffers, clock state and open files
+// and the workers never contend with each other.
+__thread uint8_t buffer[BSIZE];
+
+// In batch mode (-b) we pull up to UDP_BATCH datagrams out of the
+// socket with a single recvmmsg() call. VentMon packets are tiny
+// (PIRDS_MEASUREMENT_PACKET bytes, or a short JSON object), so a small buffer per datagram
+// is plenty; anything longer is truncated by the kernel and dropped.
+#define UDP_BATCH 64
+#define UDP_BATCH_BUFFER_SIZE 4096
+__thread uint8_t batch_buffers[UDP_BATCH][UDP_BATCH_BUFFER_SIZE];
+bool gBATCH = false;
+
+// With -w N we run N receive threads, each with its own SO_REUSEPORT socket.
+#define MAX_WORKERS 64
+int gWORKERS = 1;
+__thread unsigned long batch_syscalls = 0;
+__thread unsigned long batch_packets = 0;
 
 #define ONE_EVENT_BUFFER_SIZE 1024
 
-// This might not need to be 64 bit, but we will be adding UNIX epoch time in ms to it, so this
-// is simpler.
-uint64_t HIGH_WATER_MARK_MS = 0;
-uint64_t HIGH_WATER_MARK_EPOCH_MS = 0; // ms since the epoch at time of last "minute mark" set in the log file
-// ms-times samples more recent than HIGH_WATER_MARK_MS are NOT logged and increment a count
+// ms-times samples more recent than the high water mark are NOT logged and increment a count
 #define HIGH_WATER_MARK_TOLERANCE 10
-int HIGH_WATER_MARK_TOLERANCE_COUNT = 0;
 
+// What the metrics (-m) count, for the process and for each peer (see
+// metric_count).
+enum { METRIC_PACKETS, METRIC_BYTES, METRIC_EVENTS, METRIC_FAILURES,
+       METRIC_INCONSISTENT, METRIC_RESETS, METRIC_ACKS, METRIC_COUNTS };
+
+// Every device has its own ms clock, so the high water mark state lives
+// in a per-peer table (see peer_lookup) rather than in globals.
+struct peer_state {
+  uint32_t addr;             // IPv4 address, network order
+  char name[INET6_ADDRSTRLEN];
+  // This might not need to be 64 bit, but we will be adding UNIX epoch time in ms to it, so this
+  // is simpler.
+  uint64_t high_water_mark_ms;
+  uint64_t high_water_mark_epoch_ms; // ms since the epoch at time of last "minute mark" set in the log file
+  int tolerance_count;
+  // We will keep a count of the number of 10 second periods
+  // since the UNIX epoch. When this changes, the next event
+  // from this peer injects a "clock" event.
+  unsigned long epoch_minute;
+  struct peer_rollup *rollup; // open rollup buckets, with -r
+  struct catalog_entry *catalog; // its dataset's slot in 0Catalog
+  bool uncataloged;          // the catalog had no room for it
+  time_t last_seen;
+  _Atomic uint64_t counts[METRIC_COUNTS]; // with -m
+  int next;                  // hash chain, or free list
+  int prev_lru, next_lru;    // least recently seen first
+};
+
+#define PEER_TABLE_DEFAULT 65536
+#define PEER_IDLE_TIMEOUT (30*60) // seconds before a silent peer is forgotten
+int gMAX_PEERS = PEER_TABLE_DEFAULT;
+
+int open_listener(char *port, uint8_t mode, bool reuseport);
+void attach_peer_affinity(int listenfd, int nworkers);
+void receive_loop(int listenfd, uint8_t mode);
+void *udp_worker(void *arg);
+void *tcp_worker(void *arg);
 void handle_udp_connx(int listenfd);
+void handle_udp_batch(int listenfd);
 void handle_tcp_connx(int listenfd);
 
+// With -u the UDP workers receive and append through io_uring (see
+// uring_receive_loop); uring_active is set while a worker runs it.
+bool gURING = false;
+__thread bool uring_active = false;
+bool uring_receive_loop(int listenfd);
+void uring_stage_line(char *peer, uint8_t stream, const char *line, int len);
+void uring_flush_writes(bool wait);
+void uring_submit_writes();
+bool uring_queue_ack(int fd, struct sockaddr_in *clientaddr, const char *reply, int len);
+
 int
-handle_event(uint8_t *buffer, int fd, struct sockaddr_in *clientaddr, char *peer, bool mark_minute);
+handle_event(uint8_t *buffer, int fd, struct sockaddr_in *clientaddr, struct peer_state *ps, bool mark_minute);
 
 FILE *gFOUTPUT;
 
-// We will keep a count of the number of minutes
-// since the UNIX epoch (seconds/60).
-// When this changes, we will set a mark for the
-// first child process to inject a "clock" event.
-unsigned long epoch_minute;
+// Set by SIGINT/SIGTERM so that we can flush the log files on the way out.
+volatile sig_atomic_t gSTOP = 0;
+
+// Log files are kept open between events in a small cache keyed by
+// peer, instead of an fopen/fprintf/fclose for every sample. When more
+// than gLOG_CACHE_SIZE peers are active the least recently used file is
+// closed. Buffered data is written out by the flush policies below:
+//   - a dirty file is flushed at least every gFLUSH_INTERVAL seconds
+//     (0 means flush after every record, the old behaviour);
+//   - when no packets arrive for LOG_IDLE_FLUSH seconds, everything is flushed.
+#define LOG_CACHE_DEFAULT 64
+#define LOG_CACHE_MAX 4096
+#define LOG_CACHE_BUCKETS 1024
+#define LOG_IDLE_FLUSH 1 // seconds
+
+int gLOG_CACHE_SIZE = LOG_CACHE_DEFAULT;
+int gFLUSH_INTERVAL = 1;
+
+// With -a the receive threads only format records and queue them; a
+// separate writer thread does all the file I/O (see append_log_line).
+bool gASYNC = false;
+
+// With -m FILE the logger counts what it receives and logs, and
+// rewrites FILE with the counts in the Prometheus text format every
+// METRICS_INTERVAL seconds (see metrics_write).
+char *gMETRICS_FILE = NULL;
+
+// With -A N the receive path's diagnostics are queued for a separate
+// thread to print, keeping 1 packet in N (see diag_begin); 0 prints
+// them at once.
+int gDIAG_SAMPLE = 0;
+
+// What -s selects to store: the text log, binary segments (see
+// pirds_store.h), or both.
+#define STORE_TEXT 1
+#define STORE_SEGMENT 2
+int gSTORE = STORE_TEXT;
+
+// With -l and/or -L a peer's log is rolled into a new part when it
+// reaches gROLL_BYTES or is gROLL_SECONDS old, and with -K / -k the
+// oldest parts are deleted to keep them under gKEEP_BYTES in total or
+// gKEEP_SECONDS old (see log_roll and pirds_store.h). 0 means no limit.
+long long gROLL_BYTES = 0;
+long gROLL_SECONDS = 0;
+long long gKEEP_BYTES = 0;
+long gKEEP_SECONDS = 0;
+
+// With -r the logger keeps rollup tiers of every peer's measurements
+// (see rollup_note and pirds_store.h).
+bool gROLLUP = false;
+
+// With -C the logger keeps the dataset catalog, 0Catalog (see
+// catalog_open and pirds_store.h).
+bool gCATALOG = false;
+
+// Every peer has a few log streams, each with its own cached handle.
+// A LOG_SEGMENT "line" is a struct segment_record, followed for clock
+// and message events by the heap entry (length byte and text) it refers
+// to; whoever finally writes it fills in heap_off (see segment_split).
+// Rollup tier t is stream LOG_ROLLUP + t, whose lines are struct
+// rollup_records.
+enum { LOG_TEXT, LOG_SEGMENT, LOG_ROLLUP };
+
+void peer_table_init();
+void writer_start();
+void writer_stop();
+void writer_register();
+void diag_start();
+void diag_stop();
+void diag_register();
+enum { DIAG_PACKETS, DIAG_PROBLEMS, DIAG_STATS, DIAG_CATEGORIES };
+void diag_note(int category, time_t when, const char *note, const char *text);
+void metrics_start();
+void metrics_stop();
+void log_cache_init();
+void log_cache_tick();
+bool log_cache_dirty();
+void log_cache_flush_all();
+void log_cache_close_all();
+struct peer_state;
+void rollup_flush(struct peer_state *ps, bool release);
+void rollup_flush_all();
+void rollup_tick(time_t now);
+void catalog_open();
+int bench_json(int count);
+void catalog_note(struct peer_state *ps, int64_t ms, int len);
+void catalog_save(struct peer_state *ps, const char *name);
 
 // We need to associate the current "peer" string
 // with the current milliseconds in the stream
@@ -166,18 +333,129 @@ unsigned long epoch_minute;
 // One way to do this is to look backwards in the
 // current file, which will fail if we are just beginning.
 
+void handle_stop_signal(int sig) {
+  gSTOP = 1;
+}
+
+// A size in bytes, with an optional K, M or G; -1 if it is not one (or
+// does not fit).
+long long parse_size(const char *s) {
+  char *end;
+  long long v = strtoll(s, &end, 10), factor = 1;
+  if (end == s)
+    return -1;
+  switch (toupper((unsigned char) *end)) {
+  case 'G': factor *= 1024;
+    /* fall through */
+  case 'M': factor *= 1024;
+    /* fall through */
+  case 'K': factor *= 1024; end++;
+  }
+  if (*end || v < 0 || v > LLONG_MAX / factor)
+    return -1;
+  return v * factor;
+}
+
+// An age in seconds, with an optional s, m, h or d; -1 if it is not one
+// (or does not fit).
+long parse_duration(const char *s) {
+  char *end;
+  long v = strtol(s, &end, 10), factor = 1;
+  if (end == s)
+    return -1;
+  switch (*end) {
+  case 'd': factor *= 24;
+    /* fall through */
+  case 'h': factor *= 60;
+    /* fall through */
+  case 'm': factor *= 60;
+    /* fall through */
+  case 's': end++;
+  }
+  if (*end || v < 0 || v > LONG_MAX / factor)
+    return -1;
+  return v * factor;
+}
+
 int main(int argc, char* argv[]) {
   uint8_t mode = UDP;
 
   int opt;
-  while ((opt = getopt(argc, argv, "Dt")) != -1) {
+  while ((opt = getopt(argc, argv, "DtbCf:F:w:c:p:aus:rl:L:K:k:A:m:J:")) != -1) {
     switch (opt) {
     case 'D': gDEBUG++; break;
     case 't': mode = TCP; break;
-    default: printf("Usage: %s [-D] [-t] [port]\n", argv[0]);
+    case 'b': gBATCH = true; break;
+    case 'C': gCATALOG = true; break;
+    case 'f': gLOG_CACHE_SIZE = atoi(optarg); break;
+    case 'F': gFLUSH_INTERVAL = atoi(optarg); break;
+    case 'w': gWORKERS = atoi(optarg); break;
+    case 'c': gMAX_CONNS = atoi(optarg); break;
+    case 'p': gMAX_PEERS = atoi(optarg); break;
+    case 'a': gASYNC = true; break;
+    case 'u': gURING = true; break;
+    case 'r': gROLLUP = true; break;
+    case 'l': gROLL_BYTES = parse_size(optarg); break;
+    case 'L': gROLL_SECONDS = parse_duration(optarg); break;
+    case 'K': gKEEP_BYTES = parse_size(optarg); break;
+    case 'k': gKEEP_SECONDS = parse_duration(optarg); break;
+    case 'A': gDIAG_SAMPLE = atoi(optarg) > 0 ? atoi(optarg) : -1; break;  // 0 would be off
+    case 'm': gMETRICS_FILE = optarg; break;
+    case 'J': return bench_json(atoi(optarg) > 0 ? atoi(optarg) : 1000000);
+    case 's':
+      if (strcmp(optarg, "text") == 0) gSTORE = STORE_TEXT;
+      else if (strcmp(optarg, "segment") == 0) gSTORE = STORE_SEGMENT;
+      else if (strcmp(optarg, "both") == 0) gSTORE = STORE_TEXT | STORE_SEGMENT;
+      else {
+        fprintf(stderr, "-s must be text, segment or both\n");
+        exit(1);
+      }
+      break;
+    default: printf("Usage: %s [-D] [-t] [-b] [-a] [-u] [-r] [-C] [-s text|segment|both] [-l roll_size] [-L roll_age] [-K keep_size] [-k keep_age] [-f max_open_files] [-F flush_seconds] [-w workers] [-c max_tcp_connections] [-p max_peers] [-A sample] [-m metrics_file] [-J bench_events] [port]\n", argv[0]);
       exit(1);
     }
   }
+  if (gLOG_CACHE_SIZE < 1 || gLOG_CACHE_SIZE > LOG_CACHE_MAX) {
+    fprintf(stderr, "-f must be between 1 and %d\n", LOG_CACHE_MAX);
+    exit(1);
+  }
+  if (gFLUSH_INTERVAL < 0)
+    gFLUSH_INTERVAL = 0;
+  if (gWORKERS < 1 || gWORKERS > MAX_WORKERS) {
+    fprintf(stderr, "-w must be between 1 and %d\n", MAX_WORKERS);
+    exit(1);
+  }
+  if (gMAX_CONNS < 1) {
+    fprintf(stderr, "-c must be at least 1\n");
+    exit(1);
+  }
+  if (gURING && gASYNC) {
+    fprintf(stderr, "-u and -a cannot be combined; io_uring appends are already asynchronous\n");
+    exit(1);
+  }
+  if (gURING && mode == TCP) {
+    fprintf(stderr, "-u only applies to UDP, using epoll for TCP\n");
+    gURING = false;
+  }
+  if (gMAX_PEERS < 1) {
+    fprintf(stderr, "-p must be at least 1\n");
+    exit(1);
+  }
+  if (gDIAG_SAMPLE < 0) {
+    fprintf(stderr, "-A must be at least 1\n");
+    exit(1);
+  }
+  if (gROLL_BYTES < 0 || gROLL_SECONDS < 0 || gKEEP_BYTES < 0 || gKEEP_SECONDS < 0) {
+    fprintf(stderr, "-l, -L, -K and -k take a size like 64M or an age like 30m, 12h or 7d\n");
+    exit(1);
+  }
+
+  // No SA_RESTART: a blocked recvfrom/accept returns EINTR and the loop exits.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
   gFOUTPUT = stderr;
   if (gDEBUG > 1)
@@ -196,6 +474,53 @@ int main(int argc, char* argv[]) {
 	    mode == TCP ? "TCP":"UDP",
 	    "\033[92m", port, "\033[0m");
 
+  int listenfds[MAX_WORKERS];
+  for (int i = 0; i < gWORKERS; i++)
+    listenfds[i] = open_listener(port, mode, gWORKERS > 1);
+  if (gWORKERS > 1)
+    attach_peer_affinity(listenfds[0], gWORKERS);
+
+  if (gCATALOG)
+    catalog_open();
+  if (gASYNC)
+    writer_start();
+  if (gDIAG_SAMPLE)
+    diag_start();
+  if (gMETRICS_FILE)
+    metrics_start();
+
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "LOOP!\n");
+
+  if (gWORKERS == 1) {
+    receive_loop(listenfds[0], mode);
+  } else {
+    pthread_t threads[MAX_WORKERS];
+    for (int i = 0; i < gWORKERS; i++) {
+      if (pthread_create(&threads[i], NULL, mode == TCP ? tcp_worker : udp_worker,
+                         (void *)(intptr_t) listenfds[i]) != 0) {
+        perror("pthread_create");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < gWORKERS; i++)
+      pthread_join(threads[i], NULL);
+  }
+  if (gASYNC)
+    writer_stop();
+  if (gDIAG_SAMPLE)
+    diag_stop();
+  if (gMETRICS_FILE)
+    metrics_stop();
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "Server stopped\n");
+  return 0;
+}
+
+// Create and bind a listening socket (and for TCP, listen on it). With
+// reuseport set, several sockets can be bound to the same port and the
+// kernel spreads the incoming packets over them.
+int open_listener(char *port, uint8_t mode, bool reuseport) {
   // getaddrinfo for host
   struct addrinfo hints, *res;
   memset (&hints, 0, sizeof(hints));
@@ -218,7 +543,13 @@ int main(int argc, char* argv[]) {
     if (listenfd == -1) continue;
     int option = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof option);
+    if (reuseport &&
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof option) != 0) {
+      perror("setsockopt(SO_REUSEPORT)");
+      exit(1);
+    }
     if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(listenfd);
   }
 
   freeaddrinfo(res);
@@ -227,15 +558,300 @@ int main(int argc, char* argv[]) {
     perror ("socket() or bind()");
     exit(1);
   }
+  // Wake up when the line goes quiet so that buffered log data gets flushed.
+  if (mode == UDP) {
+    struct timeval tv = {LOG_IDLE_FLUSH, 0};
+    setsockopt(listenfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  }
+  // A TCP socket joins the port's reuseport group when it listens, so
+  // this is done here, in listenfds[] order, and not by the workers.
+  if (mode == TCP && listen(listenfd, 1000000) != 0) {
+    perror("listen() error");
+    exit(1);
+  }
+  return listenfd;
+}
+
+// By default the kernel picks a reuseport socket by hashing the
+// address *and port* of the sender, so a device that changes its
+// source port could move to another worker. Our per-peer state (clock
+// marks, the open log file) is keyed by address only, so we install a
+// classic BPF program that picks the socket from the source address
+// alone: worker = saddr % nworkers. Sockets are numbered in the order
+// they were bound (for TCP, the order they started listening), which is
+// the order of listenfds[]; the program is attached once they all are.
+void attach_peer_affinity(int listenfd, int nworkers) {
+#if __linux__ && defined(SO_ATTACH_REUSEPORT_CBPF)
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, SKF_NET_OFF + 12 }, // A = IPv4 source address
+    { BPF_ALU | BPF_MOD | BPF_K,   0, 0, nworkers },
+    { BPF_RET | BPF_A,             0, 0, 0 },
+  };
+  struct sock_fprog prog = { sizeof code / sizeof code[0], code };
+  if (setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == 0)
+    return;
+  perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+#endif
   if (gDEBUG)
-    fprintf(gFOUTPUT, "LOOP!\n");
+    fprintf(gFOUTPUT, "WARNING: cannot pin peers to workers; "
+            "a device that changes source port may move between workers\n");
+}
 
-  while (1) {
+void receive_loop(int listenfd, uint8_t mode) {
+  log_cache_init();
+  peer_table_init();
+  if (gASYNC)
+    writer_register();
+  if (gDIAG_SAMPLE)
+    diag_register();
+  if (gURING && mode == UDP && uring_receive_loop(listenfd)) {
+    log_cache_close_all();
+    return;
+  }
+  while (!gSTOP) {
     if (mode == TCP)
       handle_tcp_connx(listenfd);
+    else if (gBATCH)
+      handle_udp_batch(listenfd);
     else
       handle_udp_connx(listenfd);
   }
+  rollup_flush_all();
+  log_cache_close_all();
+}
+
+void *udp_worker(void *arg) {
+  receive_loop((int)(intptr_t) arg, UDP);
+  return NULL;
+}
+
+void *tcp_worker(void *arg) {
+  receive_loop((int)(intptr_t) arg, TCP);
+  return NULL;
+}
+
+// Metrics (-m). Each receive thread, and the writer, counts into a
+// struct metrics of its own, and each peer into its peer_state; only
+// the owning thread ever writes a counter, so counting is a plain add
+// (see metric_add) and cheap enough to leave on. The metrics thread adds
+// the threads' counters up when it rewrites the file. A peer's counters
+// start again from 0 when it is forgotten, which Prometheus takes as a
+// counter reset.
+#define METRIC_EVENT_KINDS "MLE" // the events counted by type
+#define METRIC_LATENCY_BUCKETS 14
+// Upper bounds of the write latency buckets, in microseconds.
+static const uint32_t metric_latency_us[METRIC_LATENCY_BUCKETS] = {
+  10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 1000000
+};
+
+struct metrics {
+  _Atomic uint64_t counts[METRIC_COUNTS];
+  _Atomic uint64_t events[sizeof METRIC_EVENT_KINDS - 1][128]; // by event and type
+  _Atomic uint64_t writes[METRIC_LATENCY_BUCKETS + 1]; // by latency, the last is +Inf
+  _Atomic uint64_t write_ns;
+  struct peer_state *peers;  // the thread's peer table, NULL for the writer
+  _Atomic unsigned *peer_seq;
+};
+
+struct metrics *metrics_threads[MAX_WORKERS + 1];
+_Atomic int metrics_nthreads = 0;
+
+__thread struct metrics *thread_metrics = NULL;
+// The peer whose packet is being handled, if any.
+__thread struct peer_state *metrics_peer = NULL;
+
+void metrics_register(struct peer_state *peers, _Atomic unsigned *peer_seq) {
+  thread_metrics = calloc(1, sizeof *thread_metrics);
+  if (!thread_metrics) {
+    perror("metrics");
+    exit(1);
+  }
+  thread_metrics->peers = peers;
+  thread_metrics->peer_seq = peer_seq;
+  int i = atomic_fetch_add(&metrics_nthreads, 1);
+  metrics_threads[i] = thread_metrics;
+}
+
+static inline void metric_add(_Atomic uint64_t *c, uint64_t n) {
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Count n against this thread and the peer being handled.
+static inline void metric_count(int which, uint64_t n) {
+  if (!thread_metrics)
+    return;
+  metric_add(&thread_metrics->counts[which], n);
+  if (metrics_peer)
+    metric_add(&metrics_peer->counts[which], n);
+}
+
+// Count a logged event.
+static inline void metric_event(char event, char type) {
+  if (!thread_metrics)
+    return;
+  const char *k = strchr(METRIC_EVENT_KINDS, event);
+  if (k && event)
+    metric_add(&thread_metrics->events[k - METRIC_EVENT_KINDS][type & 127], 1);
+  metric_count(METRIC_EVENTS, 1);
+}
+
+// Count a write to the log files that took ns.
+void metric_write_ns(uint64_t ns) {
+  if (!thread_metrics)
+    return;
+  int b = 0;
+  while (b < METRIC_LATENCY_BUCKETS && ns > metric_latency_us[b] * 1000ull)
+    b++;
+  metric_add(&thread_metrics->writes[b], 1);
+  metric_add(&thread_metrics->write_ns, ns);
+}
+
+// For timing writes; nothing is read unless metrics are on.
+static inline void metric_clock(struct timespec *t) {
+  if (thread_metrics)
+    clock_gettime(CLOCK_MONOTONIC, t);
+}
+
+void metric_write_since(struct timespec *t0) {
+  if (!thread_metrics)
+    return;
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  metric_write_ns((t1.tv_sec - t0->tv_sec) * 1000000000ull + t1.tv_nsec - t0->tv_nsec);
+}
+
+// The peer table maps a device's IPv4 address to its clock state with
+// one hash probe. Entries come from a fixed array of gMAX_PEERS, so
+// memory is bounded; peers silent for PEER_IDLE_TIMEOUT are forgotten,
+// and when the table is full the least recently seen peer is reused.
+// Like everything else on the receive path the table is per worker.
+__thread struct peer_state *peer_table = NULL;
+__thread int *peer_buckets = NULL;
+__thread unsigned int peer_bucket_mask = 0;
+__thread int peer_free = -1;
+__thread int peer_lru_head = -1, peer_lru_tail = -1;
+__thread int peer_count = 0;
+// With -m, peer_seq[i] is odd while peer_table[i] changes hands, so that
+// the metrics thread can tell when it has read a torn name or counters.
+__thread _Atomic unsigned *peer_seq = NULL;
+
+void peer_seq_begin(int i) {
+  if (peer_seq) {
+    atomic_store_explicit(&peer_seq[i], atomic_load_explicit(&peer_seq[i], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+  }
+}
+
+void peer_seq_end(int i) {
+  if (peer_seq)
+    atomic_store_explicit(&peer_seq[i], atomic_load_explicit(&peer_seq[i], memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+void peer_table_init() {
+  unsigned int nbuckets = 1;
+  while (nbuckets < (unsigned int) gMAX_PEERS)
+    nbuckets <<= 1;
+  peer_table = calloc(gMAX_PEERS, sizeof(struct peer_state));
+  peer_buckets = malloc(nbuckets * sizeof(int));
+  if (!peer_table || !peer_buckets) {
+    perror("peer table");
+    exit(1);
+  }
+  peer_bucket_mask = nbuckets - 1;
+  for (unsigned int i = 0; i < nbuckets; i++)
+    peer_buckets[i] = -1;
+  for (int i = 0; i < gMAX_PEERS; i++)
+    peer_table[i].next = i + 1 < gMAX_PEERS ? i + 1 : -1;
+  peer_free = 0;
+  if (gMETRICS_FILE) {
+    peer_seq = calloc(gMAX_PEERS, sizeof *peer_seq);
+    if (!peer_seq) {
+      perror("peer table");
+      exit(1);
+    }
+    metrics_register(peer_table, peer_seq);
+  }
+}
+
+unsigned int peer_hash(uint32_t addr) {
+  return (addr * 2654435761u) & peer_bucket_mask;
+}
+
+void peer_lru_unlink(int i) {
+  struct peer_state *ps = &peer_table[i];
+  if (ps->prev_lru != -1) peer_table[ps->prev_lru].next_lru = ps->next_lru; else peer_lru_head = ps->next_lru;
+  if (ps->next_lru != -1) peer_table[ps->next_lru].prev_lru = ps->prev_lru; else peer_lru_tail = ps->prev_lru;
+}
+
+void peer_lru_append(int i) {
+  struct peer_state *ps = &peer_table[i];
+  ps->prev_lru = peer_lru_tail;
+  ps->next_lru = -1;
+  if (peer_lru_tail != -1) peer_table[peer_lru_tail].next_lru = i; else peer_lru_head = i;
+  peer_lru_tail = i;
+}
+
+void peer_remove(int i) {
+  struct peer_state *ps = &peer_table[i];
+  rollup_flush(ps, true);
+  int *link = &peer_buckets[peer_hash(ps->addr)];
+  while (*link != i)
+    link = &peer_table[*link].next;
+  *link = ps->next;
+  peer_lru_unlink(i);
+  if (gDEBUG > 1)
+    fprintf(gFOUTPUT, "forgetting peer %s\n", ps->name);
+  peer_seq_begin(i);
+  ps->name[0] = '\0';
+  peer_seq_end(i);
+  ps->next = peer_free;
+  peer_free = i;
+  peer_count--;
+}
+
+struct peer_state *peer_lookup(uint32_t addr, time_t now) {
+  // Forget at most a couple of idle peers per call, so this stays O(1).
+  for (int k = 0; k < 2 && peer_lru_head != -1 &&
+         now - peer_table[peer_lru_head].last_seen > PEER_IDLE_TIMEOUT; k++)
+    peer_remove(peer_lru_head);
+
+  unsigned int b = peer_hash(addr);
+  for (int i = peer_buckets[b]; i != -1; i = peer_table[i].next) {
+    if (peer_table[i].addr == addr) {
+      peer_table[i].last_seen = now;
+      peer_lru_unlink(i);
+      peer_lru_append(i);
+      return &peer_table[i];
+    }
+  }
+
+  if (peer_free == -1)
+    peer_remove(peer_lru_head);
+  int i = peer_free;
+  struct peer_state *ps = &peer_table[i];
+  peer_free = ps->next;
+  peer_seq_begin(i);
+  memset(ps, 0, sizeof *ps);
+  ps->addr = addr;
+  inet_ntop(AF_INET, &addr, ps->name, sizeof ps->name);
+  peer_seq_end(i);
+  ps->last_seen = now;
+  ps->next = peer_buckets[b];
+  peer_buckets[b] = i;
+  peer_lru_append(i);
+  peer_count++;
+  return ps;
+}
+
+// True for the first event from this peer in each 10 second period;
+// that event gets a clock event injected after it.
+bool peer_new_period(struct peer_state *ps, time_t now) {
+  unsigned long cur_minute = now / 10;
+  bool new_minute = (cur_minute != ps->epoch_minute);
+  ps->epoch_minute = cur_minute;
+  return new_minute;
 }
 
 void
@@ -264,209 +880,1984 @@ log_measurement_bytecode(char *peer, void *buff, bool limit) {
   struct __attribute__((__packed__)) measurement_t *measurement = (struct measurement_t *) buff;
 */
 
-FILE* open_log_file(char *peer) {
-  // xxx need file locking
-  char fname[30];
-  strcpy(fname, "0Logfile.");
-  strcpy(fname + 9, peer);
-
-  FILE *fp = fopen(fname, "a");
-  return fp;
-}
-
-/**
- * Copy content from one file to other file.
- */
-int
-copy_file(char path_to_read_file[], char path_to_write_file[])
-{
-    char chr;
-    FILE *stream_for_write, *stream_for_read;
+// See open_log_file() below.
 
-    if ((stream_for_write = fopen(path_to_write_file, "w")) == NULL) {
-        fprintf(stderr, "%s: %s\n", "Impossible to create a file", path_to_write_file);
-        return -1;
-    }
-
-    if ((stream_for_read = fopen(path_to_read_file, "r")) == NULL) {
-        fprintf(stderr, "%s: %s\n", "Impossible to read a file", path_to_read_file);
-        return -1;
-    }
+struct log_handle {
+  char peer[INET6_ADDRSTRLEN];
+  uint8_t stream;            // LOG_TEXT or LOG_SEGMENT
+  FILE *fp;
+  FILE *heap_fp;             // LOG_SEGMENT only
+  FILE *idx_fp;              // LOG_TEXT only, NULL if not indexing
+  off_t size;                // bytes in the file, counting what is still buffered
+  off_t heap_size;
+  int64_t idx_last_sec;      // time of the last index entry
+  time_t started;            // arrival of the first record, 0 if none yet
+  int next;                  // hash chain, -1 terminated
+  unsigned long last_used;   // LRU stamp
+  time_t last_flush;
+  bool dirty;
+};
 
-    while (!feof(stream_for_read)) {
-      char chr = fgetc(stream_for_read);
-      fputc(chr, stream_for_write);
-    }
+// One cache per worker thread; a peer always lands on the same worker,
+// so no two caches ever hold the same file.
+__thread struct log_handle *log_cache = NULL;
+__thread int log_cache_buckets[LOG_CACHE_BUCKETS];
+__thread int log_cache_used = 0;
+__thread unsigned long log_cache_clock = 0;
+__thread time_t log_cache_last_tick = 0;
+
+unsigned int log_cache_hash(const char *peer) {
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  while (*peer) {
+    h ^= (unsigned char) *peer++;
+    h *= 16777619u;
+  }
+  return h % LOG_CACHE_BUCKETS;
+}
 
-    fclose(stream_for_write);
-    fclose(stream_for_read);
-    return 0;
+void log_cache_init() {
+  log_cache = calloc(gLOG_CACHE_SIZE, sizeof(struct log_handle));
+  if (!log_cache) {
+    perror("log cache");
+    exit(1);
+  }
+  for (int i = 0; i < LOG_CACHE_BUCKETS; i++)
+    log_cache_buckets[i] = -1;
 }
 
-void copy_log_file_to_name(char* peer,char* name) {
+void log_handle_flush(struct log_handle *h) {
+  if (h->dirty) {
+    struct timespec t0;
+    metric_clock(&t0);
+    if (h->heap_fp)
+      fflush(h->heap_fp);
+    fflush(h->fp);
+    if (h->idx_fp)
+      fflush(h->idx_fp);
+    metric_write_since(&t0);
+    h->dirty = false;
+  }
+  h->last_flush = time(NULL);
+}
 
-  char fname[30];
-  int ret;
-  strcpy(fname, "0Logfile.");
-  strcpy(fname + 9, peer);
+// Close the cached file for slot i and unlink it from its hash chain.
+void log_cache_drop(int i) {
+  struct log_handle *h = &log_cache[i];
+  int *link = &log_cache_buckets[log_cache_hash(h->peer)];
+  while (*link != -1 && *link != i)
+    link = &log_cache[*link].next;
+  if (*link == i)
+    *link = h->next;
+  if (h->heap_fp)
+    fclose(h->heap_fp);
+  fclose(h->fp);
+  if (h->idx_fp)
+    fclose(h->idx_fp);
+  h->fp = NULL;
+  h->heap_fp = NULL;
+  h->idx_fp = NULL;
+  h->dirty = false;
+}
 
-  char cmd[256];
+// Close peer's files if we have them open, e.g. because they are about
+// to be renamed; the next event for the peer opens fresh ones.
+void log_cache_evict(char *peer) {
+  int i = log_cache_buckets[log_cache_hash(peer)];
+  while (i != -1) {
+    int next = log_cache[i].next;
+    if (strcmp(log_cache[i].peer, peer) == 0)
+      log_cache_drop(i);
+    i = next;
+  }
+}
 
-  sprintf(cmd,"mv %s %s",fname,name);
-  system(cmd);
-  fprintf(gFOUTPUT,"old name %s, new name %s",fname,name);
-  /* ret =   rename(fname,name); */
-  /* if(ret == 0) { */
-  /*     fprintf(gFOUTPUT,"File renamed successfully"); */
+void log_cache_flush_all() {
+  for (int i = 0; i < log_cache_used; i++)
+    if (log_cache[i].fp)
+      log_handle_flush(&log_cache[i]);
+}
 
-  /*  } else { */
-  /*     fprintf(gFOUTPUT, "Error: unable to rename the file"); */
-  /*  } */
-  //  copy_file(fname,name);
+// The cached handle for peer's stream, without opening anything.
+struct log_handle *log_cache_lookup(char *peer, uint8_t stream) {
+  for (int i = log_cache_buckets[log_cache_hash(peer)]; i != -1; i = log_cache[i].next)
+    if (log_cache[i].stream == stream && strcmp(log_cache[i].peer, peer) == 0)
+      return &log_cache[i];
+  return NULL;
 }
 
-void mark_minute_into_stream(uint32_t cur_ms, int fd, struct sockaddr_in *clientaddr, char *peer) {
-    // Here whenever a new minute ticks over we output a new Clock event
-    // I can
-    char iso_time_string[256];
-    time_t now;
-    time(&now);
+bool log_cache_dirty() {
+  for (int i = 0; i < log_cache_used; i++)
+    if (log_cache[i].dirty)
+      return true;
+  return false;
+}
 
-    HIGH_WATER_MARK_EPOCH_MS = (uint64_t) now*1000;
-    HIGH_WATER_MARK_MS = (uint64_t) cur_ms;
+void log_cache_close_all() {
+  for (int i = 0; i < log_cache_used; i++)
+    if (log_cache[i].fp)
+      log_cache_drop(i);
+}
 
-    struct tm *ptm = gmtime(&now);
+// Called once per received packet (or batch); applies the flush interval.
+void log_cache_tick() {
+  time_t now = time(NULL);
+  if (now == log_cache_last_tick)
+    return;
+  log_cache_last_tick = now;
+  rollup_tick(now);
+  for (int i = 0; i < log_cache_used; i++) {
+    struct log_handle *h = &log_cache[i];
+    if (h->fp && h->dirty && now - h->last_flush >= gFLUSH_INTERVAL)
+      log_handle_flush(h);
+  }
+}
 
-    if (ptm == NULL) {
-        puts("The gmtime() function failed");
+// Open peer's time index for appending (see pirds_store.h). A log that
+// already has lines but no index is left unindexed here: an index
+// started now would not cover the older lines. pirds_webcgi builds one
+// for such a log when it needs it, and we append to that from the next
+// time the log is opened.
+FILE *open_log_index(char *peer, off_t log_size, int64_t *last_sec) {
+  char fname[30];
+  struct stat st;
+  snprintf(fname, sizeof fname, "%s%s", INDEX_PREFIX, peer);
+  *last_sec = 0;
+  if (log_size == 0)
+    return fopen(fname, "w"); // a new log; anything there is stale
+  if (stat(fname, &st) != 0)
+    return NULL;
+  if (st.st_size >= (off_t) sizeof(struct log_index_entry)) {
+    FILE *fp = fopen(fname, "r");
+    struct log_index_entry e;
+    if (fp) {
+      off_t last = st.st_size - st.st_size % sizeof e - sizeof e;
+      if (fseeko(fp, last, SEEK_SET) == 0 && fread(&e, sizeof e, 1, fp) == 1)
+        *last_sec = e.epoch_s;
+      fclose(fp);
     }
-    sprintf(iso_time_string,"%s", asctime(ptm));
-    // remove traling newline
-    iso_time_string[strcspn(iso_time_string, "\n")] = 0;
-    //    unsigned long cur_ms = get_most_recent_ms(peer);
-    // This is a fake until I figure out how to get it out of the file!
-    Message clockEvent = {
-      'E','C',cur_ms,(uint8_t) strlen(iso_time_string)
-    };
-    strcpy(clockEvent.buff,iso_time_string);
-    uint8_t lbuffer[263];
-    fill_byte_buffer_message(&clockEvent,lbuffer,263);
-    handle_event(lbuffer, fd, clientaddr, peer, false);
+  }
+  return fopen(fname, "a");
 }
 
-uint32_t
-log_measurement_bytecode_from_measurement(char *peer, Measurement* measurement, bool limit) {
-
-  FILE *fp = open_log_file(peer);
-  if (!fp) return 0;
-
-  if (measurement->ms < HIGH_WATER_MARK_MS) {
-    fprintf(gFOUTPUT,"INTERNAL ERROR: HIGH_WATER_MARK_MS INCONSISTENT");
-  } else {
-    uint64_t displacement = (((uint64_t) measurement->ms) - HIGH_WATER_MARK_MS);
-    uint64_t ms = HIGH_WATER_MARK_EPOCH_MS +
-      (((uint64_t) measurement->ms) - HIGH_WATER_MARK_MS);
-
-    fprintf(fp, "%lu:%c:%c:%c:%u:%llu:%d\n", time(NULL),
-            measurement->event,
-            measurement->type, measurement->loc,
-            measurement->num, ms, measurement->val);
+// Called with each text line just before it is appended to h.
+void log_index_note(struct log_handle *h, const char *line) {
+  if (!h->idx_fp)
+    return;
+  int64_t sec = strtoll(line, NULL, 10);
+  if (sec > h->idx_last_sec) {
+    struct log_index_entry e = { sec, h->size };
+    fwrite(&e, sizeof e, 1, h->idx_fp);
+    h->idx_last_sec = sec;
   }
-  fclose(fp);
-  return measurement->ms;
 }
 
-uint32_t
-log_measurement_bytecode(char *peer, void *buff, bool limit) {
-  Measurement measurement = get_measurement_from_buffer(buff,13);
-  return log_measurement_bytecode_from_measurement(peer,&measurement,limit);
+// Rolling. The stream that decides when a peer's log is rolled is the
+// text log, or the segment if there is no text log; rolling moves all
+// of the peer's files (but not its rollups) into a new part.
+static inline uint8_t log_primary_stream() {
+  return (gSTORE & STORE_TEXT) ? LOG_TEXT : LOG_SEGMENT;
 }
 
-
-void get_timestamp( char *buffer, size_t buffersize ) {
-   time_t rawtime;
-   struct tm * timeinfo;
-   time (&rawtime);
-   timeinfo = localtime (&rawtime);
-   strftime (buffer,16,"%G%m%d%H%M%S",timeinfo);
-   puts(buffer);
+bool log_roll_due(struct log_handle *h) {
+  if (h->stream != log_primary_stream())
+    return false;
+  if (!h->started)
+    h->started = time(NULL); // a record is about to be appended
+  return (gROLL_BYTES && h->size >= gROLL_BYTES) ||
+    (gROLL_SECONDS && time(NULL) - h->started >= gROLL_SECONDS);
 }
 
-
-uint32_t
-log_event_bytecode_from_message(char *peer, Message* message, bool limit) {
-
-  int n = strlen(SAVE_LOG_TO_FILE);
-  if (strncmp(message->buff,SAVE_LOG_TO_FILE,n) == 0) {
-    char *name = message->buff+n;
-      char fname[256];
-      char cname[256];
-      strcpy(fname, "0Logfile.");
-      strcpy(fname + 9, peer);
-      strcpy(cname,fname);
-      strcpy(fname + strlen(fname),".");
-      strcpy(fname + strlen(fname),name);
-      strcpy(fname + strlen(fname),".");
-      get_timestamp(fname+strlen(fname),16);
-      copy_log_file_to_name(peer,fname);
-      //      remove(cname);
-  } else {
-    FILE *fp = open_log_file(peer);
-    if (!fp) return 0;
-
-    // Here we perform the HIGH_WATER_MARK_MATH
-    // Note: The second summand had better be positive..
-
-    if (message->ms < HIGH_WATER_MARK_MS) {
-      fprintf(gFOUTPUT,"INTERNAL ERROR: HIGH_WATER_MARK_MS INCONSISTENT");
+// The arrival and sample times of the first (or, with last, the last)
+// record of the log file fname, a segment or a text log; false if it
+// has none.
+bool log_record_times(const char *fname, uint8_t stream, bool last, int64_t *arrival, int64_t *ms) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool found = false;
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    if (stream == LOG_SEGMENT) {
+      struct segment_record r;
+      off_t n = (st.st_size - (off_t) SEGMENT_HEADER_SIZE) / (off_t) sizeof r;
+      off_t off = SEGMENT_HEADER_SIZE + (last ? n - 1 : 0) * sizeof r;
+      if (n > 0 && pread(fd, &r, sizeof r, off) == sizeof r) {
+        *arrival = r.arrival;
+        *ms = r.epoch_ms;
+        found = true;
+      }
     } else {
-      uint64_t ms = HIGH_WATER_MARK_EPOCH_MS +
-        (((uint64_t)message->ms) - HIGH_WATER_MARK_MS);
-
-      fprintf(fp, "%lu:%c:%c:%llu:\"%s\"\n",
-              time(NULL),
-              message->event,
-              message->type,
-              ms,
-              message->buff);
+      // Lines are short; the last one starts after the last newline but one.
+      char buf[2 * ONE_EVENT_BUFFER_SIZE + 1];
+      off_t want = sizeof buf - 1;
+      off_t off = last && st.st_size > want ? st.st_size - want : 0;
+      ssize_t n = pread(fd, buf, want, off);
+      if (n > 0) {
+        buf[n] = '\0';
+        char *p = buf;
+        if (last) {
+          char *end = buf + n - 1;  // the line's own newline
+          while (end > buf && end[-1] != '\n')
+            end--;
+          p = end;
+        }
+        // <arrival>:M:<type>:<loc>:<num>:<ms>:<val> or <arrival>:E:<type>:<ms>:"<text>"
+        char *f = strchr(p, ':');
+        int skip = f && f[1] == 'M' ? 4 : 2;
+        for (int k = 0; f && k < skip; k++)
+          f = strchr(f + 1, ':');
+        *arrival = strtoll(p, NULL, 10);
+        *ms = f ? strtoll(f + 1, NULL, 10) : 0;
+        found = *arrival != 0;
+      }
     }
-      fclose(fp);
   }
-  return message->ms;
+  close(fd);
+  return found;
 }
 
-uint32_t log_event_bytecode(char *peer, void *buff, bool limit) {
-  Message message = get_message_from_buffer(buff,263);
-  return log_event_bytecode_from_message(peer,&message,limit);
+// The arrival time of the first (or, with last, the last) record of
+// the primary log file fname; 0 if it has none.
+int64_t log_arrival(const char *fname, bool last) {
+  int64_t t = 0, ms;
+  log_record_times(fname, log_primary_stream(), last, &t, &ms);
+  return t;
 }
 
-void
-log_json(char *peer, void *buff) {
+// The files that make up a part.
+const char *part_prefixes[] = { "0Logfile.", INDEX_PREFIX, SEGMENT_PREFIX, HEAP_PREFIX };
+#define PART_FILES 4
+
+// How many records the log file fname has. Segments say so by their
+// size; a text log has to be read.
+int64_t log_record_count(const char *fname, uint8_t stream) {
+  struct stat st;
+  if (stream == LOG_SEGMENT)
+    return stat(fname, &st) == 0 && st.st_size > (off_t) SEGMENT_HEADER_SIZE ?
+      (st.st_size - SEGMENT_HEADER_SIZE) / sizeof(struct segment_record) : 0;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  static __thread char block[64 * 1024];
+  int64_t n = 0;
+  ssize_t len;
+  while ((len = read(fd, block, sizeof block)) > 0)
+    for (char *p = block; (p = memchr(p, '\n', block + len - p)); p++)
+      n++;
+  close(fd);
+  return n;
+}
 
-  FILE *fp = open_log_file(peer);
-  if (!fp) return;
+// The dataset catalog (see pirds_store.h). It is mapped for the life of
+// the logger, and a peer's slot is found once and kept in its
+// peer_state; after that, logging a record updates it in memory
+// without a system call. Slots are only added, under catalog_lock, and
+// each is written by the thread that logs to its peer, except for the
+// counts and first times, which log_roll also changes when it deletes
+// parts.
+struct catalog_header *catalog = NULL;
+struct catalog_entry *catalog_slots = NULL;
+int *catalog_buckets = NULL;  // name -> slot, chained through catalog_next
+int *catalog_next = NULL;
+#define CATALOG_BUCKETS 16384
+pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int catalog_hash(const char *name) {
+  unsigned int h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  return h & (CATALOG_BUCKETS - 1);
+}
 
+// The slot for dataset name, taking a new one if it has none; NULL if
+// the catalog is full (or there is none).
+struct catalog_entry *catalog_slot(const char *name) {
+  if (!catalog || strlen(name) >= PART_NAME_MAX)
+    return NULL;
+  struct catalog_entry *e = NULL;
+  unsigned int b = catalog_hash(name);
+  pthread_mutex_lock(&catalog_lock);
+  for (int i = catalog_buckets[b]; i != -1; i = catalog_next[i])
+    if (strcmp(catalog_slots[i].name, name) == 0) {
+      e = &catalog_slots[i];
+      break;
+    }
+  if (!e && catalog->count < catalog->slots) {
+    int i = catalog->count;
+    e = &catalog_slots[i];
+    memset(e, 0, sizeof *e);
+    strcpy(e->name, name);
+    catalog_next[i] = catalog_buckets[b];
+    catalog_buckets[b] = i;
+    // Readers only look at the first count slots.
+    __atomic_store_n(&catalog->count, i + 1, __ATOMIC_RELEASE);
+  } else if (!e && gDEBUG) {
+    diag_note(DIAG_PROBLEMS, 0, "catalog full, not listing %s\n", name);
+  }
+  pthread_mutex_unlock(&catalog_lock);
+  return e;
+}
+
+// Fill in a new slot for an existing dataset from its files: each of
+// its parts and then its current log.
+void catalog_seed(const char *name) {
+  struct catalog_entry *e = catalog_slot(name);
+  if (!e || e->records)
+    return;
+  char fname[256];
+  struct stat st;
+  snprintf(fname, sizeof fname, "0Logfile.%s", name);
+  uint8_t stream = stat(fname, &st) == 0 ? LOG_TEXT : LOG_SEGMENT;
+  const char *prefix = stream == LOG_TEXT ? "0Logfile." : SEGMENT_PREFIX;
+
+  struct log_part *parts;
+  snprintf(fname, sizeof fname, "%s%s", MANIFEST_PREFIX, name);
+  int nparts = manifest_read(fname, &parts);
+  int64_t arrival, ms;
+  for (int k = 0; k <= nparts; k++) {
+    if (k < nparts)
+      snprintf(fname, sizeof fname, "%s/%s%s", PARTS_DIR, prefix, parts[k].name);
+    else
+      snprintf(fname, sizeof fname, "%s%s", prefix, name);
+    int64_t n = log_record_count(fname, stream);
+    if (n == 0)
+      continue;
+    if (!e->records && log_record_times(fname, stream, false, &arrival, &ms)) {
+      e->first_arrival = arrival;
+      e->first_ms = ms;
+    }
+    if (log_record_times(fname, stream, true, &arrival, &ms)) {
+      e->last_arrival = arrival;
+      e->last_ms = ms;
+    }
+    e->records += n;
+    if (k < nparts)
+      e->bytes += parts[k].bytes;
+  }
+  free(parts);
+  for (int k = 0; k < PART_FILES; k++) {
+    snprintf(fname, sizeof fname, "%s%s", part_prefixes[k], name);
+    if (stat(fname, &st) == 0) {
+      e->bytes += st.st_size;
+      if (st.st_mtime > e->last_write)
+        e->last_write = st.st_mtime;
+    }
+  }
+}
+
+// Map the catalog, creating it (and listing the datasets already in the
+// directory in it) if there is none yet.
+void catalog_open() {
+  int fd = open(CATALOG_NAME, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(CATALOG_NAME);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  bool fresh = st.st_size == 0;
+  if (fresh && ftruncate(fd, CATALOG_SIZE(CATALOG_SLOTS)) != 0) {
+    perror(CATALOG_NAME);
+    close(fd);
+    return;
+  }
+  size_t size = fresh ? CATALOG_SIZE(CATALOG_SLOTS) : (size_t) st.st_size;
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap " CATALOG_NAME);
+    return;
+  }
+  struct catalog_header *h = p;
+  if (fresh)
+    catalog_header_init(h);
+  if (!catalog_header_ok(h) || size < CATALOG_SIZE(h->slots)) {
+    fprintf(stderr, "%s is not a catalog, or is damaged; remove it to rebuild it\n", CATALOG_NAME);
+    munmap(p, size);
+    return;
+  }
+  catalog_buckets = malloc(CATALOG_BUCKETS * sizeof(int));
+  catalog_next = malloc(h->slots * sizeof(int));
+  if (!catalog_buckets || !catalog_next) {
+    perror("catalog");
+    exit(1);
+  }
+  for (int b = 0; b < CATALOG_BUCKETS; b++)
+    catalog_buckets[b] = -1;
+  catalog_slots = (struct catalog_entry *) (h + 1);
+  for (uint32_t i = 0; i < h->count; i++) {
+    unsigned int b = catalog_hash(catalog_slots[i].name);
+    catalog_next[i] = catalog_buckets[b];
+    catalog_buckets[b] = i;
+  }
+  catalog = h;
+  if (!fresh)
+    return;
+  DIR *dir = opendir(".");
+  struct dirent *d;
+  while (dir && (d = readdir(dir))) {
+    if (strncmp(d->d_name, "0Logfile.", 9) == 0)
+      catalog_seed(d->d_name + 9);
+    else if (strncmp(d->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) == 0)
+      catalog_seed(d->d_name + strlen(SEGMENT_PREFIX));
+  }
+  if (dir)
+    closedir(dir);
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "catalog: listed %u existing datasets\n", catalog->count);
+}
+
+// ps's slot, looked for only once if there is none.
+struct catalog_entry *peer_catalog(struct peer_state *ps) {
+  if (!ps->catalog && !ps->uncataloged)
+    ps->uncataloged = !(ps->catalog = catalog_slot(ps->name));
+  return ps->catalog;
+}
+
+// A record with sample time ms, taking len bytes in the log(s), has
+// just been logged for ps.
+void catalog_note(struct peer_state *ps, int64_t ms, int len) {
+  if (!peer_catalog(ps))
+    return;
+  struct catalog_entry *e = ps->catalog;
+  time_t now = time(NULL);
+  if (__atomic_fetch_add(&e->records, 1, __ATOMIC_RELAXED) == 0) {
+    __atomic_store_n(&e->first_arrival, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->first_ms, ms, __ATOMIC_RELAXED);
+  }
+  e->last_write = e->last_arrival = now;
+  e->last_ms = ms;
+  __atomic_fetch_add(&e->bytes, len, __ATOMIC_RELAXED);
+}
+
+// ps's log is being saved as dataset name (SAVE_LOG_TO_FILE): its slot's
+// figures go to the new dataset, and it starts again from nothing.
+void catalog_save(struct peer_state *ps, const char *name) {
+  if (!peer_catalog(ps))
+    return;
+  struct catalog_entry *e = ps->catalog, *saved = catalog_slot(name);
+  if (saved) {
+    memcpy((char *) saved + PART_NAME_MAX, (char *) e + PART_NAME_MAX, sizeof *e - PART_NAME_MAX);
+    saved->last_write = time(NULL);
+  }
+  memset((char *) e + PART_NAME_MAX, 0, sizeof *e - PART_NAME_MAX);
+}
+
+// Take part, about to be deleted, off its dataset's catalog entry e;
+// next is the part after it, which will be the first, if any.
+void catalog_part_deleted(struct catalog_entry *e, const struct log_part *part,
+                          const struct log_part *next) {
+  char fname[256];
+  struct stat st;
+  uint8_t stream = LOG_SEGMENT;
+  snprintf(fname, sizeof fname, "%s/%s%s", PARTS_DIR, SEGMENT_PREFIX, part->name);
+  if (stat(fname, &st) != 0) {
+    stream = LOG_TEXT;
+    snprintf(fname, sizeof fname, "%s/0Logfile.%s", PARTS_DIR, part->name);
+  }
+  __atomic_fetch_sub(&e->records, log_record_count(fname, stream), __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&e->bytes, part->bytes, __ATOMIC_RELAXED);
+  int64_t arrival, ms;
+  if (next) {
+    snprintf(fname, sizeof fname, "%s/%s%s", PARTS_DIR,
+             stream == LOG_SEGMENT ? SEGMENT_PREFIX : "0Logfile.", next->name);
+    if (log_record_times(fname, stream, false, &arrival, &ms)) {
+      __atomic_store_n(&e->first_arrival, arrival, __ATOMIC_RELAXED);
+      __atomic_store_n(&e->first_ms, ms, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Delete a part's files.
+void log_part_delete(const struct log_part *part) {
+  char fname[256];
+  for (int k = 0; k < PART_FILES; k++) {
+    snprintf(fname, sizeof fname, "%s/%s%s", PARTS_DIR, part_prefixes[k], part->name);
+    unlink(fname);
+  }
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "retention: deleted part %s\n", part->name);
+}
+
+// Move peer's current files into a new part, add it to the manifest and
+// apply the retention limits to the parts.
+void log_roll(char *peer) {
+  char fname[256], to[256];
+  // Nothing we still hold may refer to the files we move.
+  if (uring_active)
+    uring_submit_writes();
+  log_cache_evict(peer);
+
+  struct log_part part;
+  snprintf(fname, sizeof fname, "%s%s",
+           log_primary_stream() == LOG_TEXT ? "0Logfile." : SEGMENT_PREFIX, peer);
+  part.first = log_arrival(fname, false);
+  part.last = log_arrival(fname, true);
+  part.bytes = 0;
+  snprintf(part.name, sizeof part.name, "%s.%lld", peer, (long long) part.first);
+  mkdir(PARTS_DIR, 0755);
+  // Two parts can start in the same second if they are small enough.
+  struct stat st;
+  for (int k = 1; ; k++) {
+    bool taken = false;
+    for (int f = 0; f < PART_FILES; f++) {
+      snprintf(to, sizeof to, "%s/%s%s", PARTS_DIR, part_prefixes[f], part.name);
+      taken |= stat(to, &st) == 0;
+    }
+    if (!taken)
+      break;
+    snprintf(part.name, sizeof part.name, "%s.%lld-%d", peer, (long long) part.first, k);
+  }
+  for (int k = 0; k < PART_FILES; k++) {
+    snprintf(fname, sizeof fname, "%s%s", part_prefixes[k], peer);
+    snprintf(to, sizeof to, "%s/%s%s", PARTS_DIR, part_prefixes[k], part.name);
+    if (stat(fname, &st) == 0 && rename(fname, to) == 0)
+      part.bytes += st.st_size;
+  }
+
+  struct log_part *parts;
+  char manifest[64];
+  snprintf(manifest, sizeof manifest, "%s%s", MANIFEST_PREFIX, peer);
+  int n = manifest_read(manifest, &parts);
+  struct log_part *np = realloc(parts, (n + 1) * sizeof *parts);
+  if (!np) {
+    free(parts);
+    return;
+  }
+  parts = np;
+  parts[n++] = part;
+  // Retention: drop the oldest parts while they are over the limits.
+  int64_t total = 0;
+  for (int k = 0; k < n; k++)
+    total += parts[k].bytes;
+  time_t now = time(NULL);
+  int drop = 0;
+  struct catalog_entry *e = NULL;
+  while (drop < n &&
+         ((gKEEP_BYTES && total > gKEEP_BYTES) ||
+          (gKEEP_SECONDS && parts[drop].last < now - gKEEP_SECONDS))) {
+    if (e || (e = catalog_slot(peer)))
+      catalog_part_deleted(e, &parts[drop], drop + 1 < n ? &parts[drop + 1] : NULL);
+    log_part_delete(&parts[drop]);
+    total -= parts[drop].bytes;
+    drop++;
+  }
+  char tmp[80];
+  snprintf(tmp, sizeof tmp, "%s.tmp", manifest);
+  FILE *fp = fopen(tmp, "w");
+  if (fp) {
+    for (int k = drop; k < n; k++)
+      fprintf(fp, "%s %lld %lld %lld\n", parts[k].name, (long long) parts[k].first,
+              (long long) parts[k].last, (long long) parts[k].bytes);
+    if (fclose(fp) == 0)
+      rename(tmp, manifest);
+  }
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "rolled %s into part %s (%lld bytes, %d parts kept)\n",
+            peer, part.name, (long long) part.bytes, n - drop);
+  free(parts);
+}
+
+struct log_handle* open_log_file(char *peer, uint8_t stream) {
+  // xxx need file locking
+  unsigned int b = log_cache_hash(peer);
+  for (int i = log_cache_buckets[b]; i != -1; i = log_cache[i].next) {
+    if (log_cache[i].stream == stream && strcmp(log_cache[i].peer, peer) == 0) {
+      log_cache[i].last_used = ++log_cache_clock;
+      if (!(gROLL_BYTES || gROLL_SECONDS) || !log_roll_due(&log_cache[i]))
+        return &log_cache[i];
+      log_roll(peer);
+      break;
+    }
+  }
+
+  char fname[30];
+  FILE *heap_fp = NULL;
+  struct stat st;
+  off_t heap_size = 0;
+  if (stream == LOG_SEGMENT) {
+    snprintf(fname, sizeof fname, "%s%s", HEAP_PREFIX, peer);
+    heap_fp = fopen(fname, "a");
+    if (!heap_fp) return NULL;
+    if (fstat(fileno(heap_fp), &st) == 0)
+      heap_size = st.st_size;
+    snprintf(fname, sizeof fname, "%s%s", SEGMENT_PREFIX, peer);
+  } else if (stream >= LOG_ROLLUP) {
+    snprintf(fname, sizeof fname, "%s%s", rollup_tiers[stream - LOG_ROLLUP].prefix, peer);
+  } else {
+    strcpy(fname, "0Logfile.");
+    strcpy(fname + 9, peer);
+  }
+
+  FILE *fp = fopen(fname, "a");
+  if (!fp) {
+    if (heap_fp) fclose(heap_fp);
+    return NULL;
+  }
+  off_t size = 0;
+  if (fstat(fileno(fp), &st) == 0)
+    size = st.st_size;
+  if (stream == LOG_SEGMENT && size == 0) {
+    struct segment_header hdr;
+    segment_header_init(&hdr);
+    fwrite(&hdr, sizeof hdr, 1, fp);
+    fflush(fp);
+    size = sizeof hdr;
+  }
+  if (stream >= LOG_ROLLUP && size == 0) {
+    struct segment_header hdr;
+    rollup_header_init(&hdr);
+    fwrite(&hdr, sizeof hdr, 1, fp);
+    fflush(fp);
+    size = sizeof hdr;
+  }
+  FILE *idx_fp = NULL;
+  int64_t idx_last_sec = 0;
+  if (stream == LOG_TEXT)
+    idx_fp = open_log_index(peer, size, &idx_last_sec);
+
+  // Take a free slot, or close the least recently used file.
+  int slot = -1;
+  for (int i = 0; i < log_cache_used; i++) {
+    if (!log_cache[i].fp) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1 && log_cache_used < gLOG_CACHE_SIZE)
+    slot = log_cache_used++;
+  if (slot == -1) {
+    slot = 0;
+    for (int i = 1; i < log_cache_used; i++)
+      if (log_cache[i].last_used < log_cache[slot].last_used)
+        slot = i;
+    if (gDEBUG > 1)
+      fprintf(gFOUTPUT, "log cache full, closing %s\n", log_cache[slot].peer);
+    log_cache_drop(slot);
+  }
+
+  struct log_handle *h = &log_cache[slot];
+  strcpy(h->peer, peer);
+  h->stream = stream;
+  h->fp = fp;
+  h->heap_fp = heap_fp;
+  h->idx_fp = idx_fp;
+  h->size = size;
+  h->heap_size = heap_size;
+  h->idx_last_sec = idx_last_sec;
+  h->started = 0;
+  if (stream == log_primary_stream() && size > (stream == LOG_SEGMENT ? (off_t) SEGMENT_HEADER_SIZE : 0))
+    h->started = log_arrival(fname, false);
+  h->dirty = false;
+  h->last_used = ++log_cache_clock;
+  h->last_flush = time(NULL);
+  h->next = log_cache_buckets[b];
+  log_cache_buckets[b] = slot;
+  if ((gROLL_BYTES || gROLL_SECONDS) && log_roll_due(h)) {
+    log_roll(peer);
+    return open_log_file(peer, stream);
+  }
+  return h;
+}
+
+// For a LOG_SEGMENT line about to be appended to h: point the record
+// at the end of the heap, account for both parts, and describe them in
+// *rec and *heap (heap->iov_len is 0 for a measurement).
+void segment_split(struct log_handle *h, char *data, int len, struct iovec *rec, struct iovec *heap) {
+  struct segment_record *r = (struct segment_record *) data;
+  rec->iov_base = data;
+  rec->iov_len = sizeof *r;
+  heap->iov_base = data + sizeof *r;
+  heap->iov_len = len - sizeof *r;
+  if (heap->iov_len > 0) {
+    r->heap_off = h->heap_size;
+    h->heap_size += heap->iov_len;
+  }
+  h->size += sizeof *r;
+}
+
+// Called after writing a record to h.
+void release_log_file(struct log_handle *h) {
+  h->dirty = true;
+  if (gFLUSH_INTERVAL == 0)
+    log_handle_flush(h);
+}
+
+// A single-producer single-consumer ring of fixed size slots. The
+// producer fills the slot returned by ring_reserve() and publishes it
+// with ring_commit(); the consumer looks at committed slots with
+// ring_peek() and hands them back with ring_release(). No locks: head
+// is only written by the producer and tail only by the consumer.
+struct spsc_ring {
+  _Atomic size_t head;
+  char pad1[64];
+  _Atomic size_t tail;
+  char pad2[64];
+  size_t mask;               // capacity - 1, capacity a power of two
+  size_t slot_size;
+  uint8_t *slots;
+};
+
+struct spsc_ring *ring_create(size_t capacity, size_t slot_size) {
+  struct spsc_ring *r = calloc(1, sizeof *r);
+  if (!r) return NULL;
+  r->slots = malloc(capacity * slot_size);
+  if (!r->slots) {
+    free(r);
+    return NULL;
+  }
+  r->mask = capacity - 1;
+  r->slot_size = slot_size;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  return r;
+}
+
+void *ring_reserve(struct spsc_ring *r) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail > r->mask)
+    return NULL;             // full
+  return r->slots + (head & r->mask) * r->slot_size;
+}
+
+void ring_commit(struct spsc_ring *r) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+size_t ring_available(struct spsc_ring *r) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  return head - tail;
+}
+
+void *ring_peek(struct spsc_ring *r, size_t k) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  return r->slots + ((tail + k) & r->mask) * r->slot_size;
+}
+
+void ring_release(struct spsc_ring *r, size_t n) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+}
+
+// The asynchronous writer. Every receive thread has its own ring of
+// log records; the writer thread drains all of them, groups each batch
+// by peer and appends each peer's records with one writev(). A full
+// ring makes the receive thread wait for the writer (it is counted as
+// a stall) rather than lose data.
+#define LOG_LINE_MAX (ONE_EVENT_BUFFER_SIZE + 64)
+#define LOG_RING_SIZE 4096   // records per receive thread
+#define WRITER_BATCH 512     // records taken from one ring at a time
+#define WRITER_STATS_INTERVAL 10 // seconds between debug reports
+
+enum { LOG_RECORD_LINE, LOG_RECORD_SAVE };
+
+struct log_record {
+  uint8_t kind;
+  uint8_t stream;            // LOG_TEXT or LOG_SEGMENT
+  char peer[INET6_ADDRSTRLEN];
+  uint16_t len;
+  char data[LOG_LINE_MAX];   // the line, or the new name for LOG_RECORD_SAVE
+};
+
+struct spsc_ring *writer_rings[MAX_WORKERS];
+_Atomic int writer_nrings = 0;
+_Atomic bool writer_stopping = false;
+pthread_t writer_thread;
+__thread struct spsc_ring *log_ring = NULL;
+
+// Writer statistics, reported in debug output.
+struct writer_stats {
+  unsigned long batches;
+  unsigned long records;
+  unsigned long writes;
+  size_t max_depth;          // deepest ring seen when draining
+  size_t max_batch;
+  double write_us;           // total time spent in writev
+  double max_write_us;
+};
+struct writer_stats wstats;
+_Atomic unsigned long writer_stalls = 0; // times a receive thread found its ring full
+
+void writer_register() {
+  log_ring = ring_create(LOG_RING_SIZE, sizeof(struct log_record));
+  if (!log_ring) {
+    perror("log ring");
+    exit(1);
+  }
+  int i = atomic_fetch_add(&writer_nrings, 1);
+  writer_rings[i] = log_ring;
+}
+
+// Queue a record for the writer, waiting for room if the ring is full.
+struct log_record *writer_reserve() {
+  struct log_record *rec = ring_reserve(log_ring);
+  if (!rec) {
+    atomic_fetch_add_explicit(&writer_stalls, 1, memory_order_relaxed);
+    while (!(rec = ring_reserve(log_ring)))
+      sched_yield();
+  }
+  return rec;
+}
+
+void copy_log_file_to_name(char* peer,char* name);
+
+void writev_all(char *peer, int fd, struct iovec *iov, int n) {
+  for (int done = 0; done < n; done += IOV_MAX) {
+    int k = n - done < IOV_MAX ? n - done : IOV_MAX;
+    if (writev(fd, iov + done, k) < 0 && gDEBUG)
+      fprintf(gFOUTPUT, "writev %s: %s\n", peer, strerror(errno));
+  }
+}
+
+// Append n lines to peer's log with as few writev() calls as possible.
+void writer_write(char *peer, uint8_t stream, struct iovec *iov, int n) {
+  if (n == 0)
+    return;
+  struct log_handle *h = open_log_file(peer, stream);
+  if (!h)
+    return;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  // Nothing is ever buffered in h->fp here, but keep stdio honest.
+  fflush(h->fp);
+  if (stream == LOG_SEGMENT) {
+    struct iovec recs[n], heap[n];
+    int nheap = 0;
+    fflush(h->heap_fp);
+    for (int k = 0; k < n; k++) {
+      segment_split(h, iov[k].iov_base, iov[k].iov_len, &recs[k], &heap[nheap]);
+      if (heap[nheap].iov_len > 0)
+        nheap++;
+    }
+    writev_all(peer, fileno(h->heap_fp), heap, nheap);
+    writev_all(peer, fileno(h->fp), recs, n);
+  } else {
+    for (int k = 0; k < n; k++) {
+      log_index_note(h, iov[k].iov_base);
+      h->size += iov[k].iov_len;
+    }
+    if (h->idx_fp)
+      fflush(h->idx_fp);
+    writev_all(peer, fileno(h->fp), iov, n);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+  metric_write_ns(us * 1000);
+  wstats.writes++;
+  wstats.write_us += us;
+  if (us > wstats.max_write_us)
+    wstats.max_write_us = us;
+}
+
+// Write up to WRITER_BATCH records from one ring; returns how many.
+// The batch is grouped by peer with a stable counting sort, so each
+// peer's records keep their order and go out in one writev().
+size_t writer_drain(struct spsc_ring *r) {
+  static char *group_peer[WRITER_BATCH];
+  static uint8_t group_stream[WRITER_BATCH];
+  static int group_count[WRITER_BATCH + 1];
+  static int group_of[WRITER_BATCH];
+  static struct iovec iov[WRITER_BATCH];
+
+  size_t avail = ring_available(r);
+  if (avail == 0)
+    return 0;
+  if (avail > wstats.max_depth)
+    wstats.max_depth = avail;
+  size_t n = avail < WRITER_BATCH ? avail : WRITER_BATCH;
+
+  // A save (rename) must see every earlier record of the batch written
+  // first, so the batch is cut just after the first save record.
+  size_t lines = n;
+  for (size_t k = 0; k < n; k++) {
+    struct log_record *rec = ring_peek(r, k);
+    if (rec->kind == LOG_RECORD_SAVE) {
+      lines = k;
+      n = k + 1;
+      break;
+    }
+  }
+
+  int ngroups = 0;
+  for (size_t k = 0; k < lines; k++) {
+    struct log_record *rec = ring_peek(r, k);
+    int j;
+    for (j = 0; j < ngroups; j++)
+      if (group_stream[j] == rec->stream && strcmp(group_peer[j], rec->peer) == 0)
+        break;
+    if (j == ngroups) {
+      group_peer[ngroups] = rec->peer;
+      group_stream[ngroups] = rec->stream;
+      group_count[ngroups] = 0;
+      ngroups++;
+    }
+    group_of[k] = j;
+    group_count[j]++;
+  }
+  // group_count[j] becomes the start of group j in iov[]
+  int start = 0;
+  for (int j = 0; j < ngroups; j++) {
+    int c = group_count[j];
+    group_count[j] = start;
+    start += c;
+  }
+  group_count[ngroups] = start;
+  int fill[WRITER_BATCH];
+  memcpy(fill, group_count, ngroups * sizeof(int));
+  for (size_t k = 0; k < lines; k++) {
+    struct log_record *rec = ring_peek(r, k);
+    struct iovec *v = &iov[fill[group_of[k]]++];
+    v->iov_base = rec->data;
+    v->iov_len = rec->len;
+  }
+  for (int j = 0; j < ngroups; j++)
+    writer_write(group_peer[j], group_stream[j], iov + group_count[j], group_count[j+1] - group_count[j]);
+
+  if (n > lines) {
+    struct log_record *rec = ring_peek(r, lines);
+    log_cache_evict(rec->peer);
+    copy_log_file_to_name(rec->peer, rec->data);
+  }
+  ring_release(r, n);
+
+  wstats.batches++;
+  wstats.records += n;
+  if (n > wstats.max_batch)
+    wstats.max_batch = n;
+  return n;
+}
+
+void writer_report() {
+  fprintf(gFOUTPUT, "writer: %lu records in %lu batches (avg %.1f, max %zu), "
+          "max queue depth %zu, %lu writes avg %.1f us max %.1f us, %lu stalls\n",
+          wstats.records, wstats.batches,
+          wstats.batches ? (double) wstats.records / wstats.batches : 0.0,
+          wstats.max_batch, wstats.max_depth, wstats.writes,
+          wstats.writes ? wstats.write_us / wstats.writes : 0.0,
+          wstats.max_write_us, atomic_load(&writer_stalls));
+  wstats.max_depth = 0;
+  wstats.max_batch = 0;
+  wstats.max_write_us = 0;
+}
+
+void *writer_main(void *arg) {
+  log_cache_init();
+  if (gMETRICS_FILE)
+    metrics_register(NULL, NULL);
+  time_t last_report = time(NULL);
+  while (1) {
+    bool stopping = atomic_load(&writer_stopping);
+    size_t written = 0;
+    int nrings = atomic_load(&writer_nrings);
+    for (int i = 0; i < nrings; i++)
+      written += writer_drain(writer_rings[i]);
+    if (written == 0) {
+      if (stopping)
+        break;
+      struct timespec ts = {0, 1000000}; // 1 ms
+      nanosleep(&ts, NULL);
+    }
+    time_t now = time(NULL);
+    if (gDEBUG && now - last_report >= WRITER_STATS_INTERVAL) {
+      writer_report();
+      last_report = now;
+    }
+  }
+  log_cache_close_all();
+  if (gDEBUG)
+    writer_report();
+  return NULL;
+}
+
+void writer_start() {
+  if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+    perror("pthread_create writer");
+    exit(1);
+  }
+}
+
+// Called once the receive threads are done; the writer drains the rings and exits.
+void writer_stop() {
+  atomic_store(&writer_stopping, true);
+  pthread_join(writer_thread, NULL);
+}
+
+// Diagnostics. The receive path reports every packet and event (with
+// the default debug level); by default that is printed at once, but
+// with -A it is queued instead: each receive thread puts fixed size
+// entries on a ring of its own, and a diagnostics thread formats and
+// prints them, so the receive threads never wait on stdio. Routine
+// entries are sampled a packet at a time (-A N keeps 1 packet in N with
+// everything it logs), each category is limited to so many entries a
+// second per thread, and when a ring is full the entry is dropped and
+// counted. Problems (invalid packets and the like) are never sampled.
+#define DIAG_RING_SIZE 4096     // entries per receive thread
+#define DIAG_TEXT_MAX 160
+#define DIAG_REPORT_INTERVAL 10 // seconds between reports of dropped entries
+
+// The categories are declared at the top.
+static const int diag_rate[DIAG_CATEGORIES] = { 2000, 200, 100 }; // per second per thread
+
+enum {
+  DIAG_ARRIVAL,              // a datagram: peer, n[0] bytes
+  DIAG_TCP_READ,             // a read from a connection: peer, n[0] bytes
+  DIAG_MEASUREMENT,          // m, printed as print_measurement does
+  DIAG_MESSAGE,              // text, printed as print_message does
+  DIAG_NOTE,                 // text, printed with the format note (see diag_note)
+  DIAG_PEER_NOTE,            // n[], printed with the format note after (peer)
+  DIAG_BATCH,                // a batch of n[0] events, malformed unless n[1]
+  DIAG_RECVMMSG,             // n[0] packets from one call, n[1] in n[2] calls so far
+  DIAG_URING,                // n[0] packets from one wakeup, n[1] in n[2] enters so far
+};
+
+struct diag_entry {
+  uint8_t kind;
+  bool limit;                // DIAG_MEASUREMENT
+  time_t when;               // for a time stamp, if not 0
+  int64_t n[3];
+  const char *note;          // DIAG_NOTE, DIAG_PEER_NOTE: a string literal
+  char peer[INET6_ADDRSTRLEN];
+  union {
+    Measurement m;
+    char text[DIAG_TEXT_MAX];
+  };
+};
+
+struct spsc_ring *diag_rings[MAX_WORKERS];
+_Atomic int diag_nrings = 0;
+_Atomic bool diag_stopping = false;
+_Atomic unsigned long diag_dropped = 0;  // the ring was full
+_Atomic unsigned long diag_limited = 0;  // over the rate limit
+pthread_t diag_thread;
+__thread struct spsc_ring *diag_ring = NULL;
+__thread struct diag_entry diag_scratch;
+struct diag_category_state {
+  unsigned long seen;        // packets, for sampling
+  bool keep;                 // whether the current packet is sampled in
+  time_t second;
+  int count;                 // entries in that second
+};
+__thread struct diag_category_state diag_state[DIAG_CATEGORIES];
+
+void print_message(Message message,bool limit);
+void print_measurement(Measurement* measurement,bool limit);
+
+void diag_stamp(time_t when) {
+  struct tm *tm = localtime(&when);
+  fprintf(gFOUTPUT, "%d%02d%02d %02d:%02d:%02d ", tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+}
+
+void diag_print(struct diag_entry *e) {
+  if (e->when)
+    diag_stamp(e->when);
+  switch (e->kind) {
+  case DIAG_ARRIVAL:
+    fprintf(gFOUTPUT, "(%s) len: [%d]\n", e->peer, (int) e->n[0]);
+    break;
+  case DIAG_TCP_READ:
+    fprintf(gFOUTPUT, "(%s) \x1b[32m + [%d]\x1b[0m\n", e->peer, (int) e->n[0]);
+    break;
+  case DIAG_MEASUREMENT:
+    print_measurement(&e->m, e->limit);
+    break;
+  case DIAG_MESSAGE: {
+    Message message;
+    strcpy(message.buff, e->text);
+    print_message(message, true);
+    break;
+  }
+  case DIAG_NOTE:
+    fprintf(gFOUTPUT, e->note, e->text);
+    break;
+  case DIAG_PEER_NOTE:
+    if (e->peer[0])
+      fprintf(gFOUTPUT, "(%s) ", e->peer);
+    fprintf(gFOUTPUT, e->note, (int) e->n[0], (int) e->n[1], (int) e->n[2]);
+    break;
+  case DIAG_BATCH:
+    fprintf(gFOUTPUT, "  Batch of %d events%s\n", (int) e->n[0], e->n[1] ? "" : ", malformed");
+    break;
+  case DIAG_RECVMMSG:
+    fprintf(gFOUTPUT, "batch: %d packets/syscall (avg %.2f over %lu syscalls)\n",
+            (int) e->n[0], (double) e->n[1] / e->n[2], (unsigned long) e->n[2]);
+    break;
+  case DIAG_URING:
+    fprintf(gFOUTPUT, "io_uring: %lu packets this wakeup, %.2f packets/enter\n",
+            (unsigned long) e->n[0], (double) e->n[1] / e->n[2]);
+    break;
+  }
+}
+
+void diag_register() {
+  diag_ring = ring_create(DIAG_RING_SIZE, sizeof(struct diag_entry));
+  if (!diag_ring) {
+    perror("diag ring");
+    exit(1);
+  }
+  int i = atomic_fetch_add(&diag_nrings, 1);
+  diag_rings[i] = diag_ring;
+}
+
+// An entry to fill in and hand to diag_commit, or NULL if it is not
+// wanted. A DIAG_ARRIVAL or DIAG_TCP_READ starts a packet, and decides
+// for the packet's other routine entries whether they are kept.
+struct diag_entry *diag_begin(int category, uint8_t kind) {
+  // Threads other than the receive threads print at once.
+  if (!gDIAG_SAMPLE || !diag_ring)
+    return &diag_scratch;
+  struct diag_category_state *st = &diag_state[category];
+  bool starts = kind == DIAG_ARRIVAL || kind == DIAG_TCP_READ || category == DIAG_STATS;
+  if (category != DIAG_PROBLEMS) {
+    if (starts)
+      st->keep = st->seen++ % gDIAG_SAMPLE == 0;
+    if (!st->keep)
+      return NULL;
+  }
+  time_t now = time(NULL);
+  if (now != st->second) {
+    st->second = now;
+    st->count = 0;
+  }
+  if (st->count >= diag_rate[category]) {
+    atomic_fetch_add_explicit(&diag_limited, 1, memory_order_relaxed);
+    if (starts)
+      st->keep = false;      // nor the rest of the packet
+    return NULL;
+  }
+  st->count++;
+  struct diag_entry *e = ring_reserve(diag_ring);
+  if (!e)
+    atomic_fetch_add_explicit(&diag_dropped, 1, memory_order_relaxed);
+  return e;
+}
+
+void diag_commit(struct diag_entry *e) {
+  if (e == &diag_scratch) {
+    diag_print(e);
+    return;
+  }
+  ring_commit(diag_ring);
+}
+
+void diag_arrival(uint8_t kind, const char *peer, int len, time_t now) {
+  struct diag_entry *e = diag_begin(DIAG_PACKETS, kind);
+  if (!e) return;
+  e->kind = kind;
+  e->when = now;
+  e->n[0] = len;
+  strcpy(e->peer, peer);
+  diag_commit(e);
+}
+
+void diag_measurement(Measurement *m, bool limit) {
+  struct diag_entry *e = diag_begin(DIAG_PACKETS, DIAG_MEASUREMENT);
+  if (!e) return;
+  e->kind = DIAG_MEASUREMENT;
+  e->when = 0;
+  e->m = *m;
+  e->limit = limit;
+  diag_commit(e);
+}
+
+void diag_message(const char *text) {
+  struct diag_entry *e = diag_begin(DIAG_PACKETS, DIAG_MESSAGE);
+  if (!e) return;
+  e->kind = DIAG_MESSAGE;
+  e->when = 0;
+  snprintf(e->text, sizeof e->text, "%s", text);
+  diag_commit(e);
+}
+
+// note is a string literal with at most one %s, for (up to
+// DIAG_TEXT_MAX - 1 bytes of) text, which may be NULL if there is none.
+void diag_note(int category, time_t when, const char *note, const char *text) {
+  struct diag_entry *e = diag_begin(category, DIAG_NOTE);
+  if (!e) return;
+  e->kind = DIAG_NOTE;
+  e->when = when;
+  e->note = note;
+  snprintf(e->text, sizeof e->text, "%s", text ? text : "");
+  diag_commit(e);
+}
+
+// note is a string literal with up to three int conversions (%d, %c),
+// for a, b and c; it follows (peer) unless peer is NULL.
+void diag_peer_note(int category, time_t when, const char *peer, const char *note,
+                    int a, int b, int c) {
+  struct diag_entry *e = diag_begin(category, DIAG_PEER_NOTE);
+  if (!e) return;
+  e->kind = DIAG_PEER_NOTE;
+  e->when = when;
+  e->note = note;
+  snprintf(e->peer, sizeof e->peer, "%s", peer ? peer : "");
+  e->n[0] = a;
+  e->n[1] = b;
+  e->n[2] = c;
+  diag_commit(e);
+}
+
+void diag_numbers(int category, uint8_t kind, int64_t a, int64_t b, int64_t c) {
+  struct diag_entry *e = diag_begin(category, kind);
+  if (!e) return;
+  e->kind = kind;
+  e->when = 0;
+  e->n[0] = a;
+  e->n[1] = b;
+  e->n[2] = c;
+  diag_commit(e);
+}
+
+void *diag_main(void *arg) {
+  time_t last_report = time(NULL);
+  unsigned long dropped = 0, limited = 0;
+  while (1) {
+    bool stopping = atomic_load(&diag_stopping);
+    size_t printed = 0;
+    int nrings = atomic_load(&diag_nrings);
+    for (int i = 0; i < nrings; i++) {
+      size_t n = ring_available(diag_rings[i]);
+      for (size_t k = 0; k < n; k++)
+        diag_print(ring_peek(diag_rings[i], k));
+      ring_release(diag_rings[i], n);
+      printed += n;
+    }
+    time_t now = time(NULL);
+    if (now - last_report >= DIAG_REPORT_INTERVAL || (stopping && !printed)) {
+      unsigned long d = atomic_load(&diag_dropped), l = atomic_load(&diag_limited);
+      if (d != dropped || l != limited)
+        fprintf(gFOUTPUT, "diag: %lu entries dropped (ring full), %lu over the rate limit\n",
+                d - dropped, l - limited);
+      dropped = d;
+      limited = l;
+      last_report = now;
+    }
+    if (printed) {
+      fflush(gFOUTPUT);
+    } else {
+      if (stopping)
+        break;
+      struct timespec ts = {0, 10000000}; // 10 ms
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+void diag_start() {
+  if (pthread_create(&diag_thread, NULL, diag_main, NULL) != 0) {
+    perror("pthread_create diag");
+    exit(1);
+  }
+}
+
+// Called once the receive threads are done.
+void diag_stop() {
+  atomic_store(&diag_stopping, true);
+  pthread_join(diag_thread, NULL);
+}
+
+// The metrics file. Every METRICS_INTERVAL seconds, and when the logger
+// stops, the metrics thread adds up the counters of every thread and
+// peer (see metric_count) and writes them in the Prometheus text format
+// to FILE.tmp, which it then renames to FILE, so a reader (such as
+// node_exporter's textfile collector) never sees half a file.
+#define METRICS_INTERVAL 5 // seconds
+
+static const struct {
+  const char *name;
+  const char *help;
+} metric_info[METRIC_COUNTS] = {
+  { "packets_total", "Datagrams, or TCP reads, received." },
+  { "received_bytes_total", "Bytes received." },
+  { "events_total", "Events logged." },
+  { "parse_failures_total", "Packets and events that were malformed or of an unknown kind." },
+  { "high_water_mark_inconsistent_total", "Events dropped as HIGH_WATER_MARK_MS INCONSISTENT." },
+  { "timebase_resets_total", "Times a device's clock went back and its high water mark was reset." },
+  { "acks_total", "Replies sent." },
+};
+
+struct metrics_peer_total {
+  char name[INET6_ADDRSTRLEN];
+  uint64_t counts[METRIC_COUNTS];
+};
+
+_Atomic bool metrics_stopping = false;
+pthread_t metrics_thread;
+
+int metrics_peer_cmp(const void *a, const void *b) {
+  return strcmp(((const struct metrics_peer_total *) a)->name,
+                ((const struct metrics_peer_total *) b)->name);
+}
+
+// Copy the peers of thread m that are in use to *peers, growing it as
+// needed; returns the new number of them.
+int metrics_collect_peers(struct metrics *m, struct metrics_peer_total **peers, int n, int *cap) {
+  for (int i = 0; i < gMAX_PEERS; i++) {
+    unsigned seq = atomic_load_explicit(&m->peer_seq[i], memory_order_acquire);
+    struct peer_state *ps = &m->peers[i];
+    if (seq & 1 || !ps->name[0])
+      continue;
+    if (n == *cap) {
+      *cap = *cap ? 2 * *cap : 1024;
+      struct metrics_peer_total *np = realloc(*peers, *cap * sizeof **peers);
+      if (!np)
+        return n;
+      *peers = np;
+    }
+    struct metrics_peer_total *t = &(*peers)[n];
+    memcpy(t->name, ps->name, sizeof t->name);
+    t->name[sizeof t->name - 1] = '\0';
+    for (int k = 0; k < METRIC_COUNTS; k++)
+      t->counts[k] = atomic_load_explicit(&ps->counts[k], memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    // Skip it if it changed hands meanwhile; it is counted next time.
+    if (atomic_load_explicit(&m->peer_seq[i], memory_order_relaxed) == seq)
+      n++;
+  }
+  return n;
+}
+
+void metrics_header(FILE *fp, const char *name, const char *help, const char *type) {
+  fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write() {
+  uint64_t counts[METRIC_COUNTS] = {0};
+  uint64_t events[sizeof METRIC_EVENT_KINDS - 1][128] = {{0}};
+  uint64_t writes[METRIC_LATENCY_BUCKETS + 1] = {0};
+  uint64_t write_ns = 0;
+  struct metrics_peer_total *peers = NULL;
+  int npeers = 0, cap = 0;
+
+  int nthreads = atomic_load(&metrics_nthreads);
+  for (int i = 0; i < nthreads; i++) {
+    struct metrics *m = metrics_threads[i];
+    if (!m)
+      continue;
+    for (int k = 0; k < METRIC_COUNTS; k++)
+      counts[k] += atomic_load_explicit(&m->counts[k], memory_order_relaxed);
+    for (int e = 0; e < (int) sizeof METRIC_EVENT_KINDS - 1; e++)
+      for (int t = 0; t < 128; t++)
+        events[e][t] += atomic_load_explicit(&m->events[e][t], memory_order_relaxed);
+    for (int b = 0; b <= METRIC_LATENCY_BUCKETS; b++)
+      writes[b] += atomic_load_explicit(&m->writes[b], memory_order_relaxed);
+    write_ns += atomic_load_explicit(&m->write_ns, memory_order_relaxed);
+    if (m->peers)
+      npeers = metrics_collect_peers(m, &peers, npeers, &cap);
+  }
+  // A peer is only on more than one thread if attach_peer_affinity
+  // failed, but then its counts still add up.
+  qsort(peers, npeers, sizeof *peers, metrics_peer_cmp);
+  int n = 0;
+  for (int i = 0; i < npeers; i++) {
+    if (n > 0 && strcmp(peers[n-1].name, peers[i].name) == 0) {
+      for (int k = 0; k < METRIC_COUNTS; k++)
+        peers[n-1].counts[k] += peers[i].counts[k];
+    } else {
+      peers[n++] = peers[i];
+    }
+  }
+  npeers = n;
+
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof tmp, "%s.tmp", gMETRICS_FILE);
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    if (gDEBUG)
+      fprintf(gFOUTPUT, "metrics: cannot write %s: %s\n", tmp, strerror(errno));
+    free(peers);
+    return;
+  }
+  char name[128];
+  for (int k = 0; k < METRIC_COUNTS; k++) {
+    if (k == METRIC_EVENTS)
+      continue;              // by type below
+    snprintf(name, sizeof name, "pirds_%s", metric_info[k].name);
+    metrics_header(fp, name, metric_info[k].help, "counter");
+    fprintf(fp, "%s %llu\n", name, (unsigned long long) counts[k]);
+  }
+  metrics_header(fp, "pirds_events_total", "Events logged, by event and type.", "counter");
+  for (int e = 0; e < (int) sizeof METRIC_EVENT_KINDS - 1; e++)
+    for (int t = 0; t < 128; t++) {
+      if (!events[e][t])
+        continue;
+      char type[8];
+      if (t == '"' || t == '\\')
+        snprintf(type, sizeof type, "\\%c", t);
+      else if (isprint(t))
+        snprintf(type, sizeof type, "%c", t);
+      else
+        snprintf(type, sizeof type, "0x%02x", t);
+      fprintf(fp, "pirds_events_total{event=\"%c\",type=\"%s\"} %llu\n",
+              METRIC_EVENT_KINDS[e], type, (unsigned long long) events[e][t]);
+    }
+  metrics_header(fp, "pirds_write_seconds", "Time taken to write buffered records to the log files.", "histogram");
+  uint64_t total = 0;
+  for (int b = 0; b < METRIC_LATENCY_BUCKETS; b++) {
+    total += writes[b];
+    fprintf(fp, "pirds_write_seconds_bucket{le=\"%g\"} %llu\n",
+            metric_latency_us[b] / 1e6, (unsigned long long) total);
+  }
+  total += writes[METRIC_LATENCY_BUCKETS];
+  fprintf(fp, "pirds_write_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) total);
+  fprintf(fp, "pirds_write_seconds_sum %.9f\n", write_ns / 1e9);
+  fprintf(fp, "pirds_write_seconds_count %llu\n", (unsigned long long) total);
+  if (gASYNC) {
+    metrics_header(fp, "pirds_writer_stalls_total", "Times a receive thread found its queue to the writer full.", "counter");
+    fprintf(fp, "pirds_writer_stalls_total %lu\n", atomic_load(&writer_stalls));
+  }
+  metrics_header(fp, "pirds_peers", "Devices heard from recently.", "gauge");
+  fprintf(fp, "pirds_peers %d\n", npeers);
+  for (int k = 0; k < METRIC_COUNTS; k++) {
+    snprintf(name, sizeof name, "pirds_peer_%s", metric_info[k].name);
+    metrics_header(fp, name, metric_info[k].help, "counter");
+    for (int i = 0; i < npeers; i++)
+      fprintf(fp, "%s{peer=\"%s\"} %llu\n", name, peers[i].name,
+              (unsigned long long) peers[i].counts[k]);
+  }
+  free(peers);
+  if (fclose(fp) != 0 || rename(tmp, gMETRICS_FILE) != 0) {
+    if (gDEBUG)
+      fprintf(gFOUTPUT, "metrics: cannot write %s: %s\n", gMETRICS_FILE, strerror(errno));
+    unlink(tmp);
+  }
+}
+
+void *metrics_main(void *arg) {
+  while (!atomic_load(&metrics_stopping)) {
+    metrics_write();
+    for (int k = 0; k < METRICS_INTERVAL * 10 && !atomic_load(&metrics_stopping); k++) {
+      struct timespec ts = {0, 100000000}; // 100 ms
+      nanosleep(&ts, NULL);
+    }
+  }
+  metrics_write();
+  return NULL;
+}
+
+void metrics_start() {
+  if (pthread_create(&metrics_thread, NULL, metrics_main, NULL) != 0) {
+    perror("pthread_create metrics");
+    exit(1);
+  }
+}
+
+// Called once the receive threads (and the writer) are done, so the
+// last file has everything.
+void metrics_stop() {
+  atomic_store(&metrics_stopping, true);
+  pthread_join(metrics_thread, NULL);
+}
+
+// Append a line to h, an open log file.
+void log_handle_append(struct log_handle *h, const char *line, int len) {
+  if (h->stream == LOG_SEGMENT) {
+    struct iovec rec, heap;
+    char data[LOG_LINE_MAX];
+    memcpy(data, line, len);
+    segment_split(h, data, len, &rec, &heap);
+    fwrite(heap.iov_base, 1, heap.iov_len, h->heap_fp);
+    fwrite(rec.iov_base, 1, rec.iov_len, h->fp);
+  } else {
+    log_index_note(h, line);
+    fwrite(line, 1, len, h->fp);
+    h->size += len;
+  }
+}
+
+// While a batch (see handle_batch) is being logged, lines that would be
+// written directly are staged here instead, and log_batch_end appends
+// them with one lookup (and roll check) of each of the peer's files.
+// The writer (-a) and io_uring (-u) already group a peer's lines.
+#define LOG_BATCH_SIZE (64*1024)
+#define LOG_BATCH_LINES 1024
+
+struct log_batch {
+  bool open;
+  char peer[INET6_ADDRSTRLEN];
+  int nlines;
+  size_t used;
+  uint8_t stream[LOG_BATCH_LINES];
+  struct iovec iov[LOG_BATCH_LINES];
+  char data[LOG_BATCH_SIZE];
+};
+__thread struct log_batch log_batch;
+
+void log_batch_flush() {
+  struct log_batch *b = &log_batch;
+  for (uint8_t stream = LOG_TEXT; b->nlines > 0 && stream < LOG_ROLLUP + ROLLUP_TIERS; stream++) {
+    struct log_handle *h = NULL;
+    for (int k = 0; k < b->nlines; k++) {
+      if (b->stream[k] != stream)
+        continue;
+      if (!h && !(h = open_log_file(b->peer, stream)))
+        break;
+      log_handle_append(h, b->iov[k].iov_base, b->iov[k].iov_len);
+    }
+    if (h)
+      release_log_file(h);
+  }
+  b->nlines = 0;
+  b->used = 0;
+}
+
+void log_batch_begin(char *peer) {
+  log_batch.open = true;
+  strcpy(log_batch.peer, peer);
+}
+
+void log_batch_end() {
+  log_batch_flush();
+  log_batch.open = false;
+}
+
+void log_batch_stage(char *peer, uint8_t stream, const char *line, int len) {
+  struct log_batch *b = &log_batch;
+  if (b->nlines == LOG_BATCH_LINES || b->used + len > LOG_BATCH_SIZE || strcmp(b->peer, peer)) {
+    log_batch_flush();
+    strcpy(b->peer, peer);
+  }
+  memcpy(b->data + b->used, line, len);
+  b->stream[b->nlines] = stream;
+  b->iov[b->nlines].iov_base = b->data + b->used;
+  b->iov[b->nlines].iov_len = len;
+  b->nlines++;
+  b->used += len;
+}
+
+// Append one formatted line (or segment record) to peer's log stream,
+// directly or through the writer.
+void append_log_line(char *peer, uint8_t stream, const char *line, int len) {
+  if (len <= 0)
+    return;
+  if (len >= LOG_LINE_MAX)
+    len = LOG_LINE_MAX - 1;
+  if (uring_active) {
+    uring_stage_line(peer, stream, line, len);
+    return;
+  }
+  if (gASYNC) {
+    struct log_record *rec = writer_reserve();
+    rec->kind = LOG_RECORD_LINE;
+    rec->stream = stream;
+    strcpy(rec->peer, peer);
+    rec->len = len;
+    memcpy(rec->data, line, len);
+    ring_commit(log_ring);
+    return;
+  }
+  if (log_batch.open) {
+    log_batch_stage(peer, stream, line, len);
+    return;
+  }
+  struct log_handle *h = open_log_file(peer, stream);
+  if (!h) return;
+  log_handle_append(h, line, len);
+  release_log_file(h);
+}
+
+// Move peer's log aside to name (SAVE_LOG_TO_FILE), after everything
+// logged so far has been written to it.
+void save_log_file(char *peer, char *name) {
+  if (gASYNC) {
+    struct log_record *rec = writer_reserve();
+    rec->kind = LOG_RECORD_SAVE;
+    strcpy(rec->peer, peer);
+    snprintf(rec->data, sizeof rec->data, "%s", name);
+    ring_commit(log_ring);
+    return;
+  }
+  // Make sure everything we have buffered goes with the old file.
+  if (uring_active)
+    uring_flush_writes(true);
+  log_batch_flush();
+  log_cache_evict(peer);
+  copy_log_file_to_name(peer, name);
+}
+
+/**
+ * Copy content from one file to other file.
+ */
+int
+copy_file(char path_to_read_file[], char path_to_write_file[])
+{
+    char chr;
+    FILE *stream_for_write, *stream_for_read;
+
+    if ((stream_for_write = fopen(path_to_write_file, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", "Impossible to create a file", path_to_write_file);
+        return -1;
+    }
+
+    if ((stream_for_read = fopen(path_to_read_file, "r")) == NULL) {
+        fprintf(stderr, "%s: %s\n", "Impossible to read a file", path_to_read_file);
+        return -1;
+    }
+
+    while (!feof(stream_for_read)) {
+      char chr = fgetc(stream_for_read);
+      fputc(chr, stream_for_write);
+    }
+
+    fclose(stream_for_write);
+    fclose(stream_for_read);
+    return 0;
+}
+
+void copy_log_file_to_name(char* peer,char* name) {
+
+  char fname[30];
+  int ret;
+  strcpy(fname, "0Logfile.");
+  strcpy(fname + 9, peer);
+
+  char cmd[256];
+
+  sprintf(cmd,"mv %s %s",fname,name);
+  if (gSTORE & STORE_TEXT)
+    system(cmd);
+  fprintf(gFOUTPUT,"old name %s, new name %s",fname,name);
+
+  // The index, segment and heap go along, under the same name with
+  // their own prefixes, so that the saved dataset can be read either way.
+  if (strncmp(name, "0Logfile.", 9) == 0) {
+    char from[256], to[256];
+    snprintf(from, sizeof from, "%s%s", INDEX_PREFIX, peer);
+    snprintf(to, sizeof to, "%s%s", INDEX_PREFIX, name + 9);
+    if (gSTORE & STORE_TEXT)
+      rename(from, to);
+  }
+  if ((gSTORE & STORE_SEGMENT) && strncmp(name, "0Logfile.", 9) == 0) {
+    char from[256], to[256];
+    snprintf(from, sizeof from, "%s%s", SEGMENT_PREFIX, peer);
+    snprintf(to, sizeof to, "%s%s", SEGMENT_PREFIX, name + 9);
+    rename(from, to);
+    snprintf(from, sizeof from, "%s%s", HEAP_PREFIX, peer);
+    snprintf(to, sizeof to, "%s%s", HEAP_PREFIX, name + 9);
+    rename(from, to);
+  }
+  // So do its earlier parts, if it has been rolled.
+  if (strncmp(name, "0Logfile.", 9) == 0) {
+    char from[256], to[256];
+    snprintf(from, sizeof from, "%s%s", MANIFEST_PREFIX, peer);
+    snprintf(to, sizeof to, "%s%s", MANIFEST_PREFIX, name + 9);
+    rename(from, to);
+  }
+  if (gROLLUP && strncmp(name, "0Logfile.", 9) == 0) {
+    char from[256], to[256];
+    for (int t = 0; t < ROLLUP_TIERS; t++) {
+      snprintf(from, sizeof from, "%s%s", rollup_tiers[t].prefix, peer);
+      snprintf(to, sizeof to, "%s%s", rollup_tiers[t].prefix, name + 9);
+      rename(from, to);
+    }
+  }
+  /* ret =   rename(fname,name); */
+  /* if(ret == 0) { */
+  /*     fprintf(gFOUTPUT,"File renamed successfully"); */
+
+  /*  } else { */
+  /*     fprintf(gFOUTPUT, "Error: unable to rename the file"); */
+  /*  } */
+  //  copy_file(fname,name);
+}
+
+void mark_minute_into_stream(uint32_t cur_ms, int fd, struct sockaddr_in *clientaddr, struct peer_state *ps) {
+    // Here whenever a new minute ticks over we output a new Clock event
+    // I can
+    char iso_time_string[256];
+    time_t now;
+    time(&now);
+
+    ps->high_water_mark_epoch_ms = (uint64_t) now*1000;
+    ps->high_water_mark_ms = (uint64_t) cur_ms;
+
+    struct tm *ptm = gmtime(&now);
+
+    if (ptm == NULL) {
+        puts("The gmtime() function failed");
+    }
+    sprintf(iso_time_string,"%s", asctime(ptm));
+    // remove traling newline
+    iso_time_string[strcspn(iso_time_string, "\n")] = 0;
+    //    unsigned long cur_ms = get_most_recent_ms(peer);
+    // This is a fake until I figure out how to get it out of the file!
+    Message clockEvent = {
+      'E','C',cur_ms,(uint8_t) strlen(iso_time_string)
+    };
+    strcpy(clockEvent.buff,iso_time_string);
+    uint8_t lbuffer[PIRDS_MESSAGE_MAX];
+    fill_byte_buffer_message(&clockEvent,lbuffer,PIRDS_MESSAGE_MAX);
+    handle_event(lbuffer, fd, clientaddr, ps, false);
+}
+
+// Rollups (-r). Each peer gets, when it first sends a measurement, a
+// table of its series with the open bucket of every tier. A sample
+// into a different bucket closes the open one, and rollup_tick closes
+// buckets that have been over for ROLLUP_GRACE_MS, so that a device
+// that goes quiet still has its last buckets written. A sample that
+// arrives after its bucket was closed starts another bucket for the
+// same time; readers just see two buckets with the same start.
+#define ROLLUP_SERIES_MAX 32
+
+struct peer_rollup {
+  int nseries;
+  struct rollup_record open[ROLLUP_SERIES_MAX][ROLLUP_TIERS]; // count 0: none
+};
+
+void rollup_close(struct peer_state *ps, struct rollup_record *b, int tier) {
+  if (b->count == 0)
+    return;
+  append_log_line(ps->name, LOG_ROLLUP + tier, (char *) b, sizeof *b);
+  b->count = 0;
+}
+
+void rollup_note(struct peer_state *ps, Measurement *m, uint64_t ms) {
+  struct peer_rollup *pr = ps->rollup;
+  if (!pr && !(pr = ps->rollup = calloc(1, sizeof *pr)))
+    return;
+  int s;
+  for (s = 0; s < pr->nseries; s++) {
+    struct rollup_record *b = &pr->open[s][0];
+    if (b->type == m->type && b->loc == m->loc && b->num == m->num)
+      break;
+  }
+  if (s == pr->nseries) {
+    if (s == ROLLUP_SERIES_MAX) {
+      if (gDEBUG > 1)
+        diag_peer_note(DIAG_PROBLEMS, 0, ps->name, "rollup: too many series, not rolling up %c:%c:%d\n",
+                       m->type, m->loc, m->num);
+      return;
+    }
+    pr->nseries++;
+    for (int t = 0; t < ROLLUP_TIERS; t++) {
+      pr->open[s][t].type = m->type;
+      pr->open[s][t].loc = m->loc;
+      pr->open[s][t].num = m->num;
+    }
+  }
+  for (int t = 0; t < ROLLUP_TIERS; t++) {
+    struct rollup_record *b = &pr->open[s][t];
+    int64_t start = (int64_t) ms - (int64_t) ms % rollup_tiers[t].ms;
+    if (b->count && b->start_ms != start)
+      rollup_close(ps, b, t);
+    if (b->count == 0) {
+      b->start_ms = start;
+      b->sum = 0;
+      b->sumsq = 0;
+      b->min = b->max = b->first = m->val;
+    }
+    b->count++;
+    b->sum += m->val;
+    b->sumsq += (double) m->val * m->val;
+    if (m->val < b->min) b->min = m->val;
+    if (m->val > b->max) b->max = m->val;
+    b->last = m->val;
+  }
+}
+
+// Write out all of ps's open buckets; with release, also forget them.
+void rollup_flush(struct peer_state *ps, bool release) {
+  struct peer_rollup *pr = ps->rollup;
+  if (!pr)
+    return;
+  for (int s = 0; s < pr->nseries; s++)
+    for (int t = 0; t < ROLLUP_TIERS; t++)
+      rollup_close(ps, &pr->open[s][t], t);
+  if (release) {
+    free(pr);
+    ps->rollup = NULL;
+  }
+}
+
+void rollup_flush_all() {
+  for (int i = peer_lru_head; i != -1; i = peer_table[i].next_lru)
+    rollup_flush(&peer_table[i], true);
+}
+
+// Called about once a second by each worker.
+void rollup_tick(time_t now) {
+  if (!gROLLUP)
+    return;
+  int64_t now_ms = (int64_t) now * 1000;
+  for (int i = peer_lru_head; i != -1; i = peer_table[i].next_lru) {
+    struct peer_rollup *pr = peer_table[i].rollup;
+    if (!pr)
+      continue;
+    for (int s = 0; s < pr->nseries; s++)
+      for (int t = 0; t < ROLLUP_TIERS; t++) {
+        struct rollup_record *b = &pr->open[s][t];
+        if (b->count && b->start_ms + rollup_tiers[t].ms + ROLLUP_GRACE_MS <= now_ms)
+          rollup_close(&peer_table[i], b, t);
+      }
+  }
+}
+
+uint32_t
+log_measurement_bytecode_from_measurement(struct peer_state *ps, Measurement* measurement, bool limit) {
+
+  if (measurement->ms < ps->high_water_mark_ms) {
+    diag_note(DIAG_PROBLEMS, 0, "INTERNAL ERROR: HIGH_WATER_MARK_MS INCONSISTENT\n", NULL);
+    metric_count(METRIC_INCONSISTENT, 1);
+  } else {
+    uint64_t displacement = (((uint64_t) measurement->ms) - ps->high_water_mark_ms);
+    uint64_t ms = ps->high_water_mark_epoch_ms +
+      (((uint64_t) measurement->ms) - ps->high_water_mark_ms);
+    int bytes = 0;
+
+    if (gSTORE & STORE_TEXT) {
+      char line[LOG_LINE_MAX];
+      int len = snprintf(line, sizeof line, "%lu:%c:%c:%c:%u:%llu:%d\n", time(NULL),
+                         measurement->event,
+                         measurement->type, measurement->loc,
+                         measurement->num, ms, measurement->val);
+      append_log_line(ps->name, LOG_TEXT, line, len);
+      bytes += len;
+    }
+    if (gSTORE & STORE_SEGMENT) {
+      struct segment_record r = {
+        time(NULL), (int64_t) ms, measurement->val,
+        measurement->event, measurement->type, measurement->loc, measurement->num,
+        SEGMENT_NO_HEAP
+      };
+      append_log_line(ps->name, LOG_SEGMENT, (char *) &r, sizeof r);
+      bytes += sizeof r;
+    }
+    catalog_note(ps, ms, bytes);
+    metric_event(measurement->event, measurement->type);
+    // Limits are not samples; keep them out of the channel's buckets.
+    if (gROLLUP && measurement->event == 'M')
+      rollup_note(ps, measurement, ms);
+  }
+  return measurement->ms;
+}
+
+uint32_t
+log_measurement_bytecode(struct peer_state *ps, void *buff, bool limit) {
+  Measurement measurement = get_measurement_from_buffer(buff,PIRDS_MEASUREMENT_SIZE);
+  return log_measurement_bytecode_from_measurement(ps,&measurement,limit);
+}
+
+// A MultiMeasurement is logged as a Measurement per channel, so that it
+// reads back exactly as if they had been sent one by one.
+uint32_t
+log_multi_measurement(struct peer_state *ps, MultiMeasurement *mm, bool limit) {
+  for (uint8_t i = 0; i < mm->count; i++) {
+    Measurement measurement = get_measurement_from_multi(mm, i);
+    log_measurement_bytecode_from_measurement(ps, &measurement, limit);
+  }
+  return mm->ms;
+}
+
+
+void get_timestamp( char *buffer, size_t buffersize ) {
+   time_t rawtime;
+   struct tm * timeinfo;
+   time (&rawtime);
+   timeinfo = localtime (&rawtime);
+   strftime (buffer,16,"%G%m%d%H%M%S",timeinfo);
+   puts(buffer);
+}
+
+
+uint32_t
+log_event_bytecode_from_message(struct peer_state *ps, Message* message, bool limit) {
+  char *peer = ps->name;
+
+  int n = strlen(SAVE_LOG_TO_FILE);
+  if (strncmp(message->buff,SAVE_LOG_TO_FILE,n) == 0) {
+    char *name = message->buff+n;
+      char fname[256];
+      char cname[256];
+      strcpy(fname, "0Logfile.");
+      strcpy(fname + 9, peer);
+      strcpy(cname,fname);
+      strcpy(fname + strlen(fname),".");
+      strcpy(fname + strlen(fname),name);
+      strcpy(fname + strlen(fname),".");
+      get_timestamp(fname+strlen(fname),16);
+      // The open rollup buckets belong to the saved dataset.
+      rollup_flush(ps, false);
+      catalog_save(ps, fname + 9);
+      save_log_file(peer,fname);
+      //      remove(cname);
+  } else {
+    // Here we perform the HIGH_WATER_MARK_MATH
+    // Note: The second summand had better be positive..
+
+    if (message->ms < ps->high_water_mark_ms) {
+      diag_note(DIAG_PROBLEMS, 0, "INTERNAL ERROR: HIGH_WATER_MARK_MS INCONSISTENT\n", NULL);
+      metric_count(METRIC_INCONSISTENT, 1);
+    } else {
+      uint64_t ms = ps->high_water_mark_epoch_ms +
+        (((uint64_t)message->ms) - ps->high_water_mark_ms);
+      int bytes = 0;
+
+      if (gSTORE & STORE_TEXT) {
+        char line[LOG_LINE_MAX];
+        int len = snprintf(line, sizeof line, "%lu:%c:%c:%llu:\"%s\"\n",
+                           time(NULL),
+                           message->event,
+                           message->type,
+                           ms,
+                           message->buff);
+        append_log_line(peer, LOG_TEXT, line, len);
+        bytes += len;
+      }
+      if (gSTORE & STORE_SEGMENT) {
+        char data[sizeof(struct segment_record) + 256];
+        struct segment_record r = {
+          time(NULL), (int64_t) ms, 0, message->event, message->type, 0, 0, 0
+        };
+        uint8_t n = strnlen(message->buff, 255);
+        memcpy(data, &r, sizeof r);
+        data[sizeof r] = n;
+        memcpy(data + sizeof r + 1, message->buff, n);
+        append_log_line(peer, LOG_SEGMENT, data, sizeof r + 1 + n);
+        bytes += sizeof r + 1 + n;
+      }
+      catalog_note(ps, ms, bytes);
+      metric_event(message->event, message->type);
+    }
+  }
+  return message->ms;
+}
+
+uint32_t log_event_bytecode(struct peer_state *ps, void *buff, bool limit) {
+  Message message = get_message_from_buffer(buff,PIRDS_MESSAGE_MAX);
+  return log_event_bytecode_from_message(ps,&message,limit);
+}
+
+void
+log_json(char *peer, void *buff) {
 
   char *ptr = strchr((char *)buff, '\n');
   if (ptr) *ptr = '\0';
   if ((ptr = strchr((char*)buff, '\r')))
     *ptr = '\0';
 
+  char line[LOG_LINE_MAX];
+  int len;
   if (((char *)buff)[0] == '[') {
-    fprintf(fp, "[ {\"TimeStamp\": %lu}, %s\n", time(NULL), (char *)buff+1);
+    len = snprintf(line, sizeof line, "[ {\"TimeStamp\": %lu}, %s\n", time(NULL), (char *)buff+1);
   } else {
-    fprintf(fp, "{\"TimeStamp\": %lu, %s\n", time(NULL), (char *)buff+1);
+    len = snprintf(line, sizeof line, "{\"TimeStamp\": %lu, %s\n", time(NULL), (char *)buff+1);
   }
-  fclose(fp);
+  append_log_line(peer, LOG_TEXT, line, len < (int) sizeof line ? len : (int) sizeof line - 1);
 }
 void print_message(Message message,bool limit);
 
+// These go through the diagnostics (see diag_begin).
 void
 print_event_bytecode(void *buff, bool limit) {
   char second_char = ((char *)buff)[1];
   if (second_char == 'M') {
-    Message message = get_message_from_buffer(buff,263);
-    print_message(message,limit);
+    Message message = get_message_from_buffer(buff,PIRDS_MESSAGE_MAX);
+    diag_message(message.buff);
   }
 }
 
@@ -478,8 +2869,16 @@ void print_measurement(Measurement* measurement,bool limit);
 
 void
 print_measurement_bytecode(void *buff, bool limit) {
-  Measurement measurement = get_measurement_from_buffer(buff,13);
-  print_measurement(&measurement,limit);
+  Measurement measurement = get_measurement_from_buffer(buff,PIRDS_MEASUREMENT_SIZE);
+  diag_measurement(&measurement,limit);
+}
+
+void
+print_multi_measurement(MultiMeasurement *mm, bool limit) {
+  for (uint8_t i = 0; i < mm->count; i++) {
+    Measurement measurement = get_measurement_from_multi(mm, i);
+    diag_measurement(&measurement,limit);
+  }
 }
 
  void print_measurement(Measurement* measurement,bool limit) {
@@ -562,26 +2961,382 @@ void zombie_hunter(int sig)
 }
 #endif
 
-int process_high_water(uint64_t ms) {
-  if (ms >= HIGH_WATER_MARK_MS) {
+int process_high_water(struct peer_state *ps, uint64_t ms) {
+  if (ms >= ps->high_water_mark_ms) {
     return ms;
   } else {
-    HIGH_WATER_MARK_TOLERANCE_COUNT++;
-    if (HIGH_WATER_MARK_TOLERANCE_COUNT > HIGH_WATER_MARK_TOLERANCE) {
-      HIGH_WATER_MARK_TOLERANCE_COUNT = 0;
+    ps->tolerance_count++;
+    if (ps->tolerance_count > HIGH_WATER_MARK_TOLERANCE) {
+      ps->tolerance_count = 0;
+      metric_count(METRIC_RESETS, 1);
       // Settting this here is debatable; possiblye it should
       // oly be set when the epoch mark changes!
-      HIGH_WATER_MARK_MS = ms;
+      ps->high_water_mark_ms = ms;
       return -1;
     }
-    return ms;
+    return ms;
+  }
+}
+
+// Acknowledge an event: to the sender's address for UDP, down the
+// connection for TCP.
+void send_reply(int fd, struct sockaddr_in *clientaddr, const char *reply, int len) {
+  metric_count(METRIC_ACKS, 1);
+  if (uring_active && clientaddr && uring_queue_ack(fd, clientaddr, reply, len))
+    return;
+  int flags = 0;
+#if __linux__
+  flags = MSG_CONFIRM;
+#endif
+  if (clientaddr)
+    sendto(fd, reply, len, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
+  else
+    write(fd, reply, len);
+}
+
+// PIRDS JSON events are flat objects with string and integer members:
+//   { "event": "M", "type": "P", "loc": "A", "num": 0, "ms": 20001, "val": 10112 }
+//   { "event": "E", "type": "M", "ms": 20001, "buff": "hello" }
+// json_event_parse reads one in a single pass over the bytes as they
+// were received, without copying or changing them, and decodes it
+// straight into a Measurement or a Message. Members may come in any
+// order; ones we do not know are skipped (they too must be strings,
+// numbers, true, false or null), and missing ones are 0.
+
+static inline const char *json_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  return p;
+}
+
+// The string whose opening quote is just before p; returns what follows
+// its closing quote, or NULL if it has none. Up to cap - 1 bytes of its
+// value go to out (if cap), null terminated, with their count in *len.
+static inline const char *json_string(const char *p, const char *end, char *out, size_t cap, size_t *len) {
+  // Usually there is nothing to unescape. (The strings are short; a
+  // loop beats two calls to memchr.)
+  const char *q = p;
+  while (q < end && *q != '"' && *q != '\\')
+    q++;
+  if (q < end && *q == '"') {
+    if (cap) {
+      size_t n = (size_t) (q - p) < cap - 1 ? (size_t) (q - p) : cap - 1;
+      memcpy(out, p, n);
+      out[n] = '\0';
+      *len = n;
+    }
+    return q + 1;
+  }
+  size_t n = 0;
+  while (p < end && *p != '"') {
+    char c = *p++;
+    if (c == '\\') {
+      if (p == end)
+        return NULL;
+      switch (c = *p++) {
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'u': {
+        // Our text is ASCII; anything else becomes '?'.
+        unsigned u = 0;
+        for (int k = 0; k < 4; k++, p++) {
+          if (p == end || !isxdigit((unsigned char) *p))
+            return NULL;
+          u = 16 * u + (isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a' + 10));
+        }
+        c = u < 0x80 ? (char) u : '?';
+        break;
+      }
+      }
+    }
+    if (n + 1 < cap)
+      out[n++] = c;
+  }
+  if (p == end)
+    return NULL;
+  if (cap) {
+    out[n] = '\0';
+    *len = n;
+  }
+  return p + 1;
+}
+
+// An integer (a fraction is dropped); NULL if there is none or it is
+// absurdly large.
+static inline const char *json_int(const char *p, const char *end, int64_t *v) {
+  bool neg = p < end && *p == '-';
+  p += neg;
+  if (p == end || !isdigit((unsigned char) *p))
+    return NULL;
+  int64_t x = 0;
+  for (; p < end && isdigit((unsigned char) *p); p++) {
+    if (x > INT64_MAX / 100)
+      return NULL;
+    x = 10 * x + (*p - '0');
+  }
+  if (p < end && *p == '.')
+    for (p++; p < end && isdigit((unsigned char) *p); p++)
+      ;
+  if (p < end && (*p == 'e' || *p == 'E'))
+    return NULL;
+  *v = neg ? -x : x;
+  return p;
+}
+
+#define JSON_KEY(k, klen, s) ((klen) == sizeof(s) - 1 && memcmp(k, s, sizeof(s) - 1) == 0)
+
+// The object that starts at p: sets *c to its event's character ('M'
+// and 'E' are filled in; any other is an event we do not log) and
+// returns what follows its closing brace, or NULL if it is not a PIRDS
+// JSON event.
+static const char *json_event_object(const char *p, const char *end, char *c,
+                                     Measurement *m, Message *msg) {
+  char event = 0, type = 0, loc = 0;
+  int64_t num = 0, ms = 0, val = 0;
+  size_t blen = 0;
+  msg->buff[0] = '\0';
+
+  p = json_ws(p, end);
+  if (p == end || *p != '{')
+    return NULL;
+  p = json_ws(p + 1, end);
+  while (p < end && *p == '"') {
+    const char *key = p + 1;
+    if (!(p = json_string(key, end, NULL, 0, NULL)))
+      return NULL;
+    size_t klen = p - 1 - key;
+    p = json_ws(p, end);
+    if (p == end || *p != ':')
+      return NULL;
+    p = json_ws(p + 1, end);
+    if (p == end)
+      return NULL;
+    if (*p == '"') {
+      char one[2];
+      size_t n;
+      if (JSON_KEY(key, klen, "buff")) {
+        p = json_string(p + 1, end, msg->buff, sizeof msg->buff, &blen);
+      } else {
+        p = json_string(p + 1, end, one, sizeof one, &n);
+        if (JSON_KEY(key, klen, "event"))
+          event = one[0];
+        else if (JSON_KEY(key, klen, "type"))
+          type = one[0];
+        else if (JSON_KEY(key, klen, "loc"))
+          loc = one[0];
+      }
+    } else if (*p == '-' || isdigit((unsigned char) *p)) {
+      int64_t v;
+      p = json_int(p, end, &v);
+      if (JSON_KEY(key, klen, "num"))
+        num = v;
+      else if (JSON_KEY(key, klen, "ms"))
+        ms = v;
+      else if (JSON_KEY(key, klen, "val"))
+        val = v;
+    } else if (end - p >= 4 && (!memcmp(p, "true", 4) || !memcmp(p, "null", 4))) {
+      p += 4;
+    } else if (end - p >= 5 && !memcmp(p, "false", 5)) {
+      p += 5;
+    } else {
+      return NULL;
+    }
+    if (!p)
+      return NULL;
+    p = json_ws(p, end);
+    if (p == end || *p != ',')
+      break;
+    p = json_ws(p + 1, end);
+    if (p == end || *p != '"')
+      return NULL;
+  }
+  if (p == end || *p != '}')
+    return NULL;
+
+  if (event == 0 || ms < 0 || ms > UINT32_MAX)
+    return NULL;
+  if (event == 'M') {
+    if (num < 0 || num > UINT8_MAX || val < INT32_MIN || val > INT32_MAX)
+      return NULL;
+    *m = (Measurement) { 'M', type, loc, (uint8_t) num, (uint32_t) ms, (int32_t) val };
+  } else if (event == 'E') {
+    msg->event = 'E';
+    msg->type = type;
+    msg->ms = (uint32_t) ms;
+    msg->b_size = (uint8_t) blen;
+  }
+  *c = event;
+  return p + 1;
+}
+
+// Only whitespace (or the null a C sender may include) may follow an
+// event or a batch.
+static inline bool json_rest_empty(const char *p, const char *end) {
+  p = json_ws(p, end);
+  return p == end || *p == '\0';
+}
+
+// Returns the event's character, as json_event_object sets it, or 0 if
+// p is not a PIRDS JSON event.
+char json_event_parse(const char *p, size_t len, Measurement *m, Message *msg) {
+  const char *end = p + len;
+  char c;
+  p = json_event_object(p, end, &c, m, msg);
+  return p && json_rest_empty(p, end) ? c : 0;
+}
+
+// Log a JSON event from a device, as if it had come in as bytes.
+// Returns false, having done nothing, if it is not a PIRDS JSON event.
+bool handle_json_event(const char *p, size_t len, int fd, struct sockaddr_in *clientaddr,
+                       struct peer_state *ps, bool mark_minute) {
+  Measurement m;
+  Message msg;
+  char c = json_event_parse(p, len, &m, &msg);
+  uint32_t ms;
+  switch (c) {
+  case 0:
+    return false;
+  case 'M':
+    process_high_water(ps, (uint64_t) m.ms);
+    ms = log_measurement_bytecode_from_measurement(ps, &m, true);
+    if (mark_minute)
+      mark_minute_into_stream(ms, fd, clientaddr, ps);
+    send_reply(fd, clientaddr, "OK\n", 3);
+    break;
+  case 'E':
+    process_high_water(ps, (uint64_t) msg.ms);
+    ms = log_event_bytecode_from_message(ps, &msg, true);
+    if (mark_minute)
+      mark_minute_into_stream(ms, fd, clientaddr, ps);
+    if (gDEBUG)
+      diag_message(msg.buff);
+    send_reply(fd, clientaddr, "OK\n", 3);
+    break;
+  default:
+    if (gDEBUG)
+      diag_note(DIAG_PROBLEMS, 0, "  Unknown %s JSON event\n", (char []) { c, 0 });
+    metric_count(METRIC_FAILURES, 1);
+    send_reply(fd, clientaddr, "UNK\n", 4);
+    break;
+  }
+  return true;
+}
+
+// Batches. A device that samples quickly can send many events in one
+// datagram, either as bytes:
+//   '*', BATCH_VERSION, the number of events (2 bytes, network order),
+//   then the events back to back: Measurements as
+//   fill_byte_buffer_measurement writes them (PIRDS_MEASUREMENT_SIZE
+//   bytes, without the padding of a lone datagram), Messages as
+//   fill_byte_buffer_message writes them (PIRDS_MESSAGE_HEADER bytes and
+//   the text) and
+//   MultiMeasurements as fill_byte_buffer_multi_measurement does
+// or as a JSON array of events, [ {...}, {...} ]. The events are logged
+// in order, as if they had come one at a time, but with one append to
+// each of the device's files, and the device gets one reply: OK, or
+// UNK if the batch is malformed (the events before the bad one are
+// still logged).
+#define BATCH_MAGIC '*'
+#define BATCH_VERSION 1
+#define BATCH_HEADER_SIZE 4
+
+void log_batch_event(char c, Measurement *m, Message *msg, bool json, int fd,
+                     struct sockaddr_in *clientaddr, struct peer_state *ps, bool *mark_minute) {
+  uint32_t ms;
+  if (c == 'E') {
+    if (json)
+      process_high_water(ps, (uint64_t) msg->ms);
+    ms = log_event_bytecode_from_message(ps, msg, true);
+  } else {
+    if (json)
+      process_high_water(ps, (uint64_t) m->ms);
+    ms = log_measurement_bytecode_from_measurement(ps, m, true);
+  }
+  if (*mark_minute) {
+    mark_minute_into_stream(ms, fd, clientaddr, ps);
+    *mark_minute = false;
+  }
+}
+
+// Returns false, having done nothing, if buf is not a batch.
+bool handle_batch(uint8_t *buf, int len, int fd, struct sockaddr_in *clientaddr,
+                  struct peer_state *ps, bool mark_minute) {
+  uint8_t *end = buf + len;
+  Measurement m;
+  Message msg;
+  int count, events = 0;
+  bool ok;
+  if (len >= BATCH_HEADER_SIZE && buf[0] == BATCH_MAGIC) {
+    count = buf[1] == BATCH_VERSION ? buf[2] << 8 | buf[3] : -1;
+    log_batch_begin(ps->name);
+    uint8_t *p = buf + BATCH_HEADER_SIZE;
+    for (; events < count; events++) {
+      if (end - p >= PIRDS_MEASUREMENT_SIZE && (*p == 'M' || *p == 'L')) {
+        m = get_measurement_from_buffer(p, PIRDS_MEASUREMENT_SIZE);
+        log_batch_event('M', &m, &msg, false, fd, clientaddr, ps, &mark_minute);
+        p += PIRDS_MEASUREMENT_SIZE;
+      } else if (*p == 'N' && multi_measurement_size(p, end - p)) {
+        MultiMeasurement mm = get_multi_measurement_from_buffer(p, end - p);
+        for (uint8_t i = 0; i < mm.count; i++) {
+          m = get_measurement_from_multi(&mm, i);
+          log_batch_event('M', &m, &msg, false, fd, clientaddr, ps, &mark_minute);
+        }
+        p += multi_measurement_size(p, end - p);
+      } else if (end - p >= PIRDS_MESSAGE_HEADER && *p == 'E' &&
+                 end - p >= PIRDS_MESSAGE_HEADER + p[6]) {
+        msg = get_message_from_buffer(p, PIRDS_MESSAGE_HEADER + p[6]);
+        log_batch_event('E', &m, &msg, false, fd, clientaddr, ps, &mark_minute);
+        p += PIRDS_MESSAGE_HEADER + p[6];
+      } else {
+        break;
+      }
+    }
+    ok = events == count && json_rest_empty((const char *) p, (const char *) end);
+  } else {
+    const char *p = json_ws((const char *) buf, (const char *) end);
+    if (p == (const char *) end || *p != '[')
+      return false;
+    log_batch_begin(ps->name);
+    p = json_ws(p + 1, (const char *) end);
+    ok = p < (const char *) end && *p == ']';
+    while (!ok) {
+      char c;
+      if (!(p = json_event_object(p, (const char *) end, &c, &m, &msg)))
+        break;
+      // Events we do not log are skipped, as they are acknowledged
+      // without being logged when sent alone.
+      if (c == 'M' || c == 'E')
+        log_batch_event(c, &m, &msg, true, fd, clientaddr, ps, &mark_minute);
+      events++;
+      p = json_ws(p, (const char *) end);
+      if (p < (const char *) end && *p == ',')
+        p = json_ws(p + 1, (const char *) end);
+      else if (p < (const char *) end && *p == ']')
+        ok = true;
+      else
+        break;
+    }
+    ok = ok && json_rest_empty(p + 1, (const char *) end);
   }
+  log_batch_end();
+  if (gDEBUG)
+    diag_numbers(ok ? DIAG_PACKETS : DIAG_PROBLEMS, DIAG_BATCH, events, ok, 0);
+  if (!ok)
+    metric_count(METRIC_FAILURES, 1);
+  if (ok)
+    send_reply(fd, clientaddr, "OK\n", 3);
+  else
+    send_reply(fd, clientaddr, "UNK\n", 4);
+  return true;
 }
 
 // TODO: The use of mark_minute here is very confusing and duplicative;
 // it should be extracted from the
 int
-handle_event(uint8_t *buffer, int fd, struct sockaddr_in *clientaddr, char *peer, bool mark_minute) {
+handle_event(uint8_t *buffer, int fd, struct sockaddr_in *clientaddr, struct peer_state *ps, bool mark_minute) {
   // TODO: This should be a a function...
   uint8_t x = 0;
   while (message_types[x].type != '\0') {
@@ -591,216 +3346,129 @@ handle_event(uint8_t *buffer, int fd, struct sockaddr_in *clientaddr, char *peer
 
   if (message_types[x].type == '\0') {
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Invalid Message from buffer |%s|\n",buffer);
+      diag_note(DIAG_PROBLEMS, 0, "  Invalid Message from buffer |%s|\n", (char *) buffer);
+    metric_count(METRIC_FAILURES, 1);
     return 0;
   }
 
-  int flags = 0;
-#if __linux__
-  flags = MSG_CONFIRM;
-#endif
-
   int8_t rvalue = 0;
   switch(message_types[x].type) {
   case '{':
-    // TODO: This should be moved out to a separate function
-    {
-    // If this is an event or a measurmente, we want to log it
-    // as bytes, just as if it came in as bytes. If it is not, we will
-    // log it as JSON, assuming it is a comment.
-    // we will want to call get_measurement_from_JSON here, unless
-    // the the "event" type is an "M", in which case we get to do
-    // "get_message_from_JSON". This is functionality we need to add to PIRDS
-    // itself!
-
-    char c = get_event_designation_char_from_json((const char *) buffer,ONE_EVENT_BUFFER_SIZE);
-    switch (c) {
-    case 'M': {
-      int n = strlen((const char *)buffer);
-      if (n >= ONE_EVENT_BUFFER_SIZE) {
-        fprintf(gFOUTPUT, "INTERNAL ERROR, BUFFER LENGTH TOO HIGH\n");
-        // I'm not sure what this means
-        return 2;
-      }
-      //      char buff[1024]; // ugly
-      //      strcpy(buff,(const char *) buffer);
-      Measurement mp = get_measurement_from_JSON((char *) buffer,ONE_EVENT_BUFFER_SIZE);
-
-      process_high_water((uint64_t) mp.ms);
-      // TODO: Much of this code below is duplicated; I hate
-      // duplication!!
-      uint32_t ms = log_measurement_bytecode_from_measurement(peer, &mp, true);
-      if (mark_minute) {
-        mark_minute_into_stream(ms,fd,clientaddr,peer);
-      }
-      if (clientaddr)
-        sendto(fd, "OK\n", 3, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-      else
-        write(fd, "OK\n", 3);
-      break;
-    }
-    case 'E': {
-      Message msg = get_message_from_buffer(buffer,ONE_EVENT_BUFFER_SIZE);
-      process_high_water((uint64_t)msg.ms);
-
-      uint32_t ms = log_event_bytecode_from_message(peer, &msg, true);
-      if (mark_minute) {
-        mark_minute_into_stream(ms,fd,clientaddr,peer);
-      }
-
-      if (gDEBUG)
-        print_event_bytecode(buffer, true);
-      if (clientaddr)
-        sendto(fd, "OK\n", 3, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-      else
-        write(fd, "OK\n", 3);
-
-      rvalue = 1;
-      break;
-    }
-    case '\0':
-      if (gDEBUG)
-        fprintf(gFOUTPUT, "  Unknown %c Message\n", message_types[x].type);
-      if (clientaddr)
-        sendto(fd, "UNK\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-      else
-        write(fd, "UNK\n", 4);
-      rvalue = 2;
-      break;
-    default:
+    if (!handle_json_event((const char *) buffer, strlen((const char *) buffer), fd, clientaddr,
+                           ps, mark_minute)) {
       if (gDEBUG)
-        fprintf(gFOUTPUT, "  Unknown %c Message\n", message_types[x].type);
-      if (clientaddr)
-        sendto(fd, "UNK\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-      else
-        write(fd, "UNK\n", 4);
+        diag_note(DIAG_PROBLEMS, 0, "  Invalid JSON event |%s|\n", (char *) buffer);
+      metric_count(METRIC_FAILURES, 1);
+      send_reply(fd, clientaddr, "UNK\n", 4);
       rvalue = 2;
-      break;
-    };
-
-    //    log_json(peer, buffer);
-    if (clientaddr)
-      sendto(fd, "OK\n", 3, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "OK\n", 3);
-    break;
     }
+    break;
   case '!':
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Emergency Message\n");
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+      diag_note(DIAG_PACKETS, 0, "  Emergency Message\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
   case 'A':
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Alarm Message\n");
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+      diag_note(DIAG_PACKETS, 0, "  Alarm Message\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
   case 'B':
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Battery Message\n");
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+      diag_note(DIAG_PACKETS, 0, "  Battery Message\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
   case 'C':
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Control Message\n");
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+      diag_note(DIAG_PACKETS, 0, "  Control Message\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
     /* The is an *E*vent */
   case 'E':
     {
-      uint32_t ms = log_event_bytecode(peer, buffer, true);
+      uint32_t ms = log_event_bytecode(ps, buffer, true);
       if (mark_minute) {
-        mark_minute_into_stream(ms,fd,clientaddr,peer);
+        mark_minute_into_stream(ms,fd,clientaddr,ps);
       }
 
     if (gDEBUG)
       print_event_bytecode(buffer, true);
-    if (clientaddr)
-      sendto(fd, "OK\n", 3, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "OK\n", 3);
+    send_reply(fd, clientaddr, "OK\n", 3);
     rvalue = 1;
     }
     break;
   case 'F':
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Failure Message\n");
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+      diag_note(DIAG_PACKETS, 0, "  Failure Message\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
   case 'L':
     {
-    uint32_t ms = log_measurement_bytecode(peer, buffer, true);
+    uint32_t ms = log_measurement_bytecode(ps, buffer, true);
     if (mark_minute) {
-      mark_minute_into_stream(ms,fd,clientaddr,peer);
+      mark_minute_into_stream(ms,fd,clientaddr,ps);
     }
     if (gDEBUG)
       print_measurement_bytecode(buffer, true);
-    if (clientaddr)
-      sendto(fd, "OK\n", 3, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "OK\n", 3);
+    send_reply(fd, clientaddr, "OK\n", 3);
     }
     break;
   case 'M':
     {
-    uint32_t ms = log_measurement_bytecode(peer, buffer, true);
+    uint32_t ms = log_measurement_bytecode(ps, buffer, true);
     if (mark_minute) {
-      mark_minute_into_stream(ms,fd,clientaddr,peer);
+      mark_minute_into_stream(ms,fd,clientaddr,ps);
     }
     if (gDEBUG)
       print_measurement_bytecode(buffer, false);
-    if (clientaddr)
-      sendto(fd, "OK\n", 3, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "OK\n", 3);
+    send_reply(fd, clientaddr, "OK\n", 3);
+    }
+    break;
+  case 'N':
+    {
+    // Callers have checked that the whole record is there: UDP that
+    // multi_measurement_size accepts it, TCP that the frame it gives is
+    // complete (a bad count is rejected by get_multi_measurement_from_buffer).
+    MultiMeasurement mm = get_multi_measurement_from_buffer(buffer, MULTI_HEADER_SIZE + MULTI_CHANNEL_SIZE * buffer[1]);
+    if (mm.count == 0) {
+      if (gDEBUG)
+        diag_note(DIAG_PROBLEMS, 0, "  Invalid Multi-channel Measurement\n", NULL);
+      metric_count(METRIC_FAILURES, 1);
+      send_reply(fd, clientaddr, "UNK\n", 4);
+      rvalue = 2;
+      break;
+    }
+    uint32_t ms = log_multi_measurement(ps, &mm, true);
+    if (mark_minute) {
+      mark_minute_into_stream(ms,fd,clientaddr,ps);
+    }
+    if (gDEBUG)
+      print_multi_measurement(&mm, false);
+    send_reply(fd, clientaddr, "OK\n", 3);
     }
     break;
   case 'P':
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Param request\n");
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+      diag_note(DIAG_PACKETS, 0, "  Param request\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
   case 'S':
-    if (gDEBUG) {
-      fprintf(gFOUTPUT, "  aSsertion Message\n");
-    }
-    if (clientaddr)
-      sendto(fd, "NOP\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "NOP\n", 4);
+    if (gDEBUG)
+      diag_note(DIAG_PACKETS, 0, "  aSsertion Message\n", NULL);
+    send_reply(fd, clientaddr, "NOP\n", 4);
     rvalue = 1;
     break;
   default:
     if (gDEBUG)
-      fprintf(gFOUTPUT, "  Unknown %c Message\n", message_types[x].type);
-    if (clientaddr)
-      sendto(fd, "UNK\n", 4, flags, (struct sockaddr *) clientaddr, sizeof *clientaddr);
-    else
-      write(fd, "UNK\n", 4);
+      diag_note(DIAG_PROBLEMS, 0, "  Unknown %s Message\n", (char []) { message_types[x].type, 0 });
+    metric_count(METRIC_FAILURES, 1);
+    send_reply(fd, clientaddr, "UNK\n", 4);
     rvalue = 2;
     break;
   }
@@ -843,6 +3511,146 @@ size_t trimwhitespaceX(char *out, size_t len, const char *str)
 }
 
 
+// -J n: decode n JSON events (default 1000000) the way the logger used
+// to -- trimmed into a copy, classified with
+// get_event_designation_char_from_json and parsed again with
+// get_measurement_from_JSON or get_message_from_JSON -- and with
+// json_event_parse, check that both give the same events, and report
+// how long each took. Nothing is logged.
+#define BENCH_RUNS 5
+#define BENCH_SHAPES 4096
+
+int bench_json(int count) {
+  char (*events)[128] = malloc(BENCH_SHAPES * sizeof *events);
+  int *lens = malloc(BENCH_SHAPES * sizeof *lens);
+  if (!events || !lens) {
+    perror("bench");
+    return 1;
+  }
+  const char *types = "PDFHTA";
+  for (int i = 0; i < BENCH_SHAPES; i++) {
+    if (i % 10 == 9)
+      lens[i] = snprintf(events[i], sizeof events[i],
+                         "{ \"event\": \"E\", \"type\": \"M\", \"ms\": %d, \"buff\": \"alarm %d\" }\n",
+                         1000 + 20 * i, i);
+    else
+      lens[i] = snprintf(events[i], sizeof events[i],
+                         "{ \"event\": \"M\", \"type\": \"%c\", \"loc\": \"%c\", \"num\": %d, \"ms\": %d, \"val\": %d }\n",
+                         types[i % 6], i % 3 ? 'A' : 'B', i % 4, 1000 + 20 * i, (i * 7919) % 20001 - 10000);
+  }
+
+  double best[2] = { 1e9, 1e9 };
+  long mismatches = 0;
+  uint64_t check[2] = { 0, 0 };
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    for (int single = 0; single <= 1; single++) {
+      struct timespec t0, t1;
+      uint64_t sum = 0;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      for (int i = 0; i < count; i++) {
+        int k = i % BENCH_SHAPES;
+        Measurement m;
+        Message msg;
+        char c;
+        if (single) {
+          c = json_event_parse(events[k], lens[k], &m, &msg);
+        } else {
+          char lbuff[ONE_EVENT_BUFFER_SIZE];
+          trimwhitespaceX(lbuff, ONE_EVENT_BUFFER_SIZE, events[k]);
+          if (lbuff[0] != '{' || lbuff[strlen(lbuff) - 1] != '}')
+            continue;
+          c = get_event_designation_char_from_json(lbuff, ONE_EVENT_BUFFER_SIZE);
+          if (c == 'M' && strlen(lbuff) < ONE_EVENT_BUFFER_SIZE)
+            m = get_measurement_from_JSON(lbuff, ONE_EVENT_BUFFER_SIZE);
+          else if (c == 'E')
+            msg = get_message_from_JSON(lbuff, ONE_EVENT_BUFFER_SIZE);
+        }
+        // Fold what was decoded into a checksum, so that none of it can
+        // be optimized away and the two ways can be compared.
+        if (c == 'M')
+          sum = sum * 31 + m.type + 7 * m.loc + 11 * m.num + 13 * (uint64_t) m.ms + (uint32_t) m.val;
+        else if (c == 'E')
+          sum = sum * 31 + msg.type + 13 * (uint64_t) msg.ms + msg.buff[0] + strlen(msg.buff);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      double t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+      if (t < best[single])
+        best[single] = t;
+      check[single] = sum;
+    }
+  }
+  // Event by event, for the report.
+  for (int k = 0; k < BENCH_SHAPES; k++) {
+    Measurement m1, m2;
+    Message e1, e2;
+    char lbuff[ONE_EVENT_BUFFER_SIZE];
+    trimwhitespaceX(lbuff, ONE_EVENT_BUFFER_SIZE, events[k]);
+    char c1 = get_event_designation_char_from_json(lbuff, ONE_EVENT_BUFFER_SIZE);
+    char c2 = json_event_parse(events[k], lens[k], &m2, &e2);
+    if (c1 == 'M')
+      m1 = get_measurement_from_JSON(lbuff, ONE_EVENT_BUFFER_SIZE);
+    else if (c1 == 'E')
+      e1 = get_message_from_JSON(lbuff, ONE_EVENT_BUFFER_SIZE);
+    if (c1 != c2 ||
+        (c1 == 'M' && (m1.type != m2.type || m1.loc != m2.loc || m1.num != m2.num ||
+                       m1.ms != m2.ms || m1.val != m2.val)) ||
+        (c1 == 'E' && (e1.type != e2.type || e1.ms != e2.ms || strcmp(e1.buff, e2.buff))))
+      mismatches++;
+  }
+  printf("json: %d events, current %.2f ms (%.0f ns/event), single pass %.2f ms (%.0f ns/event), %.1fx, %s\n",
+         count, best[0] * 1e3, best[0] * 1e9 / count, best[1] * 1e3, best[1] * 1e9 / count,
+         best[1] > 0 ? best[0] / best[1] : 0.0,
+         mismatches || check[0] != check[1] ? "events DIFFER" : "events identical");
+  free(events);
+  free(lens);
+  return mismatches || check[0] != check[1];
+}
+
+// Process one datagram that has already been received into buf.
+// buf must have room for a terminating null at buf[len].
+void handle_udp_datagram(uint8_t *buf, int len, int listenfd, struct sockaddr_in *clientaddr, time_t now) {
+  buf[len] = '\0';
+
+  struct peer_state *ps = peer_lookup(clientaddr->sin_addr.s_addr, now);
+  char *peer = ps->name;
+  bool new_minute = peer_new_period(ps, now);
+  metrics_peer = ps;
+  metric_count(METRIC_PACKETS, 1);
+  metric_count(METRIC_BYTES, len);
+
+  if (gDEBUG)
+    diag_arrival(DIAG_ARRIVAL, peer, len, now);
+  //    This is a bit of a problem---we support both bytes and
+  //      JSON, but have no truly excellent way of deciding which!
+  // A MultiMeasurement is as long as it says (a newline may follow).
+  uint16_t multi;
+  // A batch says so at the start.
+  if (handle_batch(buf, len, listenfd, clientaddr, ps, new_minute)) {
+    // logged and acknowledged
+  } else if ((multi = multi_measurement_size(buf, len)) &&
+             json_rest_empty((const char *) buf + multi, (const char *) buf + len)) {
+    handle_event(buf, listenfd, clientaddr, ps, new_minute);
+  } else if (buf[0] == 'N') {
+    // Not a whole MultiMeasurement; handle_event would read past it.
+    if (gDEBUG)
+      diag_note(DIAG_PROBLEMS, 0, "  Invalid Multi-channel Measurement\n", NULL);
+    metric_count(METRIC_FAILURES, 1);
+    send_reply(listenfd, clientaddr, "UNK\n", 4);
+  // If the len == PIRDS_MEASUREMENT_PACKET, we are byte buffer message!
+  } else if (len != PIRDS_MEASUREMENT_PACKET) {
+    if (gDEBUG)
+      diag_note(DIAG_PACKETS, 0, "%s\n", (char *) buf);
+    // Anything else is taken as JSON, parsed where it was received.
+    if (!handle_json_event((const char *) buf, len, listenfd, clientaddr, ps, new_minute)) {
+      if (gDEBUG)
+        diag_note(DIAG_PROBLEMS, 0, "INVALID, not processing: [%s]\n", (char *) buf);
+      metric_count(METRIC_FAILURES, 1);
+    }
+  } else {
+    handle_event(buf, listenfd, clientaddr, ps, new_minute);    }
+  metrics_peer = NULL;
+}
+
 //client connection
 void handle_udp_connx(int listenfd) {
   struct sockaddr_in clientaddr;
@@ -850,187 +3658,938 @@ void handle_udp_connx(int listenfd) {
 
   // MSG_WAITALL or 0????
   int len = recvfrom(listenfd, buffer, BSIZE-1, MSG_WAITALL, (struct sockaddr *) &clientaddr, &addrlen);
+  if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    // idle (SO_RCVTIMEO expired) or interrupted by a signal
+    rollup_tick(time(NULL));
+    log_cache_flush_all();
+    return;
+  }
+
+  time_t now = time(NULL);
 
-  // Exprimental: Create the time before the fork and "mark off" if we are the first
-  // in this minute. The child process which is the first in the minute immediate injects a
-  // clock event.
-  unsigned long xnow = time(NULL);
-  unsigned long cur_minute = xnow / 10;
-  bool new_minute = (cur_minute != epoch_minute);
-  epoch_minute = cur_minute;
+  if (len == -1) {
+    if (gDEBUG)
+      diag_note(DIAG_PROBLEMS, now, "recvfrom error\n", NULL);
+    return;
+  }
+  handle_udp_datagram(buffer, len, listenfd, &clientaddr, now);
+  log_cache_tick();
+}
 
+// Batched version of handle_udp_connx: one recvmmsg() returns every
+// datagram already queued on the socket (up to UDP_BATCH), and we then
+// run each of them through handle_event in arrival order.
+void handle_udp_batch(int listenfd) {
+  static __thread struct mmsghdr msgs[UDP_BATCH];
+  static __thread struct iovec iovecs[UDP_BATCH];
+  static __thread struct sockaddr_in clientaddrs[UDP_BATCH];
+
+  for (int i = 0; i < UDP_BATCH; i++) {
+    iovecs[i].iov_base = batch_buffers[i];
+    // leave room for the terminating null added by handle_udp_datagram
+    iovecs[i].iov_len = UDP_BATCH_BUFFER_SIZE - 1;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &clientaddrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof clientaddrs[i];
+    msgs[i].msg_hdr.msg_control = NULL;
+    msgs[i].msg_hdr.msg_controllen = 0;
+    msgs[i].msg_hdr.msg_flags = 0;
+  }
 
-  if (gDEBUG) {
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
-    fprintf(gFOUTPUT, "%d%02d%02d %02d:%02d:%02d ", tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+  // MSG_WAITFORONE: block for the first datagram, then take whatever
+  // else is already waiting without blocking again.
+  int n = recvmmsg(listenfd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    rollup_tick(time(NULL));
+    log_cache_flush_all();
+    return;
   }
 
-  if (len == -1) {
+  time_t now = time(NULL);
+
+  if (n == -1) {
     if (gDEBUG)
-      fprintf(gFOUTPUT, "recvfrom error\n");
+      diag_note(DIAG_PROBLEMS, now, "recvmmsg error\n", NULL);
     return;
   }
-  buffer[len] = '\0';
 
-  char peer[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET, &clientaddr.sin_addr, peer, sizeof peer);
+  batch_syscalls++;
+  batch_packets += n;
+  if (gDEBUG)
+    diag_numbers(DIAG_STATS, DIAG_RECVMMSG, n, batch_packets, batch_syscalls);
 
-  if (gDEBUG) {
-    fprintf(gFOUTPUT, "(%s) ", peer);
-    fprintf(gFOUTPUT, "len: [%d]\n", len);
-    //    fprintf(gFOUTPUT, "(%s)\n", buffer);
+  for (int i = 0; i < n; i++) {
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      if (gDEBUG)
+        diag_note(DIAG_PROBLEMS, now, "datagram too long, dropped\n", NULL);
+      metric_count(METRIC_FAILURES, 1);
+      continue;
+    }
+    handle_udp_datagram(batch_buffers[i], msgs[i].msg_len, listenfd, &clientaddrs[i], now);
   }
-  //    This is a bit of a problem---we support both bytes and
-  //      JSON, but have no truly excellent way of deciding which!
-  // If the len == 14, we are byte buffer message!
-  if (len != 14) {
-    char lbuff[ONE_EVENT_BUFFER_SIZE];
-    size_t res = trimwhitespaceX(lbuff, ONE_EVENT_BUFFER_SIZE, (const char *) buffer);
-    if (gDEBUG) {
-      fprintf(gFOUTPUT,"%s\n",lbuff);
-      fflush(gFOUTPUT);
+  log_cache_tick();
+}
+
+#ifdef HAVE_IO_URING
+// The io_uring engine (-u). Each UDP worker keeps one multishot
+// IORING_OP_RECVMSG armed on its socket; the kernel picks a receive
+// buffer from a provided buffer ring for every datagram, so receiving
+// needs no system call per packet. Log lines are staged in memory and
+// appended with one IORING_OP_WRITEV per peer file, and acks go out as
+// IORING_OP_SENDMSG. A second ring carries the writes, so we can wait
+// for writes without disturbing receive completions.
+//
+// Only one batch of writes is in flight at a time: a new batch is
+// submitted after the previous one has completed, which keeps each
+// file's records in order. Meanwhile new lines go into the other of
+// two staging areas.
+//
+// If the kernel lacks anything we need (5.19+ for buffer rings, 6.0+
+// for multishot recvmsg) uring_receive_loop returns false and the
+// worker uses the recvfrom/recvmmsg path instead.
+#define URING_ENTRIES 1024
+#define URING_WRITE_ENTRIES 256
+#define URING_BUFFERS 256     // power of two
+#define URING_BGID 1
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + UDP_BATCH_BUFFER_SIZE)
+#define URING_STAGE_SIZE (1024*1024)
+#define URING_STAGE_RECORDS 8192
+#define URING_STAGE_SLACK (64*1024) // flush when less room than this is left
+#define URING_ACKS 1024
+
+#define URING_RECV_TAG 1ULL
+#define URING_ACK_TAG  (1ULL << 32)
+
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned sqe_tail;         // our copy, published by uring_submit
+  unsigned to_submit;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+struct uring_stage {
+  char *data;
+  size_t used;
+  int nrecs;
+  struct {
+    char peer[INET6_ADDRSTRLEN];
+    uint8_t stream;
+    uint32_t off, len;
+  } *recs;
+};
+
+struct uring_ack {
+  struct msghdr mh;
+  struct iovec iov;
+  struct sockaddr_in addr;
+  char reply[8];
+};
+
+__thread struct uring urecv, uwrite;
+__thread struct io_uring_buf_ring *ubufring = NULL;
+__thread uint8_t *ubufs = NULL;
+__thread unsigned ubuf_tail = 0;
+__thread struct uring_stage ustage[2];
+__thread int ustage_cur = 0;
+__thread int uwrites_inflight = 0;
+__thread struct timespec uwrites_started; // when the batch in flight was submitted
+__thread struct iovec *uwrite_iov = NULL;
+__thread struct uring_ack *uacks = NULL;
+__thread int *uack_free = NULL;
+__thread int uack_nfree = 0;
+
+int uring_setup_ring(struct uring *r, unsigned entries, struct io_uring_params *p) {
+  memset(r, 0, sizeof *r);
+  r->fd = syscall(__NR_io_uring_setup, entries, p);
+  if (r->fd < 0)
+    return -1;
+  r->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  r->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len)
+      r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+    return -1;
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED)
+      return -1;
+  }
+  r->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    return -1;
+  r->sq_head = (unsigned *)((char *) r->sq_ptr + p->sq_off.head);
+  r->sq_tail = (unsigned *)((char *) r->sq_ptr + p->sq_off.tail);
+  r->sq_mask = (unsigned *)((char *) r->sq_ptr + p->sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *) r->sq_ptr + p->sq_off.array);
+  r->cq_head = (unsigned *)((char *) r->cq_ptr + p->cq_off.head);
+  r->cq_tail = (unsigned *)((char *) r->cq_ptr + p->cq_off.tail);
+  r->cq_mask = (unsigned *)((char *) r->cq_ptr + p->cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *) r->cq_ptr + p->cq_off.cqes);
+  r->sq_entries = p->sq_entries;
+  r->sqe_tail = *r->sq_tail;
+  return 0;
+}
+
+void uring_close_ring(struct uring *r) {
+  if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+  if (r->fd >= 0) close(r->fd);
+  memset(r, 0, sizeof *r);
+  r->fd = -1;
+}
+
+// A zeroed SQE, or NULL if the submission queue is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (r->sqe_tail - head >= r->sq_entries)
+    return NULL;
+  unsigned idx = r->sqe_tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof *sqe);
+  r->sq_array[idx] = idx;
+  r->sqe_tail++;
+  r->to_submit++;
+  return sqe;
+}
+
+// Submit what has been queued and wait for min_complete completions,
+// for at most timeout_ms if that is not negative.
+int uring_enter(struct uring *r, unsigned min_complete, int timeout_ms) {
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  if (min_complete && timeout_ms >= 0) {
+    struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.ts = (uint64_t)(uintptr_t) &ts;
+    ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete,
+                  flags | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+  } else {
+    if (r->to_submit == 0 && min_complete == 0)
+      return 0;
+    ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete, flags, NULL, 0);
+  }
+  if (ret >= 0)
+    r->to_submit -= ret < (int) r->to_submit ? ret : r->to_submit;
+  else if (errno == ETIME || errno == EINTR || errno == EBUSY)
+    r->to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Hand receive buffer bid back to the kernel (published by uring_publish_buffers).
+void uring_recycle_buffer(unsigned bid) {
+  struct io_uring_buf *b = &ubufring->bufs[ubuf_tail & (URING_BUFFERS - 1)];
+  b->addr = (uint64_t)(uintptr_t)(ubufs + (size_t) bid * (URING_BUF_SIZE + 1));
+  b->len = URING_BUF_SIZE;
+  b->bid = bid;
+  ubuf_tail++;
+}
+
+void uring_publish_buffers() {
+  __atomic_store_n(&ubufring->tail, (uint16_t) ubuf_tail, __ATOMIC_RELEASE);
+}
+
+__thread struct msghdr urecv_msg;
+
+bool uring_arm_recv(int listenfd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&urecv);
+  if (!sqe) {
+    uring_enter(&urecv, 0, -1);
+    sqe = uring_get_sqe(&urecv);
+    if (!sqe) return false;
+  }
+  memset(&urecv_msg, 0, sizeof urecv_msg);
+  urecv_msg.msg_namelen = sizeof(struct sockaddr_in);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = listenfd;
+  sqe->addr = (uint64_t)(uintptr_t) &urecv_msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = URING_RECV_TAG;
+  return true;
+}
+
+void uring_stage_line(char *peer, uint8_t stream, const char *line, int len) {
+  struct uring_stage *st = &ustage[ustage_cur];
+  if (st->nrecs == URING_STAGE_RECORDS || st->used + len > URING_STAGE_SIZE)
+    uring_flush_writes(true);
+  st = &ustage[ustage_cur];
+  memcpy(st->data + st->used, line, len);
+  strcpy(st->recs[st->nrecs].peer, peer);
+  st->recs[st->nrecs].stream = stream;
+  st->recs[st->nrecs].off = st->used;
+  st->recs[st->nrecs].len = len;
+  st->nrecs++;
+  st->used += len;
+}
+
+bool uring_queue_ack(int fd, struct sockaddr_in *clientaddr, const char *reply, int len) {
+  if (uack_nfree == 0 || len > (int) sizeof uacks[0].reply)
+    return false;
+  struct io_uring_sqe *sqe = uring_get_sqe(&urecv);
+  if (!sqe)
+    return false;
+  int slot = uack_free[--uack_nfree];
+  struct uring_ack *a = &uacks[slot];
+  memcpy(a->reply, reply, len);
+  a->addr = *clientaddr;
+  a->iov.iov_base = a->reply;
+  a->iov.iov_len = len;
+  memset(&a->mh, 0, sizeof a->mh);
+  a->mh.msg_name = &a->addr;
+  a->mh.msg_namelen = sizeof a->addr;
+  a->mh.msg_iov = &a->iov;
+  a->mh.msg_iovlen = 1;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t) &a->mh;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_CONFIRM;
+  sqe->user_data = URING_ACK_TAG | slot;
+  return true;
+}
+
+void uring_reap_writes() {
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_peek_cqe(&uwrite))) {
+    if (cqe->res < 0 && gDEBUG)
+      diag_note(DIAG_PROBLEMS, 0, "io_uring write: %s\n", strerror(-cqe->res));
+    if (--uwrites_inflight == 0)
+      metric_write_since(&uwrites_started);
+    uring_cqe_seen(&uwrite);
+  }
+}
+
+// Queue writev(fd, iov, n), as linked SQEs of at most IOV_MAX each.
+// Submit the writes queued so far, e.g. before closing files.
+void uring_submit_writes() {
+  uring_enter(&uwrite, 0, -1);
+}
+
+void uring_queue_writev(int fd, struct iovec *iov, int n) {
+  for (int done = 0; done < n; done += IOV_MAX) {
+    int k = n - done < IOV_MAX ? n - done : IOV_MAX;
+    struct io_uring_sqe *sqe = uring_get_sqe(&uwrite);
+    if (!sqe) {
+      uring_enter(&uwrite, 0, -1);
+      sqe = uring_get_sqe(&uwrite);
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) &iov[done];
+    sqe->len = k;
+    sqe->off = (uint64_t) -1; // current position; the file is O_APPEND anyway
+    if (done + k < n)
+      sqe->flags = IOSQE_IO_LINK;
+    uwrites_inflight++;
+  }
+}
+
+// Wait for the writes in flight, then submit the staged lines: one
+// IORING_OP_WRITEV per peer and stream (several linked ones if there
+// are more than IOV_MAX lines). With wait set, also wait for these to
+// finish.
+void uring_flush_writes(bool wait) {
+  while (uwrites_inflight > 0) {
+    if (uring_enter(&uwrite, 1, -1) < 0 && errno != EINTR && errno != ETIME)
+      break;
+    uring_reap_writes();
+  }
+
+  struct uring_stage *st = &ustage[ustage_cur];
+  if (st->nrecs > 0) {
+    // Group the lines by peer and stream, keeping each peer's lines in order.
+    static __thread int group_of[URING_STAGE_RECORDS];
+    static __thread int group_start[URING_STAGE_RECORDS + 1];
+    static __thread int group_first[URING_STAGE_RECORDS];
+    static __thread int group_next[URING_STAGE_RECORDS];
+    static __thread int group_buckets[LOG_CACHE_BUCKETS];
+    int ngroups = 0;
+    memset(group_buckets, -1, sizeof group_buckets);
+    for (int k = 0; k < st->nrecs; k++) {
+      unsigned hb = log_cache_hash(st->recs[k].peer);
+      int j;
+      for (j = group_buckets[hb]; j != -1; j = group_next[j])
+        if (st->recs[group_first[j]].stream == st->recs[k].stream &&
+            strcmp(st->recs[group_first[j]].peer, st->recs[k].peer) == 0)
+          break;
+      if (j < 0) {
+        j = ngroups++;
+        group_first[j] = k;
+        group_start[j] = 0;
+        group_next[j] = group_buckets[hb];
+        group_buckets[hb] = j;
+      }
+      group_of[k] = j;
+      group_start[j]++;
+    }
+    int start = 0;
+    for (int j = 0; j < ngroups; j++) {
+      int c = group_start[j];
+      group_start[j] = start;
+      start += c;
     }
-      if ((lbuff[0] != '{') || (lbuff[strlen(lbuff) -1] != '}')) {
-	if (gDEBUG) {
-	  fprintf(gFOUTPUT,"INVALID, not processing: [%s]\n",lbuff);
-	  fflush(gFOUTPUT);
-	}
+    group_start[ngroups] = start;
+    int fill[ngroups];
+    memcpy(fill, group_start, ngroups * sizeof(int));
+    for (int k = 0; k < st->nrecs; k++) {
+      struct iovec *v = &uwrite_iov[fill[group_of[k]]++];
+      v->iov_base = st->data + st->recs[k].off;
+      v->iov_len = st->recs[k].len;
+    }
+
+    // Heap entries of segment records go in the second half of uwrite_iov.
+    struct iovec *heap_iov = uwrite_iov + URING_STAGE_RECORDS;
+    int nheap = 0;
+    metric_clock(&uwrites_started);
+    for (int j = 0; j < ngroups; j++) {
+      char *peer = st->recs[group_first[j]].peer;
+      uint8_t stream = st->recs[group_first[j]].stream;
+      // Opening this peer's file may close another cached one; submit
+      // first so that no queued SQE refers to a closed descriptor.
+      if (!log_cache_lookup(peer, stream))
+        uring_enter(&uwrite, 0, -1);
+      struct log_handle *h = open_log_file(peer, stream);
+      if (!h)
+        continue;
+      struct iovec *iov = &uwrite_iov[group_start[j]];
+      int n = group_start[j+1] - group_start[j];
+      if (stream == LOG_SEGMENT) {
+        int first_heap = nheap;
+        for (int k = 0; k < n; k++) {
+          segment_split(h, iov[k].iov_base, iov[k].iov_len, &iov[k], &heap_iov[nheap]);
+          if (heap_iov[nheap].iov_len > 0)
+            nheap++;
+        }
+        uring_queue_writev(fileno(h->heap_fp), &heap_iov[first_heap], nheap - first_heap);
       } else {
-      handle_event((uint8_t *)lbuff, listenfd, &clientaddr, peer, new_minute);
+        for (int k = 0; k < n; k++) {
+          log_index_note(h, iov[k].iov_base);
+          h->size += iov[k].iov_len;
+        }
+        if (h->idx_fp)
+          fflush(h->idx_fp);
+      }
+      uring_queue_writev(fileno(h->fp), iov, n);
     }
-  } else {
-    handle_event((uint8_t *)buffer, listenfd, &clientaddr, peer, new_minute);    }
+    uring_enter(&uwrite, 0, -1);
+    // The other staging area is free: its writes completed above.
+    ustage_cur ^= 1;
+    ustage[ustage_cur].used = 0;
+    ustage[ustage_cur].nrecs = 0;
+  }
+
+  if (wait) {
+    while (uwrites_inflight > 0) {
+      if (uring_enter(&uwrite, 1, -1) < 0 && errno != EINTR && errno != ETIME)
+        break;
+      uring_reap_writes();
+    }
+  }
 }
 
-void handle_tcp_connx(int listenfd) {
-  // listen for incoming connections
-  if (listen(listenfd, 1000000) != 0 ) {
-    perror("listen() error");
-    return;
+void uring_teardown() {
+  uring_close_ring(&urecv);
+  uring_close_ring(&uwrite);
+  if (ubufring) munmap(ubufring, URING_BUFFERS * sizeof(struct io_uring_buf));
+  ubufring = NULL;
+  free(ubufs);
+  ubufs = NULL;
+  for (int i = 0; i < 2; i++) {
+    free(ustage[i].data);
+    free(ustage[i].recs);
+    ustage[i].data = NULL;
+    ustage[i].recs = NULL;
+  }
+  free(uwrite_iov);
+  free(uacks);
+  free(uack_free);
+  uwrite_iov = NULL;
+  uacks = NULL;
+  uack_free = NULL;
+}
+
+bool uring_init(int listenfd) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  urecv.fd = uwrite.fd = -1;
+  if (uring_setup_ring(&urecv, URING_ENTRIES, &p) != 0)
+    return false;
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    errno = ENOSYS;
+    return false;
+  }
+  struct io_uring_params pw;
+  memset(&pw, 0, sizeof pw);
+  if (uring_setup_ring(&uwrite, URING_WRITE_ENTRIES, &pw) != 0)
+    return false;
+
+  ubufring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ubufring == MAP_FAILED) {
+    ubufring = NULL;
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (uint64_t)(uintptr_t) ubufring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, urecv.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    return false;
+
+  // One spare byte per buffer for the terminating null handle_udp_datagram adds.
+  ubufs = malloc((size_t) URING_BUFFERS * (URING_BUF_SIZE + 1));
+  uwrite_iov = malloc(2 * URING_STAGE_RECORDS * sizeof(struct iovec));
+  uacks = malloc(URING_ACKS * sizeof(struct uring_ack));
+  uack_free = malloc(URING_ACKS * sizeof(int));
+  for (int i = 0; i < 2; i++) {
+    ustage[i].data = malloc(URING_STAGE_SIZE);
+    ustage[i].recs = malloc(URING_STAGE_RECORDS * sizeof(*ustage[i].recs));
+    ustage[i].used = 0;
+    ustage[i].nrecs = 0;
+    if (!ustage[i].data || !ustage[i].recs)
+      return false;
+  }
+  if (!ubufs || !uwrite_iov || !uacks || !uack_free)
+    return false;
+  for (int i = 0; i < URING_ACKS; i++)
+    uack_free[i] = i;
+  uack_nfree = URING_ACKS;
+
+  ubuf_tail = 0;
+  for (unsigned bid = 0; bid < URING_BUFFERS; bid++)
+    uring_recycle_buffer(bid);
+  uring_publish_buffers();
+  return uring_arm_recv(listenfd);
+}
+
+// Handle one receive completion; returns false if multishot receive
+// turned out not to be supported.
+bool uring_handle_recv(int listenfd, struct io_uring_cqe *cqe, time_t now, unsigned long *packets) {
+  if (cqe->res < 0) {
+    if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+      return false;
+    if (cqe->res != -ENOBUFS && gDEBUG)
+      diag_note(DIAG_PROBLEMS, 0, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+  } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *b = ubufs + (size_t) bid * (URING_BUF_SIZE + 1);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) b;
+    struct sockaddr_in *clientaddr = (struct sockaddr_in *)(out + 1);
+    uint8_t *payload = (uint8_t *)(out + 1) + urecv_msg.msg_namelen + urecv_msg.msg_controllen;
+    if (out->flags & MSG_TRUNC) {
+      if (gDEBUG)
+        diag_note(DIAG_PROBLEMS, now, "datagram too long, dropped\n", NULL);
+      metric_count(METRIC_FAILURES, 1);
+    } else {
+      handle_udp_datagram(payload, out->payloadlen, listenfd, clientaddr, now);
+      (*packets)++;
+    }
+    uring_recycle_buffer(bid);
+  }
+  // The kernel stops a multishot request when it runs out of buffers
+  // (or on error); put it back.
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring_arm_recv(listenfd);
+  return true;
+}
+
+// The receive loop for -u. Returns false, before anything has been
+// received, if io_uring cannot be used; the caller then falls back to
+// the ordinary loop.
+bool uring_receive_loop(int listenfd) {
+  if (!uring_init(listenfd)) {
+    if (gDEBUG)
+      fprintf(gFOUTPUT, "io_uring unavailable (%s), using the recvfrom path\n", strerror(errno));
+    uring_teardown();
+    return false;
+  }
+  uring_active = true;
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "io_uring receive engine started\n");
+
+  unsigned long packets = 0, enters = 0;
+  bool started = false;
+  while (!gSTOP) {
+    int ret = uring_enter(&urecv, 1, LOG_IDLE_FLUSH * 1000);
+    enters++;
+    time_t now = time(NULL);
+    if (ret < 0 && errno != ETIME && errno != EINTR) {
+      perror("io_uring_enter");
+      break;
+    }
+
+    unsigned long before = packets;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&urecv))) {
+      if (cqe->user_data & URING_ACK_TAG) {
+        uack_free[uack_nfree++] = (int)(cqe->user_data & 0xffffffff);
+      } else if (cqe->user_data == URING_RECV_TAG) {
+        if (!uring_handle_recv(listenfd, cqe, now, &packets)) {
+          if (started) {
+            diag_note(DIAG_PROBLEMS, 0, "io_uring multishot receive failed\n", NULL);
+            gSTOP = 1;
+          } else {
+            uring_cqe_seen(&urecv);
+            uring_active = false;
+            uring_teardown();
+            if (gDEBUG)
+              diag_note(DIAG_PROBLEMS, 0, "io_uring multishot receive unsupported, using the recvfrom path\n", NULL);
+            return false;
+          }
+        }
+        started = true;
+      }
+      uring_cqe_seen(&urecv);
+      // Make sure the staging area can take another datagram's worth of lines.
+      if (ustage[ustage_cur].used > URING_STAGE_SIZE - URING_STAGE_SLACK)
+        uring_flush_writes(false);
+    }
+    uring_publish_buffers();
+    uring_reap_writes();
+    if (gROLLUP && now != log_cache_last_tick) {
+      log_cache_last_tick = now;
+      rollup_tick(now);
+    }
+
+    if (packets == before) {
+      // idle: write out everything
+      uring_flush_writes(true);
+    } else {
+      if (gDEBUG)
+        diag_numbers(DIAG_STATS, DIAG_URING, packets - before, packets, enters);
+      if (uwrites_inflight == 0)
+        uring_flush_writes(false);
+    }
   }
+  rollup_flush_all();
+  uring_flush_writes(true);
+  uring_active = false;
+  uring_teardown();
+  return true;
+}
+#else
+bool uring_receive_loop(int listenfd) {
+  if (gDEBUG)
+    fprintf(gFOUTPUT, "io_uring not available in this build, using the recvfrom path\n");
+  return false;
+}
+void uring_stage_line(char *peer, uint8_t stream, const char *line, int len) {}
+void uring_flush_writes(bool wait) {}
+void uring_submit_writes() {}
+bool uring_queue_ack(int fd, struct sockaddr_in *clientaddr, const char *reply, int len) { return false; }
+#endif
+
+// TCP connections are served by a single event loop per worker
+// instead of a forked process per connection. Each connection has a
+// small state object taken from a fixed pool, so memory is bounded by
+// gMAX_CONNS no matter how many devices connect. Connections are kept
+// on a list ordered by last activity; since every connection has the
+// same DATA_TIMEOUT, the idle ones are always at the head of the list.
+#define TCP_LISTENER ((uint32_t) -1)
+
+struct tcp_conn {
+  int fd;                    // -1 when the slot is free
+  uint32_t addr;
+  char peer[INET6_ADDRSTRLEN];
+  time_t last_active;
+  int prev, next;            // idle list, or free list through next
+  uint8_t *rbuf;             // TCP_CONN_BUFFER bytes, see tcp_dispatch()
+  int rlen;                  // bytes of an incomplete frame carried over
+};
+
+__thread struct tcp_conn *tcp_conns = NULL;
+__thread int tcp_idle_head = -1, tcp_idle_tail = -1;
+__thread int tcp_free = -1;
+__thread int tcp_open_conns = 0;
+
+void tcp_idle_unlink(int i) {
+  struct tcp_conn *c = &tcp_conns[i];
+  if (c->prev != -1) tcp_conns[c->prev].next = c->next; else tcp_idle_head = c->next;
+  if (c->next != -1) tcp_conns[c->next].prev = c->prev; else tcp_idle_tail = c->prev;
+}
+
+void tcp_idle_append(int i) {
+  struct tcp_conn *c = &tcp_conns[i];
+  c->prev = tcp_idle_tail;
+  c->next = -1;
+  if (tcp_idle_tail != -1) tcp_conns[tcp_idle_tail].next = i; else tcp_idle_head = i;
+  tcp_idle_tail = i;
+}
 
-  // Ignore SIGCHLD to avoid zombie threads
-  signal(SIGCHLD,SIG_IGN);
-  //  signal(SIGCHLD,zombie_hunter);
+void tcp_touch(int i, time_t now) {
+  tcp_conns[i].last_active = now;
+  tcp_idle_unlink(i);
+  tcp_idle_append(i);
+}
 
-  // ACCEPT connections
-  pid_t ppid = getpid();
+void tcp_close(int epfd, int i, const char *why) {
+  struct tcp_conn *c = &tcp_conns[i];
+  if (gDEBUG)
+    diag_peer_note(DIAG_PACKETS, time(NULL), c->peer, why, 0, 0, 0);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  shutdown(c->fd, SHUT_RDWR);         //All further send and recieve operations are DISABLED...
+  close(c->fd);
+  c->fd = -1;
+  free(c->rbuf);
+  c->rbuf = NULL;
+  tcp_idle_unlink(i);
+  c->next = tcp_free;
+  tcp_free = i;
+  tcp_open_conns--;
+}
 
+void tcp_accept(int epfd, int listenfd) {
   while (1) {
     struct sockaddr_in clientaddr;
     socklen_t addrlen = sizeof clientaddr;
-    int clientfd = accept (listenfd, (struct sockaddr *) &clientaddr, &addrlen);
-
+    int clientfd = accept4(listenfd, (struct sockaddr *) &clientaddr, &addrlen, SOCK_NONBLOCK);
+    if (clientfd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && gDEBUG)
+        diag_note(DIAG_PROBLEMS, 0, "accept error\n", NULL);
+      return;
+    }
     if (gDEBUG > 2)
-      fprintf(gFOUTPUT, "accept (%d)\n", clientfd);
+      diag_peer_note(DIAG_PACKETS, 0, NULL, "accept (%d)\n", clientfd, 0, 0);
 
-    if (clientfd < 0) {
+    uint8_t *rbuf = tcp_free == -1 ? NULL : malloc(TCP_CONN_BUFFER);
+    if (!rbuf) {
       if (gDEBUG)
-	fprintf(gFOUTPUT, "accept error\n");
+        diag_peer_note(DIAG_PROBLEMS, 0, NULL, "too many connections (%d), refusing\n",
+                       tcp_open_conns, 0, 0);
+      close(clientfd);
+      continue;
+    }
+    int i = tcp_free;
+    struct tcp_conn *c = &tcp_conns[i];
+    tcp_free = c->next;
+
+    c->fd = clientfd;
+    c->addr = clientaddr.sin_addr.s_addr;
+    c->rbuf = rbuf;
+    c->rlen = 0;
+    inet_ntop(AF_INET, &clientaddr.sin_addr, c->peer, sizeof c->peer);
+    c->last_active = time(NULL);
+    tcp_idle_append(i);
+    tcp_open_conns++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, clientfd, &ev);
+
+    if (gDEBUG)
+      diag_peer_note(DIAG_PACKETS, c->last_active, c->peer, "Connected %d\n", clientfd, 0, 0);
+  }
+}
+
+// A TCP stream carries events back to back, and one recv() may return
+// several of them or end in the middle of one. Split the complete frames
+// out of c->rbuf and hand each to handle_event in place; an incomplete
+// frame at the end is moved to the front of the buffer and completed by
+// the next read. Frames are:
+//   {...}   a JSON event, ended by its closing brace (usually followed by a newline)
+//   M, L    a binary Measurement, PIRDS_MEASUREMENT_PACKET bytes as in a datagram
+//   E       a binary Message, PIRDS_MESSAGE_HEADER bytes and its text
+//   N       a binary MultiMeasurement, as long as it says
+//   other   anything else runs to the end of the line
+// Returns the number of events dispatched.
+int tcp_dispatch(struct tcp_conn *c, time_t now) {
+  struct peer_state *ps = peer_lookup(c->addr, now);
+  bool new_minute = peer_new_period(ps, now);
+  metrics_peer = ps;
+  uint8_t *p = c->rbuf;
+  uint8_t *end = c->rbuf + c->rlen;
+  int events = 0;
+
+  while (p < end) {
+    uint8_t *next;
+    if (*p == '{') {
+      // PIRDS JSON objects are flat, so the first closing brace outside
+      // a string ends the event.
+      bool in_string = false;
+      uint8_t *q;
+      for (q = p + 1; q < end; q++) {
+        if (in_string) {
+          if (*q == '\\') q++;
+          else if (*q == '"') in_string = false;
+        } else if (*q == '"') {
+          in_string = true;
+        } else if (*q == '}') {
+          break;
+        }
+      }
+      if (q >= end) break;
+      next = q + 1;
+      // handle_event and the JSON parser want a terminated string; the
+      // byte after the brace is a newline we no longer need (or the
+      // spare byte at the end of rbuf).
+      uint8_t saved = *next;
+      *next = '\0';
+      handle_event(p, c->fd, NULL, ps, new_minute);
+      *next = saved;
+    } else if (*p == 'M' || *p == 'L') {
+      if (end - p < PIRDS_MEASUREMENT_PACKET) break;
+      next = p + PIRDS_MEASUREMENT_PACKET;
+      handle_event(p, c->fd, NULL, ps, new_minute);
+    } else if (*p == 'E') {
+      if (end - p < PIRDS_MESSAGE_HEADER || end - p < PIRDS_MESSAGE_HEADER + p[6]) break;
+      next = p + PIRDS_MESSAGE_HEADER + p[6];
+      handle_event(p, c->fd, NULL, ps, new_minute);
+    } else if (*p == 'N') {
+      if (end - p < MULTI_HEADER_SIZE || end - p < MULTI_HEADER_SIZE + MULTI_CHANNEL_SIZE * p[1]) break;
+      next = p + MULTI_HEADER_SIZE + MULTI_CHANNEL_SIZE * p[1];
+      handle_event(p, c->fd, NULL, ps, new_minute);
+    } else if (isspace(*p) || *p == '\0') {
+      p++;
+      continue;
     } else {
+      uint8_t *nl = memchr(p, '\n', end - p);
+      if (!nl) break;
+      *nl = '\0';
+      handle_event(p, c->fd, NULL, ps, new_minute);
+      next = nl + 1;
+    }
+    p = next;
+    events++;
+    new_minute = false;
+  }
 
-      if (fork() == 0) { // the child
+  c->rlen = end - p;
+  if (c->rlen == TCP_CONN_BUFFER - 1) {
+    // A full buffer without one complete frame: the stream is garbage.
+    if (gDEBUG)
+      diag_peer_note(DIAG_PROBLEMS, 0, c->peer, "frame too long, discarding %d bytes\n", c->rlen, 0, 0);
+    metric_count(METRIC_FAILURES, 1);
+    c->rlen = 0;
+  } else if (c->rlen && p != c->rbuf) {
+    memmove(c->rbuf, p, c->rlen);
+  }
+  return events;
+}
 
+void tcp_read(int epfd, int i) {
+  struct tcp_conn *c = &tcp_conns[i];
+  // Keep one spare byte so that a JSON frame ending the buffer can be terminated.
+  int rcvd = recv(c->fd, c->rbuf + c->rlen, TCP_CONN_BUFFER - 1 - c->rlen, 0);
+  if (rcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
 
-#if __linux__
-	if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1) {
-	  perror("prctl for child");
-	  exit(1);
-	}
-#endif
+  time_t now = time(NULL);
 
-#if 0
-	if (getppid() != ppid) exit(1);
-#endif
-	char peer[INET6_ADDRSTRLEN];
-	inet_ntop(AF_INET, &clientaddr.sin_addr, peer, sizeof peer);
-
-	time_t now = time(NULL);
-	struct tm *tm = localtime(&now);
-	if (gDEBUG) {
-	  fprintf(gFOUTPUT, "%d%02d%02d %02d:%02d:%02d ", tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
-	  fprintf(gFOUTPUT, "(%s) Connected %d\n", peer, clientfd);
-	  fflush(gFOUTPUT);
-	}
-
-	while(1) {
-          fflush(gFOUTPUT);
-	  int rcvd;
-#ifdef USESELECT
-	  fd_set fds;
-	  FD_ZERO(&fds);
-	  FD_SET(clientfd, &fds);
-
-	  struct timeval tv = {DATA_TIMEOUT, 0};
-
-	  uint8_t a = select(clientfd+1, &fds, NULL, NULL, &tv);
-	  if (a < 0) {
-	    now = time(NULL);
-	    tm = localtime(&now);
-	    if (gDEBUG) {
-	      fprintf(gFOUTPUT, "%d%02d%02d %02d:%02d:%02d ",
-		      tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
-	      fprintf(gFOUTPUT, "(%s) select error\n", peer);
-	      fflush(gFOUTPUT);
-	    }
-	    break;
-	  }
-	  if (a == 0) {
-	    now = time(NULL);
-	    tm = localtime(&now);
-	    if (gDEBUG) {
-	      fprintf(gFOUTPUT, "%d%02d%02d %02d:%02d:%02d ",
-		      tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
-	      fprintf(gFOUTPUT, "(%s) timeout\n", peer);
-	      fflush(gFOUTPUT);
-	    }
-	    break;
-	  }
-	  if (FD_ISSET(clientfd, &fds))
-	    rcvd = recv(clientfd, buffer, BSIZE, 0);
-	  else
-	    rcvd = -1;
-#else
-	  rcvd = recv(clientfd, buffer, BSIZE, 0);
-#endif
+  if (rcvd < 0) {    // receive error
+    if (gDEBUG)
+      diag_note(DIAG_PROBLEMS, now, "(%s)   read/recv error\n", c->peer);
+    tcp_close(epfd, i, "closed\n");
+    return;
+  } else if (rcvd == 0) {    // receive socket closed
+    if (gDEBUG)
+      diag_note(DIAG_PACKETS, now, "(%s)  Client disconnected\n", c->peer);
+    tcp_close(epfd, i, "closed\n");
+    return;
+  }
+  c->rlen += rcvd;
+  tcp_touch(i, now);
 
-	  now = time(NULL);
-	  tm = localtime(&now);
-	  if (gDEBUG) {
-	    fprintf(gFOUTPUT, "%d%02d%02d %02d:%02d:%02d ",
-		    tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
-	    fprintf(gFOUTPUT, "(%s) ", peer);
-	  }
-
-	  if (gDEBUG > 2)
-	    fprintf(gFOUTPUT, "[%d] ", getpid());
-
-	  if (rcvd < 0) {    // receive error
-	    if (gDEBUG)
-	      fprintf(gFOUTPUT, "  read/recv error\n");
-	    break;
-	  } else if (rcvd == 0) {    // receive socket closed
-	    if (gDEBUG)
-	      fprintf(gFOUTPUT, " Client disconnected\n");
-	    break;
-	  }
-
-	  // message received
-	  if (gDEBUG)
-	    fprintf(gFOUTPUT, "\x1b[32m + [%d]\x1b[0m\n", rcvd);
-
-          // I probably should do a "new_minute" calculation here,
-          // but I don't know how.
-	  handle_event(buffer, clientfd, NULL, peer, false);
-	}
-	//Closing SOCKET
-	fflush(gFOUTPUT);
-	shutdown(clientfd, SHUT_RDWR);         //All further send and recieve operations are DISABLED...
-	close(clientfd);
-      }
+  // message received
+  if (gDEBUG)
+    diag_arrival(DIAG_TCP_READ, c->peer, rcvd, now);
 
+  int events = tcp_dispatch(c, now);
+  // tcp_dispatch has looked the peer up.
+  metric_count(METRIC_PACKETS, 1);
+  metric_count(METRIC_BYTES, rcvd);
+  metrics_peer = NULL;
+  if (gDEBUG > 1)
+    diag_peer_note(DIAG_PACKETS, 0, c->peer, "%d events, %d bytes carried over\n", events, c->rlen, 0);
+}
 
+void handle_tcp_connx(int listenfd) {
+  // open_listener has already called listen().
+  int epfd = epoll_create1(0);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    gSTOP = 1;
+    return;
+  }
+  tcp_conns = calloc(gMAX_CONNS, sizeof(struct tcp_conn));
+  if (!tcp_conns) {
+    perror("tcp connections");
+    gSTOP = 1;
+    return;
+  }
+  for (int i = 0; i < gMAX_CONNS; i++) {
+    tcp_conns[i].fd = -1;
+    tcp_conns[i].next = i + 1 < gMAX_CONNS ? i + 1 : -1;
+  }
+  tcp_free = 0;
+
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = TCP_LISTENER;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+  struct epoll_event events[TCP_EVENTS];
+  while (!gSTOP) {
+    // Wake up at least once a second to expire idle connections and
+    // to flush the log files when the line is quiet.
+    int n = epoll_wait(epfd, events, TCP_EVENTS, LOG_IDLE_FLUSH * 1000);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int e = 0; e < n; e++) {
+      if (events[e].data.u32 == TCP_LISTENER)
+        tcp_accept(epfd, listenfd);
+      else
+        tcp_read(epfd, events[e].data.u32);
     }
+
+    time_t now = time(NULL);
+    while (tcp_idle_head != -1 && now - tcp_conns[tcp_idle_head].last_active >= DATA_TIMEOUT)
+      tcp_close(epfd, tcp_idle_head, "timeout\n");
+    if (n <= 0) {
+      rollup_tick(now);
+      log_cache_flush_all();
+    } else
+      log_cache_tick();
   }
+
+  for (int i = 0; i < gMAX_CONNS; i++)
+    if (tcp_conns[i].fd != -1)
+      tcp_close(epfd, i, "server stopping\n");
+  free(tcp_conns);
+  tcp_conns = NULL;
+  close(epfd);
 }
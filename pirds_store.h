@@ -0,0 +1,274 @@
+/* =====================================================================================
+ *
+ *       Filename:  pirds_store.h
+ *
+ *    Description:  The binary segment storage format shared by pirds_logger
+ *                  (which writes it) and pirds_webcgi (which reads it).
+ *
+ *        License:  MIT
+ *
+ * =====================================================================================
+ */
+
+#ifndef PIRDS_STORE_H
+#define PIRDS_STORE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Besides (or instead of) the text log 0Logfile.<peer>, the logger can
+// store every event as a fixed width record in 0Segment.<peer>. The text
+// of clock and message events goes into a side file, 0Heap.<peer>, and
+// the record points at it, so that every record has the same size and
+// record N is at SEGMENT_HEADER_SIZE + N * sizeof(struct segment_record).
+//
+// Records are in the byte order of the machine that wrote them; the
+// header says which one that was.
+
+#define SEGMENT_PREFIX "0Segment."
+#define HEAP_PREFIX "0Heap."
+
+#define SEGMENT_MAGIC "PIRDSSEG"
+#define SEGMENT_VERSION 1
+#define SEGMENT_BYTE_ORDER 0x01020304u
+
+struct segment_header {
+  char magic[8];             // SEGMENT_MAGIC, not null terminated
+  uint32_t version;
+  uint32_t record_size;      // sizeof(struct segment_record)
+  uint32_t byte_order;       // SEGMENT_BYTE_ORDER as written
+  uint8_t pad[12];
+};
+#define SEGMENT_HEADER_SIZE sizeof(struct segment_header)
+
+#define SEGMENT_NO_HEAP UINT64_MAX
+
+struct segment_record {
+  int64_t arrival;           // seconds since the epoch when the logger got it
+  int64_t epoch_ms;          // sample time, ms since the epoch
+  int32_t val;               // measurements only
+  char event;                // 'M', 'L' (a limit) or 'E'
+  char type;
+  char loc;                  // measurements only
+  uint8_t num;               // measurements only
+  // For events, the offset in the heap of a length byte followed by that
+  // many bytes of text; SEGMENT_NO_HEAP for measurements.
+  uint64_t heap_off;
+};
+
+_Static_assert(sizeof(struct segment_header) == 32, "segment header must be 32 bytes");
+_Static_assert(sizeof(struct segment_record) == 32, "segment record must be 32 bytes");
+
+static inline void segment_header_init(struct segment_header *h) {
+  memset(h, 0, sizeof *h);
+  memcpy(h->magic, SEGMENT_MAGIC, sizeof h->magic);
+  h->version = SEGMENT_VERSION;
+  h->record_size = sizeof(struct segment_record);
+  h->byte_order = SEGMENT_BYTE_ORDER;
+}
+
+static inline int segment_header_ok(const struct segment_header *h) {
+  return memcmp(h->magic, SEGMENT_MAGIC, sizeof h->magic) == 0 &&
+    h->version == SEGMENT_VERSION &&
+    h->record_size == sizeof(struct segment_record) &&
+    h->byte_order == SEGMENT_BYTE_ORDER;
+}
+
+// The text log has a sparse index, 0Index.<peer>: one entry for every
+// second in which a line was logged, giving the offset of the first
+// line of that second. Entries are in increasing time order. The index
+// is only a hint -- it may lag behind the log or have gaps (e.g. for
+// lines logged before it existed) -- so readers seek to the last entry
+// at or before the time they want and scan forward from there.
+#define INDEX_PREFIX "0Index."
+
+struct log_index_entry {
+  int64_t epoch_s;           // arrival time, as at the start of the line
+  int64_t offset;            // byte offset of that line in the log
+};
+
+// With -r the logger also keeps rollups: for every (type, loc, num)
+// of a peer, the count, sum, sum of squares, min, max, first and last
+// value of the measurements in each 1 s, 10 s and 1 min bucket of
+// sample time, one file per tier (0Rollup1s.<peer> etc.). A bucket is
+// written when it is closed, so the files are in time order except
+// after a device's clock is reset. A bucket is closed by the first
+// sample after it or, if none comes, ROLLUP_GRACE_MS after its end. The
+// header is a segment header with ROLLUP_MAGIC and the rollup record
+// size.
+#define ROLLUP_MAGIC "PIRDSRUP"
+#define ROLLUP_TIERS 3
+#define ROLLUP_GRACE_MS 2000
+
+static const struct {
+  const char *prefix;
+  int64_t ms;                // bucket width
+} rollup_tiers[ROLLUP_TIERS] = {
+  { "0Rollup1s.", 1000 },
+  { "0Rollup10s.", 10000 },
+  { "0Rollup1m.", 60000 },
+};
+
+struct rollup_record {
+  int64_t start_ms;          // start of the bucket, ms since the epoch
+  int64_t sum;
+  double sumsq;
+  uint32_t count;
+  int32_t min;
+  int32_t max;
+  int32_t first;
+  int32_t last;
+  char type;
+  char loc;
+  uint8_t num;
+  uint8_t pad;
+};
+
+_Static_assert(sizeof(struct rollup_record) == 48, "rollup record must be 48 bytes");
+
+static inline void rollup_header_init(struct segment_header *h) {
+  segment_header_init(h);
+  memcpy(h->magic, ROLLUP_MAGIC, sizeof h->magic);
+  h->record_size = sizeof(struct rollup_record);
+}
+
+static inline int rollup_header_ok(const struct segment_header *h) {
+  return memcmp(h->magic, ROLLUP_MAGIC, sizeof h->magic) == 0 &&
+    h->version == SEGMENT_VERSION &&
+    h->record_size == sizeof(struct rollup_record) &&
+    h->byte_order == SEGMENT_BYTE_ORDER;
+}
+
+// When the logger rolls a peer's log (-l / -L), its files move to
+// PARTS_DIR as a part named <peer>.<first arrival>, e.g.
+// 0Parts/0Logfile.10.0.0.1.1600000000 with 0Parts/0Index.10.0.0.1.1600000000
+// and so on, and the part is added to 0Manifest.<peer>. The manifest is
+// a text file with one line per part, oldest first:
+//   <part name> <first arrival> <last arrival> <bytes in all its files>
+// The peer's dataset is the parts in the manifest followed by its
+// current files. The logger rewrites the manifest (to a temporary file
+// that is then renamed) whenever it adds or deletes a part.
+#define PARTS_DIR "0Parts"
+#define MANIFEST_PREFIX "0Manifest."
+#define PART_NAME_MAX 96
+
+struct log_part {
+  char name[PART_NAME_MAX];
+  int64_t first;             // arrival times, seconds since the epoch
+  int64_t last;
+  int64_t bytes;
+};
+
+// Read a manifest into a new array of parts; returns how many there
+// are (0, with *parts NULL, if there is no manifest).
+static inline int manifest_read(const char *fname, struct log_part **parts) {
+  *parts = NULL;
+  FILE *fp = fopen(fname, "r");
+  if (!fp)
+    return 0;
+  int n = 0, cap = 0;
+  struct log_part p;
+  long long first, last, bytes;
+  char fmt[32];
+  snprintf(fmt, sizeof fmt, "%%%ds %%lld %%lld %%lld", PART_NAME_MAX - 1);
+  while (fscanf(fp, fmt, p.name, &first, &last, &bytes) == 4) {
+    if (n == cap) {
+      cap = cap ? 2 * cap : 64;
+      struct log_part *np = (struct log_part *) realloc(*parts, cap * sizeof p);
+      if (!np)
+        break;
+      *parts = np;
+    }
+    p.first = first;
+    p.last = last;
+    p.bytes = bytes;
+    (*parts)[n++] = p;
+  }
+  fclose(fp);
+  return n;
+}
+
+// The logger (with -C) keeps a catalog of the datasets in its directory,
+// 0Catalog, so that listing them does not take a stat (or a read) of
+// every file. It is a header followed by a fixed number of slots, one
+// per dataset, in the order they were created; the logger has it mapped
+// and updates a dataset's slot as it logs to it. The first count slots
+// are in use. A reader may see a slot that is being updated, so the
+// figures are only good for display.
+#define CATALOG_NAME "0Catalog"
+#define CATALOG_MAGIC "PIRDSCAT"
+#define CATALOG_SLOTS 65536
+
+struct catalog_header {
+  char magic[8];             // CATALOG_MAGIC, not null terminated
+  uint32_t version;
+  uint32_t slot_size;        // sizeof(struct catalog_entry)
+  uint32_t byte_order;       // SEGMENT_BYTE_ORDER as written
+  uint32_t slots;            // how many there is room for
+  uint32_t count;            // how many are in use
+  uint8_t pad[4];
+};
+
+struct catalog_entry {
+  char name[PART_NAME_MAX];  // as in 0Logfile.<name>
+  int64_t last_write;        // when the logger last logged to it
+  int64_t first_arrival;     // arrival times of its first and last records,
+  int64_t last_arrival;      // seconds since the epoch
+  int64_t first_ms;          // and their sample times, ms since the epoch
+  int64_t last_ms;
+  int64_t records;
+  int64_t bytes;             // about what all its files take, parts included
+};
+
+_Static_assert(sizeof(struct catalog_header) == 32, "catalog header must be 32 bytes");
+_Static_assert(sizeof(struct catalog_entry) == 152, "catalog entry must be 152 bytes");
+#define CATALOG_SIZE(slots) (sizeof(struct catalog_header) + (size_t) (slots) * sizeof(struct catalog_entry))
+
+static inline void catalog_header_init(struct catalog_header *h) {
+  memset(h, 0, sizeof *h);
+  memcpy(h->magic, CATALOG_MAGIC, sizeof h->magic);
+  h->version = SEGMENT_VERSION;
+  h->slot_size = sizeof(struct catalog_entry);
+  h->byte_order = SEGMENT_BYTE_ORDER;
+  h->slots = CATALOG_SLOTS;
+}
+
+static inline int catalog_header_ok(const struct catalog_header *h) {
+  return memcmp(h->magic, CATALOG_MAGIC, sizeof h->magic) == 0 &&
+    h->version == SEGMENT_VERSION &&
+    h->slot_size == sizeof(struct catalog_entry) &&
+    h->byte_order == SEGMENT_BYTE_ORDER &&
+    h->count <= h->slots;
+}
+
+// Measurements and limits carry loc, num and val instead of text.
+static inline int segment_record_is_measurement(const struct segment_record *r) {
+  return r->heap_off == SEGMENT_NO_HEAP || r->event == 'M' || r->event == 'L';
+}
+
+// Format r the way it appears in the text log, newline included. heap
+// and heap_size describe the mapped heap file. Returns the length, as
+// snprintf does.
+static inline int segment_record_to_line(const struct segment_record *r,
+                                         const uint8_t *heap, uint64_t heap_size,
+                                         char *line, size_t size) {
+  if (segment_record_is_measurement(r))
+    return snprintf(line, size, "%lld:%c:%c:%c:%u:%lld:%d\n",
+                    (long long) r->arrival, r->event, r->type, r->loc, r->num,
+                    (long long) r->epoch_ms, r->val);
+  const char *text = "";
+  int len = 0;
+  if (r->heap_off != SEGMENT_NO_HEAP && r->heap_off < heap_size) {
+    len = heap[r->heap_off];
+    if (r->heap_off + 1 + len > heap_size)
+      len = heap_size - r->heap_off - 1;
+    text = (const char *) heap + r->heap_off + 1;
+  }
+  return snprintf(line, size, "%lld:%c:%c:%lld:\"%.*s\"\n",
+                  (long long) r->arrival, r->event, r->type,
+                  (long long) r->epoch_ms, len, text);
+}
+
+#endif
@@ -38,11 +38,26 @@
 #include <signal.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "PIRDS.h"
+#include "pirds_store.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <limits.h>
+#include <math.h>
 
 
 #define EVARSIZE 512
-struct {
+// In daemon mode (see serve_http) every thread handles its own
+// request, so the request variables are per thread.
+__thread struct {
   char *name;
   char value[EVARSIZE];
 } evars[] = {
@@ -82,7 +97,12 @@ struct {
 // we need to be able to set this, for example to "/data".
 char *DIR_NAME = ".";
 
-char *scriptname;
+__thread char *scriptname;
+
+// Where the response goes: stdout for CGI, a memory buffer per request
+// in daemon mode.
+__thread FILE *cgi_out;
+int gDAEMON = 0;
 
 
 // Queries supported:
@@ -113,82 +133,181 @@ get_envvar(char *value) {
 
 static inline int file_select(const struct dirent *d)
 {
-  return (strncmp(d->d_name, "0Logfile.", 9) == 0);
+  return strncmp(d->d_name, "0Logfile.", 9) == 0 ||
+    strncmp(d->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) == 0;
 }
 
-static inline int
-sortbydatetime(const struct dirent **a, const struct dirent **b)
-{
-  int rval;
-  struct stat sbuf1, sbuf2;
-  char path1[PATH_MAX], path2[PATH_MAX];
+static inline const char *dataset_name(const char *file) {
+  return file + (strncmp(file, "0Logfile.", 9) == 0 ? 9 : strlen(SEGMENT_PREFIX));
+}
 
-  snprintf(path1, PATH_MAX, "%s/%s", DIR_NAME, (*a)->d_name);
-  snprintf(path2, PATH_MAX, "%s/%s", DIR_NAME, (*b)->d_name);
+// By dataset, and a dataset's text log before its segments.
+int dataset_compare(const struct dirent **a, const struct dirent **b) {
+  int c = strcmp(dataset_name((*a)->d_name), dataset_name((*b)->d_name));
+  return c ? c : strcmp((*a)->d_name, (*b)->d_name);
+}
 
-  rval = stat(path1, &sbuf1);
-  if (rval) {
-    perror("stat");
-    return 0;
+int catalog_name_compare(const void *a, const void *b) {
+  return strcmp(((const struct catalog_entry *) a)->name, ((const struct catalog_entry *) b)->name);
+}
+
+// The datasets to list: those that have a log or segments in the
+// directory, found in one pass over it. What we show about each comes
+// from the catalog the logger keeps (pirds_logger -C, see
+// pirds_store.h) if there is one, so that listing them, sorting them
+// and paging through them takes no system call per dataset. A catalog
+// entry whose files have been removed is left out, and a dataset the
+// catalog has no slot for (there is none, or it is full) gets a stat,
+// and then we know only its size and when it was last written.
+struct catalog_entry *catalog_load(int *count) {
+  char path[PATH_MAX];
+  struct catalog_entry *cat = NULL;
+  uint32_t ncat = 0;
+  snprintf(path, PATH_MAX, "%s/%s", DIR_NAME, CATALOG_NAME);
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    struct catalog_header h;
+    struct stat sbuf;
+    if (read(fd, &h, sizeof h) == sizeof h && catalog_header_ok(&h) &&
+        fstat(fd, &sbuf) == 0 && (size_t) sbuf.st_size >= CATALOG_SIZE(h.count) &&
+        (cat = malloc((h.count + 1) * sizeof *cat)) &&
+        pread(fd, cat, h.count * sizeof *cat, sizeof h) == (ssize_t) (h.count * sizeof *cat)) {
+      ncat = h.count;
+      for (uint32_t i = 0; i < ncat; i++)
+        cat[i].name[PART_NAME_MAX - 1] = '\0';
+      qsort(cat, ncat, sizeof *cat, catalog_name_compare);
+    }
+    close(fd);
   }
-  rval = stat(path2, &sbuf2);
-  if (rval) {
-    perror("stat");
-    return 0;
+
+  struct dirent **pdirent;
+  int n = scandir(DIR_NAME, &pdirent, file_select, dataset_compare);
+  if (n == -1) {
+    perror("scandir");
+    free(cat);
+    return NULL;
+  }
+  struct catalog_entry *e = calloc(n + 1, sizeof *e);
+  int k = 0;
+  for (int i = 0; e && i < n; i++) {
+    const char *name = pdirent[i]->d_name;
+    if (i > 0 && strcmp(dataset_name(name), dataset_name(pdirent[i - 1]->d_name)) == 0)
+      continue;              // its segments, listed under its text log
+    snprintf(e[k].name, PART_NAME_MAX, "%s", dataset_name(name));
+    struct catalog_entry *c = ncat ? bsearch(&e[k], cat, ncat, sizeof *cat, catalog_name_compare) : NULL;
+    struct stat sbuf;
+    snprintf(path, PATH_MAX, "%s/%s", DIR_NAME, name);
+    if (c) {
+      e[k++] = *c;
+    } else if (stat(path, &sbuf) == 0) {
+      e[k].last_write = sbuf.st_mtime;
+      e[k].bytes = sbuf.st_size;
+      k++;
+    }
   }
+  for (int i = 0; i < n; i++)
+    free(pdirent[i]);
+  free(pdirent);
+  free(cat);
+  *count = k;
+  return e;
+}
 
-  return sbuf1.st_mtime > sbuf2.st_mtime;
+// How the list is sorted: by one of these, newest (or largest) first,
+// or by name in alphabetical order, unless order= says otherwise.
+enum { SORT_TIME, SORT_NAME, SORT_FIRST, SORT_RECORDS, SORT_BYTES };
+
+int catalog_compare(const struct catalog_entry *a, const struct catalog_entry *b, int key) {
+  int64_t x, y;
+  switch (key) {
+  case SORT_NAME: return strcmp(a->name, b->name);
+  case SORT_FIRST: x = a->first_arrival; y = b->first_arrival; break;
+  case SORT_RECORDS: x = a->records; y = b->records; break;
+  case SORT_BYTES: x = a->bytes; y = b->bytes; break;
+  default: x = a->last_write; y = b->last_write; break;
+  }
+  return x < y ? -1 : x > y;
 }
 
-void list_datasets_by_time() {
-  char path[PATH_MAX];
+__thread int catalog_sort_key, catalog_sort_sign;
 
-  DIR *pdir;
-  struct stat sbuf;
-  struct dirent **pdirent;
+int catalog_sort(const void *a, const void *b) {
+  int c = catalog_compare(a, b, catalog_sort_key);
+  if (c == 0 && catalog_sort_key != SORT_NAME)
+    c = -catalog_compare(a, b, SORT_NAME);
+  return catalog_sort_sign * c;
+}
 
+void render_time(char *buf, size_t size, time_t t) {
   struct tm lt;
-  char strdate[16];
-  char strtime[16];
+  localtime_r(&t, &lt);
+  strftime(buf, size, "%F %H:%M:%S", &lt);
+}
 
-  int nfile = 0;
+// The list of datasets: ?sort=time|name|first|records|bytes,
+// &order=asc|desc, &page=N (from 1) and &per=N datasets a page.
+#define LIST_PER_PAGE 100
 
-  pdir = opendir(DIR_NAME);
-  if (!pdir) {
-    perror("opendir");
-    return;
+void list_datasets_by_time() {
+  static const char *keys[] = { "time", "name", "first", "records", "bytes" };
+  int key = SORT_TIME, desc = -1, page = 1, per = LIST_PER_PAGE;
+  char *qs = get_envvar("QUERY_STRING");
+  char *query = strdup(qs ? qs : "");
+  char *tokens = query, *p, *qsave;
+  while ((p = strsep(&tokens, "&\n"))) {
+    char *var = strtok_r(p, "=", &qsave), *val;
+    if (!var || !(val = strtok_r(NULL, "=", &qsave)))
+      continue;
+    if (!strcmp(var, "sort")) {
+      for (int k = 0; k < (int) (sizeof keys / sizeof keys[0]); k++)
+        if (!strcmp(val, keys[k]))
+          key = k;
+    } else if (!strcmp(var, "order"))
+      desc = strcmp(val, "desc") == 0;
+    else if (!strcmp(var, "page"))
+      page = atoi(val);
+    else if (!strcmp(var, "per"))
+      per = atoi(val);
   }
-
-  int n = scandir(DIR_NAME, &pdirent, file_select, sortbydatetime);
-  if (n == -1) {
-    perror("scandir");
+  free(query);
+  if (desc == -1)
+    desc = key != SORT_NAME;
+  if (page < 1)
+    page = 1;
+  if (per < 1)
+    per = LIST_PER_PAGE;
+
+  int n = 0;
+  struct catalog_entry *e = catalog_load(&n);
+  if (!e)
     return;
+  catalog_sort_key = key;
+  catalog_sort_sign = desc ? -1 : 1;
+  qsort(e, n, sizeof *e, catalog_sort);
+
+  char first[32], last[32];
+  int from = (page - 1) * per;
+  for (int i = from; i < n && i < from + per; i++) {
+    fprintf(cgi_out, "%s --  <a href=/rds/%s/json>json?n=200</a> / <a href=breath_plot?i=%s>Breath Plot</a>",
+            e[i].name, e[i].name, e[i].name);
+    if (e[i].records) {
+      render_time(first, sizeof first, e[i].first_arrival);
+      render_time(last, sizeof last, e[i].last_arrival);
+      fprintf(cgi_out, " -- %lld records, %lld bytes, %s to %s",
+              (long long) e[i].records, (long long) e[i].bytes, first, last);
+    } else {
+      render_time(last, sizeof last, e[i].last_write);
+      fprintf(cgi_out, " -- %lld bytes, last written %s", (long long) e[i].bytes, last);
+    }
+    fprintf(cgi_out, "<br>");
   }
-  while (n--) {
-    if (!((strcmp(pdirent[n]->d_name, ".") == 0) ||
-          (strcmp(pdirent[n]->d_name, "..") == 0)))
-      {
-        snprintf(path, PATH_MAX, "%s/%s", DIR_NAME, pdirent[n]->d_name);
-        int rval = stat(path, &sbuf);
-        if (rval) {
-          perror("stat");
-          return;
-        }
-        localtime_r(&sbuf.st_mtime, &lt);
-        memset(strtime, 0, sizeof(strtime));
-        strftime(strtime, sizeof(strtime), "%H:%M:%S", &lt);
-        memset(strdate, 0, sizeof(strdate));
-        strftime(strdate, sizeof(strdate), "%F", &lt);
-        /* fprintf(stderr,"scriptname = |%s|\n",scriptname); */
-        /* fprintf(stderr,"pdirent[n] = |%s|\n",pdirent[n]->d_name+9); */
-        /* fprintf(stderr,"%s --  <a href=%s/rds/%s/json>json</a> / <a href=%s/breath_plot?i=%s>Breath Plot</a><br>", */
-        /*        pdirent[n]->d_name+9,  scriptname, pdirent[n]->d_name+9, scriptname, pdirent[n]->d_name+9); */
-        printf("%s --  <a href=/rds/%s/json>json?n=200</a> / <a href=breath_plot?i=%s>Breath Plot</a><br>",
-               pdirent[n]->d_name+9,  pdirent[n]->d_name+9, pdirent[n]->d_name+9);
-      }
-    free(pdirent[n]);
-  }
-  free(pdirent);
+  if (page > 1)
+    fprintf(cgi_out, "<a href=?sort=%s&order=%s&page=%d&per=%d>previous</a> ",
+            keys[key], desc ? "desc" : "asc", page - 1, per);
+  if (from + per < n)
+    fprintf(cgi_out, "<a href=?sort=%s&order=%s&page=%d&per=%d>next</a>",
+            keys[key], desc ? "desc" : "asc", page + 1, per);
+  free(e);
 }
 
 void
@@ -196,51 +315,458 @@ list_datasets() {
 
   DIR *dir = opendir(DIR_NAME);
   if (!dir) {
-    printf("Content-type: text/plain\n");
-    printf("Access-Control-Allow-Origin: *\n");
-    printf("\n");
-    printf("Can't open directory");
+    fprintf(cgi_out, "Content-type: text/plain\n");
+    fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+    fprintf(cgi_out, "\n");
+    fprintf(cgi_out, "Can't open directory");
     return;
   }
 
   struct dirent *d = NULL;
   uint8_t found = 0;
-  printf("Content-type: text/html\n");
-  printf("Access-Control-Allow-Origin: *\n");
-  printf("\n");
+  fprintf(cgi_out, "Content-type: text/html\n");
+  fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+  fprintf(cgi_out, "\n");
   closedir(dir);
 
   list_datasets_by_time();
 }
 
-void find_back_lines(FILE *fp, int count) {
-  int lc = count + 1;
-  unsigned long pos = 0;
+// Position fp at the start of the last count lines. The file is read
+// backwards in large blocks and the newlines counted with memrchr, so
+// this costs about as much as the lines we are going to send.
+#define TAIL_BLOCK (64*1024)
+
+// Position fp count lines before its end; returns how many lines that
+// is, which is fewer than count if the file does not have that many.
+int find_back_lines(FILE *fp, int count) {
+  static __thread char block[TAIL_BLOCK];
+  int lc = count + 1;        // the last line's own newline counts too
+  int fd = fileno(fp);
+  struct stat sbuf;
 
-  while (lc) {
-    if (fseek(fp, -pos, SEEK_END) == -1) {
-      rewind(fp);
+  if (fstat(fd, &sbuf) != 0) {
+    rewind(fp);
+    return 0;
+  }
+  off_t off = sbuf.st_size;
+  while (off > 0) {
+    size_t n = off < TAIL_BLOCK ? off : TAIL_BLOCK;
+    off -= n;
+    if (pread(fd, block, n, off) != (ssize_t) n)
       break;
+    char *end = block + n;
+    char *nl;
+    while ((nl = memrchr(block, '\n', end - block))) {
+      if (--lc == 0) {
+        fseeko(fp, off + (nl - block) + 1, SEEK_SET);
+        return count;
+      }
+      end = nl;
     }
-    if (fgetc(fp) == '\n')
-      lc--;
-    pos++;
   }
+  rewind(fp);
+  return count + 1 - lc;
+}
 
-  return;
+void *map_file(const char *fname, size_t *size);
+
+// Index the log in fp (see pirds_store.h) for a log that has no index
+// yet, and install the index as idxname for the next request and for
+// the logger to continue. Returns the entries, to be freed.
+struct log_index_entry *build_log_index(FILE *fp, const char *idxname, size_t *count) {
+  size_t n = 0, cap = 1024;
+  struct log_index_entry *idx = malloc(cap * sizeof *idx);
+  int64_t last = 0;
+  off_t pos = 0;
+  char *line = NULL;
+  size_t c = 0;
+  ssize_t len;
+  fseek(fp, 0, SEEK_SET);
+  while (idx && (len = getline(&line, &c, fp)) > 0) {
+    int64_t sec = strtoll(line, NULL, 10);
+    if (sec > last) {
+      if (n == cap) {
+        cap *= 2;
+        struct log_index_entry *p = realloc(idx, cap * sizeof *idx);
+        if (!p)
+          break;
+        idx = p;
+      }
+      idx[n].epoch_s = sec;
+      idx[n].offset = pos;
+      n++;
+      last = sec;
+    }
+    pos += len;
+  }
+  free(line);
+  *count = idx ? n : 0;
+
+  // Written under a temporary name and linked into place, so that no
+  // one ever sees half an index, and an index the logger has started
+  // meanwhile is not replaced.
+  char *tmp = NULL;
+  asprintf(&tmp, "%s.XXXXXX", idxname);
+  int fd = tmp ? mkstemp(tmp) : -1;
+  if (fd >= 0) {
+    fchmod(fd, 0644);
+    if (write(fd, idx, n * sizeof *idx) == (ssize_t)(n * sizeof *idx))
+      link(tmp, idxname);
+    close(fd);
+    unlink(tmp);
+  }
+  free(tmp);
+  return idx;
 }
 
-void find_line_from_time(FILE *fp, time_t epoch_time_start) {
-  fseek(fp,0,SEEK_SET);
+// Position fp at the first line logged after epoch_time_start, using
+// the log's time index, idxname, to skip to the right second.
+void find_line_from_time(FILE *fp, const char *idxname, time_t epoch_time_start) {
+  size_t idx_size = 0, n = 0;
+  struct log_index_entry *built = NULL;
+  const struct log_index_entry *idx = map_file(idxname, &idx_size);
+  if (idx)
+    n = idx_size / sizeof *idx;
+  else
+    idx = built = build_log_index(fp, idxname, &n);
+
+  struct stat sbuf;
+  off_t log_size = fstat(fileno(fp), &sbuf) == 0 ? sbuf.st_size : 0;
+
+  // The first entry after the time we want...
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx[mid].epoch_s > epoch_time_start)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  // ...and we start from the one before it, if it points at the start
+  // of a line we have (the logger writes the index slightly ahead).
+  off_t start = 0;
+  for (size_t k = lo; k > 0; k--) {
+    off_t off = idx[k-1].offset;
+    char prev;
+    if (off == 0 ||
+        (off < log_size && pread(fileno(fp), &prev, 1, off - 1) == 1 && prev == '\n')) {
+      start = off;
+      break;
+    }
+  }
+  if (built)
+    free(built);
+  else if (idx)
+    munmap((void *) idx, idx_size);
+
+  fseeko(fp, start, SEEK_SET);
   char *line = NULL;
   size_t c = 0;
-  while (getline(&line, &c, fp) > 0) {
-      char *v = strtok(line, ":"); // skip timestamp
-      // We can rely on this as a time stamp
-      long epoch = atoi(v);
-      if (epoch > epoch_time_start)
-        return;
+  off_t pos = start;
+  ssize_t len;
+  while ((len = getline(&line, &c, fp)) > 0) {
+    // We can rely on this as a time stamp
+    long epoch = strtol(line, NULL, 10);
+    if (epoch > epoch_time_start) {
+      fseeko(fp, pos, SEEK_SET);
+      break;
+    }
+    pos += len;
   }
+  free(line);
+}
+
+// A binary segment (see pirds_store.h) and its heap, mapped read only.
+struct segment_map {
+  void *base;
+  size_t size;
+  const struct segment_record *recs;
+  size_t count;
+  void *heap;
+  size_t heap_size;
+};
+
+void *map_file(const char *fname, size_t *size) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat sbuf;
+  void *p = NULL;
+  if (fstat(fd, &sbuf) == 0 && sbuf.st_size > 0) {
+    p = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      p = NULL;
+    else
+      *size = sbuf.st_size;
+  }
+  close(fd);
+  return p;
+}
+
+// Map a segment and its heap; returns 0 if there is none (or it is not
+// one we can read).
+int segment_open_files(const char *segname, const char *heapname, struct segment_map *m) {
+  memset(m, 0, sizeof *m);
+  m->base = map_file(segname, &m->size);
+  if (!m->base)
+    return 0;
+  if (m->size < SEGMENT_HEADER_SIZE || !segment_header_ok(m->base)) {
+    munmap(m->base, m->size);
+    return 0;
+  }
+  m->recs = (const struct segment_record *)((char *) m->base + SEGMENT_HEADER_SIZE);
+  // A record still being written at the end is ignored.
+  m->count = (m->size - SEGMENT_HEADER_SIZE) / sizeof(struct segment_record);
+  m->heap = map_file(heapname, &m->heap_size);
+  return 1;
+}
+
+int segment_open(char *ipaddr, struct segment_map *m) {
+  char *segname = NULL, *heapname = NULL;
+  asprintf(&segname, "%s/%s%s", DIR_NAME, SEGMENT_PREFIX, ipaddr);
+  asprintf(&heapname, "%s/%s%s", DIR_NAME, HEAP_PREFIX, ipaddr);
+  int ok = segment_open_files(segname, heapname, m);
+  free(segname);
+  free(heapname);
+  return ok;
+}
+
+void segment_close(struct segment_map *m) {
+  if (m->heap)
+    munmap(m->heap, m->heap_size);
+  if (m->base)
+    munmap(m->base, m->size);
+}
+
+// Like find_line_from_time: the index of the first record that arrived
+// after epoch_time_start.
+size_t segment_find_time(struct segment_map *m, time_t epoch_time_start) {
+  size_t lo = 0, hi = m->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (m->recs[mid].arrival > epoch_time_start)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+char *urlDecode(const char *str);
+
+// A time in a query: seconds since the epoch, or e.g.
+// t=Mon, 14 Sep 2020 12:00:00 (UTC, URL encoded).
+time_t parse_query_time(const char *val) {
+  char *end;
+  long long secs = strtoll(val, &end, 10);
+  if (end != val && *end == '\0')
+    return secs;
+  struct tm tm = {0};
+  char *decode = urlDecode(val);
+  strptime(decode, "%a, %d %b %Y %H:%M:%S", &tm);
+  free(decode);
+  return timegm(&tm);
+}
+
+// A dataset whose log the logger has rolled (-l / -L) is the parts in
+// its manifest followed by its current files (see pirds_store.h). The
+// chains below read such a dataset as one log, opening a part only
+// when a query reaches into it.
+char *part_file(const char *prefix, const struct log_part *part) {
+  char *fname = NULL;
+  asprintf(&fname, "%s/%s/%s%s", DIR_NAME, PARTS_DIR, prefix, part->name);
+  return fname;
+}
+
+int chain_parts(char *ipaddr, struct log_part **parts) {
+  char *fname = NULL;
+  asprintf(&fname, "%s/%s%s", DIR_NAME, MANIFEST_PREFIX, ipaddr);
+  int n = manifest_read(fname, parts);
+  free(fname);
+  return n;
+}
+
+// The first part with something logged after t; nparts if none.
+int chain_part_after(const struct log_part *parts, int nparts, time_t t) {
+  int k = 0;
+  while (k < nparts && parts[k].last <= t)
+    k++;
+  return k;
+}
+
+// The text logs of a dataset, read one after the other.
+struct text_chain {
+  struct log_part *parts;
+  int nparts;
+  int cur;                   // the part being read; nparts for the current log
+  FILE *fp;                  // its stream, or NULL if it cannot be read
+  FILE *log;                 // the current log
+};
+
+void text_chain_open(struct text_chain *tc, char *ipaddr, FILE *log) {
+  tc->nparts = chain_parts(ipaddr, &tc->parts);
+  tc->cur = tc->nparts;
+  tc->fp = tc->log = log;
+}
+
+// Start reading at part k (already positioned as fp).
+void text_chain_start(struct text_chain *tc, int k, FILE *fp) {
+  if (tc->fp && tc->fp != tc->log)
+    fclose(tc->fp);
+  tc->cur = k;
+  tc->fp = fp;
+}
+
+FILE *text_chain_part(struct text_chain *tc, int k) {
+  char *fname = part_file("0Logfile.", &tc->parts[k]);
+  FILE *fp = fopen(fname, "r");
+  free(fname);
+  return fp;
+}
+
+ssize_t text_chain_getline(struct text_chain *tc, char **line, size_t *c) {
+  ssize_t len;
+  for (;;) {
+    if (tc->fp && (len = getline(line, c, tc->fp)) > 0)
+      return len;
+    if (tc->cur >= tc->nparts)
+      return -1;
+    // On to the next part, or the current log from its start.
+    FILE *next = NULL;
+    if (++tc->cur < tc->nparts)
+      next = text_chain_part(tc, tc->cur);
+    else if ((next = tc->log))
+      fseeko(next, 0, SEEK_SET);
+    text_chain_start(tc, tc->cur, next);
+  }
+}
+
+// Position the chain at the first line logged after t.
+void text_chain_seek_time(struct text_chain *tc, char *ipaddr, time_t t) {
+  int k = chain_part_after(tc->parts, tc->nparts, t);
+  char *idxname = NULL;
+  if (k < tc->nparts) {
+    FILE *fp = text_chain_part(tc, k);
+    idxname = part_file(INDEX_PREFIX, &tc->parts[k]);
+    if (fp)
+      find_line_from_time(fp, idxname, t);
+    text_chain_start(tc, k, fp);
+  } else {
+    asprintf(&idxname, "%s/%s%s", DIR_NAME, INDEX_PREFIX, ipaddr);
+    find_line_from_time(tc->log, idxname, t);
+  }
+  free(idxname);
+}
+
+// Position the chain count lines before its end; found is how many
+// of them the current log has (if already positioned, as by the
+// dataset cache), or -1.
+void text_chain_seek_back(struct text_chain *tc, int count, int found) {
+  if (found < 0)
+    found = find_back_lines(tc->log, count);
+  for (int k = tc->nparts - 1; found < count && k >= 0; k--) {
+    FILE *fp = text_chain_part(tc, k);
+    if (!fp)
+      continue;
+    found += find_back_lines(fp, count - found);
+    text_chain_start(tc, k, fp);
+  }
+}
+
+void text_chain_close(struct text_chain *tc) {
+  if (tc->fp && tc->fp != tc->log)
+    fclose(tc->fp);
+  if (tc->log)
+    fclose(tc->log);
+  free(tc->parts);
+}
+
+// The binary segments of a dataset, as one array of records: record i
+// is in part p if base[p] <= i < base[p+1], and the current segment
+// is part nparts. Parts are mapped when a record in them is wanted.
+struct segment_chain {
+  struct log_part *parts;
+  int nparts;
+  struct segment_map *maps;
+  size_t *base;
+  size_t total;
+  int last;                  // the part of the previous lookup
+};
+
+int segment_chain_open(struct segment_chain *sc, char *ipaddr) {
+  struct segment_map cur;
+  if (!segment_open(ipaddr, &cur))
+    return 0;
+  sc->nparts = chain_parts(ipaddr, &sc->parts);
+  sc->maps = calloc(sc->nparts + 1, sizeof *sc->maps);
+  sc->base = calloc(sc->nparts + 2, sizeof *sc->base);
+  size_t total = 0;
+  for (int k = 0; k < sc->nparts; k++) {
+    sc->base[k] = total;
+    char *fname = part_file(SEGMENT_PREFIX, &sc->parts[k]);
+    struct stat sbuf;
+    if (stat(fname, &sbuf) == 0 && sbuf.st_size > (off_t) SEGMENT_HEADER_SIZE)
+      total += (sbuf.st_size - SEGMENT_HEADER_SIZE) / sizeof(struct segment_record);
+    free(fname);
+  }
+  sc->base[sc->nparts] = total;
+  sc->maps[sc->nparts] = cur;
+  sc->total = total + cur.count;
+  sc->base[sc->nparts + 1] = sc->total;
+  sc->last = sc->nparts;
+  return 1;
+}
+
+// Record i, with *m set to the map that holds it; NULL if its part
+// cannot be read.
+const struct segment_record *segment_chain_rec(struct segment_chain *sc, size_t i,
+                                               const struct segment_map **m) {
+  int p = sc->last;
+  if (i < sc->base[p] || i >= sc->base[p + 1]) {
+    int lo = 0, hi = sc->nparts;
+    while (lo < hi) {        // the last part starting at or before i
+      int mid = (lo + hi + 1) / 2;
+      if (sc->base[mid] <= i)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    // Skip over empty parts.
+    while (lo < sc->nparts && i >= sc->base[lo + 1])
+      lo++;
+    p = sc->last = lo;
+  }
+  struct segment_map *map = &sc->maps[p];
+  if (!map->base) {
+    char *segname = part_file(SEGMENT_PREFIX, &sc->parts[p]);
+    char *heapname = part_file(HEAP_PREFIX, &sc->parts[p]);
+    segment_open_files(segname, heapname, map);
+    free(segname);
+    free(heapname);
+  }
+  size_t k = i - sc->base[p];
+  if (!map->base || k >= map->count)
+    return NULL;
+  *m = map;
+  return &map->recs[k];
+}
+
+// Like segment_find_time, over the whole chain.
+size_t segment_chain_find_time(struct segment_chain *sc, time_t t) {
+  int k = chain_part_after(sc->parts, sc->nparts, t);
+  const struct segment_map *m;
+  if (k < sc->nparts && sc->base[k] < sc->base[k + 1])
+    segment_chain_rec(sc, sc->base[k], &m); // maps part k
+  return sc->base[k] + segment_find_time(&sc->maps[k], t);
+}
+
+void segment_chain_close(struct segment_chain *sc) {
+  for (int k = 0; k <= sc->nparts; k++)
+    segment_close(&sc->maps[k]);
+  free(sc->maps);
+  free(sc->base);
+  free(sc->parts);
 }
 
 // https://github.com/abejfehr/URLDecode/blob/master/urldecode.h
@@ -275,80 +801,1186 @@ char *urlDecode(const char *str) {
           /* convert it to decimal */
           long int x = strtol(eStr, NULL, 16);
 
-          /* remove the hex */
-          memmove(&dStr[i+1], &dStr[i+3], strlen(&dStr[i+3])+1);
+          /* remove the hex */
+          memmove(&dStr[i+1], &dStr[i+3], strlen(&dStr[i+3])+1);
+
+          dStr[i] = x;
+        }
+      }
+    }
+  }
+
+  return dStr;
+}
+
+// Write one line of the text log, as it is or as a JSON object. This
+// is the original renderer; render_line() below produces the same
+// bytes faster and falls back to this for lines it does not recognise.
+void render_line_legacy(char *line, int json, int *first) {
+  if (!json)
+    fprintf(cgi_out, "%s", line);
+  else {
+    char *ptr;
+    if ((ptr = strchr(line, '\r')) || (ptr = strchr(line, '\n')))
+      *ptr = '\0';
+    if (!*first)
+      fprintf(cgi_out, ",\n");
+    *first = 0;
+    //      fprintf(cgi_out, "{ \"event\": \"M\",");
+    char *save;
+    char *v = strtok_r(line, ":", &save); // skip timestamp
+    v = strtok_r(NULL, ":", &save);
+    // Note: This fundamentally should come form our main library to reduce duplication
+    // This part is for back-compatibility;
+    // it should be removed when we have a chance
+    if ((0 == strcmp(v,"P")) ||
+        (0 == strcmp(v,"D")) ||
+        (0 == strcmp(v,"F")) ||
+        (0 == strcmp(v,"H")) ||
+        (0 == strcmp(v,"G")) ||
+        (0 == strcmp(v,"T")) ||
+        (0 == strcmp(v,"A"))
+        ) {
+      fprintf(cgi_out, "{ \"event\": \"M\",");
+      //      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"type\": \"%s\",", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"loc\": \"%s\",", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"num\": %s,", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"ms\": %s,", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"val\": %s }", v);
+    } else if (0 == strcmp(v,"M")) {
+      fprintf(cgi_out, "{ \"event\": \"%s\",",v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"type\": \"%s\",", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"loc\": \"%s\",", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"num\": %s,", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"ms\": %s,", v);
+      v = strtok_r(NULL, ":", &save);
+      fprintf(cgi_out, " \"val\": %s }", v);
+    } else if (0 == strcmp(v,"E")) {
+      // The only currently supported other format is "M"
+      v = strtok_r(NULL, ":", &save);
+      if (0 == strcmp(v,"M")) {
+          fprintf(cgi_out, "{ \"event\": \"%s\",","E");
+          fprintf(cgi_out, " \"type\": \"M\",");
+          v = strtok_r(NULL, ":", &save);
+          fprintf(cgi_out, " \"ms\": %s,", v);
+          v = strtok_r(NULL, ":", &save);
+          // Note: This string is already double quoted...
+          // this is not good strong typing,
+          // it should be improved.
+          fprintf(cgi_out, " \"buff\": %s }", v);
+      } else if (0 == strcmp(v,"C")) {
+          fprintf(cgi_out, "{ \"event\": \"%s\",","E");
+          fprintf(cgi_out, " \"type\": \"C\",");
+          v = strtok_r(NULL, ":", &save);
+          fprintf(cgi_out, " \"ms\": %s,", v);
+          // Now get the rest of the string, as it is a complex date
+          v = strtok_r(NULL, "\0", &save);
+          fprintf(cgi_out, " \"buff\": %s }", v);
+      } else {
+        fprintf(cgi_out, "\"\"");
+      }
+    }
+  }
+}
+
+// Records are rendered straight into a large output buffer, which goes
+// to cgi_out in big writes; anything else written to cgi_out must call
+// out_flush() first.
+#define OUT_BUFFER_SIZE (64*1024)
+#define OUT_RECORD_MAX 1024  // room we make before rendering one record
+
+__thread char out_buf[OUT_BUFFER_SIZE];
+__thread size_t out_len = 0;
+
+void out_flush() {
+  if (out_len) {
+    fwrite(out_buf, 1, out_len, cgi_out);
+    out_len = 0;
+  }
+}
+
+static inline void out_reserve(size_t n) {
+  if (out_len + n > OUT_BUFFER_SIZE)
+    out_flush();
+}
+
+static inline void out_put(const char *p, size_t n) {
+  if (n > OUT_BUFFER_SIZE - out_len) {
+    out_flush();
+    if (n > OUT_BUFFER_SIZE) {
+      fwrite(p, 1, n, cgi_out);
+      return;
+    }
+  }
+  memcpy(out_buf + out_len, p, n);
+  out_len += n;
+}
+
+#define out_lit(s) out_put(s, sizeof(s) - 1)
+
+static inline void out_char(char c) {
+  out_reserve(1);
+  out_buf[out_len++] = c;
+}
+
+// Integers without printf; the caller has reserved room.
+static inline void out_u64(uint64_t v) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n)
+    out_buf[out_len++] = tmp[--n];
+}
+
+static inline void out_i64(int64_t v) {
+  if (v < 0) {
+    out_buf[out_len++] = '-';
+    out_u64(-(uint64_t) v);
+  } else
+    out_u64(v);
+}
+
+// The colon separated fields of a line, found in one pass. As with
+// strtok, empty fields are skipped; rest is what follows the field
+// separator after field n-1 (for the text of a clock event).
+#define LINE_FIELDS 7
+
+struct line_fields {
+  const char *f[LINE_FIELDS];
+  size_t len[LINE_FIELDS];
+  int n;
+  const char *rest;
+  const char *end;
+};
+
+static inline void split_line(const char *p, const char *end, struct line_fields *lf) {
+  lf->n = 0;
+  lf->rest = end;
+  lf->end = end;
+  while (p < end && lf->n < LINE_FIELDS) {
+    while (p < end && *p == ':')
+      p++;
+    if (p == end)
+      break;
+    const char *q = memchr(p, ':', end - p);
+    if (!q)
+      q = end;
+    lf->f[lf->n] = p;
+    lf->len[lf->n] = q - p;
+    lf->n++;
+    p = q < end ? q + 1 : end;
+    lf->rest = p;
+  }
+}
+
+#define FIELD(lf, i) (lf).f[i], (lf).len[i]
+
+static inline bool field_is(struct line_fields *lf, int i, char c) {
+  return lf->len[i] == 1 && lf->f[i][0] == c;
+}
+
+void render_measurement_fields(struct line_fields *lf, int type) {
+  out_lit(" \"type\": \"");
+  out_put(FIELD(*lf, type));
+  out_lit("\", \"loc\": \"");
+  out_put(FIELD(*lf, type + 1));
+  out_lit("\", \"num\": ");
+  out_put(FIELD(*lf, type + 2));
+  out_lit(", \"ms\": ");
+  out_put(FIELD(*lf, type + 3));
+  out_lit(", \"val\": ");
+  out_put(FIELD(*lf, type + 4));
+  out_lit(" }");
+}
+
+// The shapes of line we know: legacy measurements (P, D, F, H, G, T, A
+// in the second field), M measurements and L limits (both 'M'), and
+// E:M / E:C events; 0 for anything else.
+int line_shape(const char *line, const char *end, struct line_fields *lf) {
+  split_line(line, end, lf);
+  if (lf->n < 2 || lf->len[1] != 1)
+    return 0;
+  char c = lf->f[1][0];
+  if (strchr("PDFHGTA", c) && lf->n == 6 && lf->rest == end)
+    return 'L';
+  if ((c == 'M' || c == 'L') && lf->n == 7 && lf->rest == end)
+    return 'M';
+  if (c == 'E' && lf->n == 5 && field_is(lf, 2, 'M') && lf->rest == end)
+    return 'm';
+  if (c == 'E' && lf->n >= 4 && field_is(lf, 2, 'C') && lf->f[3] + lf->len[3] < end) {
+    lf->rest = lf->f[3] + lf->len[3] + 1;
+    return lf->rest == end ? 0 : 'C'; // no text: legacy prints (null)
+  }
+  return 0;
+}
+
+// What a query wants besides its window of time or lines: which
+// records (event=, type=, loc=, num=) and which of their fields
+// (fields=, for JSON).
+#define FIELD_EVENT 0x01
+#define FIELD_TYPE  0x02
+#define FIELD_LOC   0x04
+#define FIELD_NUM   0x08
+#define FIELD_MS    0x10
+#define FIELD_VAL   0x20
+#define FIELD_BUFF  0x40
+#define FIELDS_ALL  0x7f
+
+struct record_filter {
+  char event, type, loc;     // 0 for any
+  int num;                   // -1 for any
+  unsigned fields;           // FIELD_ bits
+};
+
+static inline bool filter_selects(const struct record_filter *f) {
+  return f && (f->event || f->type || f->loc || f->num >= 0);
+}
+
+// Does a record with these fields pass f? loc and num are 0 / -1 for
+// events, which have neither.
+static inline bool filter_match(const struct record_filter *f, char event, char type,
+                                char loc, int num) {
+  return (!f->event || f->event == event) && (!f->type || f->type == type) &&
+    (!f->loc || f->loc == loc) && (f->num < 0 || f->num == num);
+}
+
+// The same for a line of a known shape, looking only at the fields the
+// filter names.
+bool filter_match_line(const struct record_filter *f, struct line_fields *lf, int shape) {
+  if (!shape)
+    return false;
+  bool measurement = shape == 'L' || shape == 'M';
+  int t = shape == 'L' ? 1 : 2;
+  return filter_match(f, shape == 'M' ? lf->f[1][0] : measurement ? 'M' : 'E', lf->f[t][0],
+                      measurement && lf->len[t + 1] == 1 ? lf->f[t + 1][0] : 0,
+                      measurement && f->num >= 0 ? (int) strtoul(lf->f[t + 2], NULL, 10) : -1);
+}
+
+bool filter_line(const struct record_filter *f, const char *line, size_t len) {
+  if (!filter_selects(f))
+    return true;
+  const char *end = line + len;
+  while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+    end--;
+  struct line_fields lf;
+  return filter_match_line(f, &lf, line_shape(line, end, &lf));
+}
+
+bool filter_record(const struct record_filter *f, const struct segment_record *r) {
+  if (!filter_selects(f))
+    return true;
+  return segment_record_is_measurement(r) ? filter_match(f, r->event, r->type, r->loc, r->num) :
+    filter_match(f, r->event, r->type, 0, -1);
+}
+
+static inline void out_key(bool *more, const char *key, size_t len) {
+  if (*more)
+    out_lit(", ");
+  else
+    out_char(' ');
+  *more = true;
+  out_put(key, len);
+}
+
+#define out_field(more, key) out_key(more, key, sizeof(key) - 1)
+
+// A record of a known shape with only the fields in mask; the caller
+// has reserved room.
+void render_projected(struct line_fields *lf, int shape, const char *end, unsigned mask) {
+  bool more = false;
+  bool measurement = shape == 'L' || shape == 'M';
+  int t = shape == 'L' ? 1 : 2;
+  out_char('{');
+  if (mask & FIELD_EVENT) {
+    out_field(&more, "\"event\": \"");
+    out_char(shape == 'M' ? lf->f[1][0] : measurement ? 'M' : 'E');
+    out_char('"');
+  }
+  if (mask & FIELD_TYPE) {
+    out_field(&more, "\"type\": \"");
+    out_put(FIELD(*lf, t));
+    out_char('"');
+  }
+  if (measurement) {
+    if (mask & FIELD_LOC) {
+      out_field(&more, "\"loc\": \"");
+      out_put(FIELD(*lf, t + 1));
+      out_char('"');
+    }
+    if (mask & FIELD_NUM) {
+      out_field(&more, "\"num\": ");
+      out_put(FIELD(*lf, t + 2));
+    }
+    if (mask & FIELD_MS) {
+      out_field(&more, "\"ms\": ");
+      out_put(FIELD(*lf, t + 3));
+    }
+    if (mask & FIELD_VAL) {
+      out_field(&more, "\"val\": ");
+      out_put(FIELD(*lf, t + 4));
+    }
+  } else {
+    if (mask & FIELD_MS) {
+      out_field(&more, "\"ms\": ");
+      out_put(FIELD(*lf, 3));
+    }
+    if (mask & FIELD_BUFF) {
+      out_field(&more, "\"buff\": ");
+      if (shape == 'C')
+        out_put(lf->rest, end - lf->rest);
+      else
+        out_put(FIELD(*lf, 4));
+    }
+  }
+  out_lit(" }");
+}
+
+// Render one line of the text log like render_line_legacy(), if it
+// passes f (NULL for every line), with the fields f asks for. Only
+// lines of a known shape pass a filter that selects anything.
+void render_line_filtered(char *line, int json, int *first, const struct record_filter *f) {
+  size_t len = strlen(line);
+  bool selects = filter_selects(f);
+  if (!json && !selects) {
+    out_put(line, len);
+    return;
+  }
+  const char *end = memchr(line, '\r', len);
+  if (!end)
+    end = memchr(line, '\n', len);
+  if (!end)
+    end = line + len;
+
+  struct line_fields lf;
+  int shape = line_shape(line, end, &lf);
+  if (selects && !filter_match_line(f, &lf, shape))
+    return;
+  if (!json) {
+    out_put(line, len);
+    return;
+  }
+  if (!shape) {
+    out_flush();
+    render_line_legacy(line, json, first);
+    return;
+  }
+
+  out_reserve(OUT_RECORD_MAX);
+  if (!*first)
+    out_lit(",\n");
+  *first = 0;
+  if (f && f->fields != FIELDS_ALL) {
+    render_projected(&lf, shape, end, f->fields);
+    return;
+  }
+  switch (shape) {
+  case 'L':
+    out_lit("{ \"event\": \"M\",");
+    render_measurement_fields(&lf, 1);
+    break;
+  case 'M':
+    out_lit("{ \"event\": \"");
+    out_put(FIELD(lf, 1));
+    out_lit("\",");
+    render_measurement_fields(&lf, 2);
+    break;
+  case 'm':
+    out_lit("{ \"event\": \"E\", \"type\": \"M\", \"ms\": ");
+    out_put(FIELD(lf, 3));
+    out_lit(", \"buff\": ");
+    out_put(FIELD(lf, 4));
+    out_lit(" }");
+    break;
+  case 'C':
+    out_lit("{ \"event\": \"E\", \"type\": \"C\", \"ms\": ");
+    out_put(FIELD(lf, 3));
+    out_lit(", \"buff\": ");
+    out_put(lf.rest, end - lf.rest);
+    out_lit(" }");
+    break;
+  }
+}
+
+// Render a segment record like the line it stands for, if it passes f
+// (checked on the record's own fields); measurements are formatted
+// directly, anything else through its text form.
+void render_record_filtered(const struct segment_record *r, const uint8_t *heap, uint64_t heap_size,
+                            int json, int *first, const struct record_filter *f) {
+  char t = r->type, l = r->loc;
+  if (!filter_record(f, r))
+    return;
+  char e = r->event;
+  if (!segment_record_is_measurement(r) || (e != 'M' && e != 'L') ||
+      t == ':' || t == '\0' || t == '\r' || t == '\n' ||
+      l == ':' || l == '\0' || l == '\r' || l == '\n' || (json && f && f->fields != FIELDS_ALL)) {
+    char line[512];
+    segment_record_to_line(r, heap, heap_size, line, sizeof line);
+    render_line_filtered(line, json, first, f);
+    return;
+  }
+  out_reserve(OUT_RECORD_MAX);
+  if (!json) {
+    out_i64(r->arrival);
+    out_buf[out_len++] = ':';
+    out_buf[out_len++] = e;
+    out_buf[out_len++] = ':';
+    out_buf[out_len++] = t;
+    out_buf[out_len++] = ':';
+    out_buf[out_len++] = l;
+    out_buf[out_len++] = ':';
+    out_u64(r->num);
+    out_buf[out_len++] = ':';
+    out_i64(r->epoch_ms);
+    out_buf[out_len++] = ':';
+    out_i64(r->val);
+    out_buf[out_len++] = '\n';
+    return;
+  }
+  if (!*first)
+    out_lit(",\n");
+  *first = 0;
+  out_lit("{ \"event\": \"");
+  out_buf[out_len++] = e;
+  out_lit("\", \"type\": \"");
+  out_buf[out_len++] = t;
+  out_lit("\", \"loc\": \"");
+  out_buf[out_len++] = l;
+  out_lit("\", \"num\": ");
+  out_u64(r->num);
+  out_lit(", \"ms\": ");
+  out_i64(r->epoch_ms);
+  out_lit(", \"val\": ");
+  out_i64(r->val);
+  out_lit(" }");
+}
+
+void render_line(char *line, int json, int *first) {
+  render_line_filtered(line, json, first, NULL);
+}
+
+void render_record(const struct segment_record *r, const uint8_t *heap, uint64_t heap_size,
+                   int json, int *first) {
+  render_record_filtered(r, heap, heap_size, json, first, NULL);
+}
+
+// In daemon mode we keep every dataset we have served open, together
+// with the offsets of its last TAIL_WARM newlines, so that an ?n=
+// request only has to look at what was appended since the previous
+// one. A dataset whose file has been replaced (SAVE_LOG_TO_FILE) is
+// reopened.
+#define TAIL_WARM 8192
+#define DATASETS_MAX 256
+
+struct dataset {
+  char name[64];
+  int fd;
+  ino_t ino;
+  off_t scanned;             // nl[] has every newline before this offset...
+  bool complete;             // ...and, if set, every newline in the file
+  off_t *nl;                 // ring of newline offsets, oldest first
+  int nl_count;
+  int nl_head;               // where the next one goes
+  pthread_mutex_t lock;
+};
+
+struct dataset datasets[DATASETS_MAX];
+int ndatasets = 0;
+pthread_mutex_t datasets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dataset_reset(struct dataset *d) {
+  d->scanned = 0;
+  d->complete = false;
+  d->nl_count = 0;
+  d->nl_head = 0;
+}
+
+void dataset_push_nl(struct dataset *d, off_t off) {
+  d->nl[d->nl_head] = off;
+  d->nl_head = (d->nl_head + 1) % TAIL_WARM;
+  if (d->nl_count < TAIL_WARM)
+    d->nl_count++;
+  else
+    d->complete = false;
+}
+
+// The open dataset for ipaddr, or NULL if there is no such log (or no
+// room to keep it).
+struct dataset *dataset_get(char *ipaddr) {
+  char *fname = NULL;
+  struct stat sbuf;
+  struct dataset *d = NULL;
+
+  if (strlen(ipaddr) >= sizeof d->name)
+    return NULL;
+  asprintf(&fname, "%s/0Logfile.%s", DIR_NAME, ipaddr);
+  if (!fname || stat(fname, &sbuf) != 0) {
+    free(fname);
+    return NULL;
+  }
+  pthread_mutex_lock(&datasets_lock);
+  for (int i = 0; i < ndatasets; i++)
+    if (strcmp(datasets[i].name, ipaddr) == 0)
+      d = &datasets[i];
+  if (!d && ndatasets < DATASETS_MAX) {
+    off_t *nl = malloc(TAIL_WARM * sizeof(off_t));
+    if (nl) {
+      d = &datasets[ndatasets++];
+      strcpy(d->name, ipaddr);
+      d->fd = -1;
+      d->nl = nl;
+      pthread_mutex_init(&d->lock, NULL);
+    }
+  }
+  pthread_mutex_unlock(&datasets_lock);
+
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+    if (d->fd < 0 || d->ino != sbuf.st_ino) {
+      int fd = open(fname, O_RDONLY);
+      if (fd >= 0) {
+        if (d->fd >= 0)
+          close(d->fd);
+        d->fd = fd;
+        d->ino = sbuf.st_ino;
+        dataset_reset(d);
+      }
+    }
+    bool have_fd = d->fd >= 0;
+    pthread_mutex_unlock(&d->lock);
+    if (!have_fd)
+      d = NULL;
+  }
+  free(fname);
+  return d;
+}
+
+// A stream of our own on the dataset's file, positioned at the start.
+// It is opened afresh through /proc rather than dup()ed, so that it has
+// its own file offset: a dup() would share ours with every other
+// request reading the same dataset. Going through our descriptor keeps
+// it on the file nl[] describes even if the log has been saved away.
+FILE *dataset_fdopen(struct dataset *d) {
+  char path[64];
+  pthread_mutex_lock(&d->lock);
+  snprintf(path, sizeof path, "/proc/self/fd/%d", d->fd);
+  int fd = open(path, O_RDONLY);
+  pthread_mutex_unlock(&d->lock);
+  if (fd < 0)
+    return NULL;
+  FILE *fp = fdopen(fd, "r");
+  if (!fp)
+    close(fd);
+  return fp;
+}
+
+// Bring nl[] up to date with the file, which is size bytes long now.
+void dataset_scan(struct dataset *d, off_t size) {
+  static __thread char block[TAIL_BLOCK];
+
+  if (size < d->scanned)
+    dataset_reset(d);        // truncated
+  if (d->scanned == 0) {
+    // First look: take the last TAIL_WARM newlines, reading backwards.
+    off_t found[TAIL_WARM];
+    int n = 0;
+    off_t off = size;
+    while (off > 0 && n < TAIL_WARM) {
+      size_t len = off < TAIL_BLOCK ? off : TAIL_BLOCK;
+      off -= len;
+      if (pread(d->fd, block, len, off) != (ssize_t) len)
+        return;
+      char *end = block + len;
+      char *nl;
+      while (n < TAIL_WARM && (nl = memrchr(block, '\n', end - block))) {
+        found[n++] = off + (nl - block);
+        end = nl;
+      }
+    }
+    while (n > 0)
+      dataset_push_nl(d, found[--n]);
+    d->complete = off == 0 && d->nl_count < TAIL_WARM;
+    d->scanned = size;
+    return;
+  }
+  while (d->scanned < size) {
+    size_t len = size - d->scanned < TAIL_BLOCK ? size - d->scanned : TAIL_BLOCK;
+    if (pread(d->fd, block, len, d->scanned) != (ssize_t) len)
+      return;
+    char *p = block, *end = block + len, *nl;
+    while ((nl = memchr(p, '\n', end - p))) {
+      dataset_push_nl(d, d->scanned + (nl - block));
+      p = nl + 1;
+    }
+    d->scanned += len;
+  }
+}
+
+// find_back_lines() from the warm newline offsets; returns false if
+// count goes back further than we have kept.
+bool dataset_seek_back_lines(struct dataset *d, FILE *fp, int count, int *found) {
+  struct stat sbuf;
+  bool ok = false;
+  off_t pos = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (fstat(d->fd, &sbuf) == 0) {
+    dataset_scan(d, sbuf.st_size);
+    if (count + 1 <= d->nl_count) {
+      pos = d->nl[(d->nl_head - (count + 1) + TAIL_WARM) % TAIL_WARM] + 1;
+      *found = count;
+      ok = true;
+    } else if (d->complete) {
+      pos = 0;
+      *found = d->nl_count;
+      ok = true;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  if (ok)
+    fseeko(fp, pos, SEEK_SET);
+  return ok;
+}
+
+// A measurement line of the text log, in either form, taken apart.
+struct sample {
+  int64_t arrival;
+  int64_t ms;
+  int32_t val;
+  char type;
+  char loc;
+  unsigned num;
+};
+
+bool parse_measurement(const char *line, size_t len, struct sample *m) {
+  const char *end = line + len;
+  while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+    end--;
+  struct line_fields lf;
+  split_line(line, end, &lf);
+  int type = 0;
+  if (lf.n == 6 && lf.len[1] == 1 && strchr("PDFHGTA", lf.f[1][0]))
+    type = 1;
+  else if (lf.n == 7 && field_is(&lf, 1, 'M'))
+    type = 2;
+  if (!type || lf.rest != end || lf.len[type] != 1 || lf.len[type + 1] != 1)
+    return false;
+  m->arrival = strtoll(line, NULL, 10);
+  m->type = lf.f[type][0];
+  m->loc = lf.f[type + 1][0];
+  m->num = strtoul(lf.f[type + 2], NULL, 10);
+  m->ms = strtoll(lf.f[type + 3], NULL, 10);
+  m->val = strtol(lf.f[type + 4], NULL, 10);
+  return true;
+}
+
+// Downsampling (?points=N&mode=minmax|lttb). The window a query selects
+// is read once, and each (type, loc, num) series is cut down to about N
+// points as its samples go by, so what we hold depends on N and not on
+// how long the window is. A series is split into buckets of k samples,
+// of which we keep only the first, last, smallest and largest sample
+// and the sums for their mean. k starts at 1; whenever a series fills
+// twice the buckets it needs, neighbouring buckets are merged in pairs
+// and k doubles. At the end the buckets are grouped into as many as are
+// wanted: minmax sends the smallest and largest sample of each, which
+// keeps every peak of a breath, and lttb the one of its kept samples
+// that makes the largest triangle with the point before and the mean of
+// the next bucket (Largest Triangle Three Buckets), which looks closest
+// to the full trace. A series that never needed merging is sent whole.
+// Events and anything we cannot parse are always kept. Everything kept
+// is rendered as before, in log order, so the JSON records have their
+// usual shape. If memory runs out we stop reading and send what we have.
+#define DS_SERIES_MAX 256
+#define DS_POINTS_MAX 10000
+#define DS_LINE_MAX 64       // longer lines are kept as events
+
+enum { DS_MINMAX, DS_LTTB };
+
+struct ds_point {
+  int64_t ms;
+  int32_t val;
+  uint64_t seq;              // line number in the window, or record number
+  char line[DS_LINE_MAX];    // the text log's line; empty for segments
+};
+
+struct ds_bucket {
+  struct ds_point first, min, max, last;
+  uint64_t count;
+  double sum_ms, sum_val;
+};
+
+struct ds_series {
+  uint32_t key;
+  struct ds_bucket *b;
+  size_t nb, cap;
+  uint64_t k;                // samples per bucket
+};
+
+struct ds_event {
+  uint64_t seq;
+  uint64_t ref;              // offset of the line in arena, or record number
+};
+
+struct downsample {
+  int points, mode;
+  size_t buckets;            // how many a series ends up with
+  size_t max_buckets;        // how many it may hold before merging
+  struct ds_series series[DS_SERIES_MAX];
+  int nseries;
+  struct ds_event *ev;
+  size_t nev, ev_cap;
+  char *arena;               // the events' lines of a text log, null terminated
+  size_t arena_len, arena_cap;
+  uint64_t seq;
+};
+
+void ds_init(struct downsample *d, int points, int mode) {
+  memset(d, 0, sizeof *d);
+  if (points > DS_POINTS_MAX)
+    points = DS_POINTS_MAX;
+  d->points = points;
+  d->mode = mode;
+  if (mode == DS_LTTB)
+    d->buckets = points > 3 ? points - 2 : 1;
+  else
+    d->buckets = points > 2 ? points / 2 : 1;
+  d->max_buckets = 2 * d->buckets > (size_t) points ? 2 * d->buckets : (size_t) points;
+}
+
+struct ds_series *ds_series(struct downsample *d, char type, char loc, unsigned num) {
+  uint32_t key = (uint8_t) type << 16 | (uint8_t) loc << 8 | (num & 0xff);
+  for (int i = 0; i < d->nseries; i++)
+    if (d->series[i].key == key)
+      return &d->series[i];
+  if (d->nseries == DS_SERIES_MAX)
+    return NULL;             // too many series: keep all of the rest
+  struct ds_series *s = &d->series[d->nseries++];
+  s->key = key;
+  s->k = 1;
+  return s;
+}
+
+// b takes in a, which comes after it.
+void ds_merge(struct ds_bucket *b, const struct ds_bucket *a) {
+  if (a->min.val < b->min.val)
+    b->min = a->min;
+  if (a->max.val > b->max.val)
+    b->max = a->max;
+  b->last = a->last;
+  b->count += a->count;
+  b->sum_ms += a->sum_ms;
+  b->sum_val += a->sum_val;
+}
+
+bool ds_add_event(struct downsample *d, const char *line, size_t len, uint64_t ref) {
+  if (d->nev == d->ev_cap) {
+    size_t cap = d->ev_cap ? 2 * d->ev_cap : 1024;
+    struct ds_event *ev = realloc(d->ev, cap * sizeof *ev);
+    if (!ev)
+      return false;
+    d->ev = ev;
+    d->ev_cap = cap;
+  }
+  if (line) {
+    if (d->arena_len + len + 1 > d->arena_cap) {
+      size_t cap = d->arena_cap ? d->arena_cap : 64 * 1024;
+      while (d->arena_len + len + 1 > cap)
+        cap *= 2;
+      char *arena = realloc(d->arena, cap);
+      if (!arena)
+        return false;
+      d->arena = arena;
+      d->arena_cap = cap;
+    }
+    ref = d->arena_len;
+    memcpy(d->arena + ref, line, len);
+    d->arena[ref + len] = '\0';
+    d->arena_len += len + 1;
+  }
+  d->ev[d->nev++] = (struct ds_event) { d->seq++, ref };
+  return true;
+}
+
+// Add a sample of s; line is its text (len bytes) or NULL.
+bool ds_add(struct downsample *d, struct ds_series *s, int64_t ms, int32_t val,
+            const char *line, size_t len) {
+  struct ds_point p = { ms, val, d->seq, "" };
+  if (line) {
+    memcpy(p.line, line, len);
+    p.line[len] = '\0';
+  }
+  struct ds_bucket *b = s->nb ? &s->b[s->nb - 1] : NULL;
+  if (b && b->count == s->k && s->nb == d->max_buckets) {
+    // Full: merge neighbours, leaving half as many buckets of 2k.
+    size_t half = (s->nb + 1) / 2;
+    for (size_t i = 0; i < s->nb / 2; i++) {
+      s->b[i] = s->b[2 * i];
+      ds_merge(&s->b[i], &s->b[2 * i + 1]);
+    }
+    if (s->nb % 2)
+      s->b[half - 1] = s->b[s->nb - 1];  // half full now; it goes on filling
+    s->nb = half;
+    s->k *= 2;
+    b = &s->b[s->nb - 1];
+  }
+  if (!b || b->count == s->k) {
+    if (s->nb == s->cap) {
+      size_t cap = s->cap ? 2 * s->cap : 64;
+      if (cap > d->max_buckets)
+        cap = d->max_buckets;
+      struct ds_bucket *nb = realloc(s->b, cap * sizeof *nb);
+      if (!nb)
+        return false;
+      s->b = nb;
+      s->cap = cap;
+    }
+    b = &s->b[s->nb++];
+    *b = (struct ds_bucket) { p, p, p, p, 1, ms, val };
+  } else {
+    struct ds_bucket one = { p, p, p, p, 1, ms, val };
+    ds_merge(b, &one);
+  }
+  d->seq++;
+  return true;
+}
+
+bool ds_add_line(struct downsample *d, const char *line, size_t len) {
+  struct sample m;
+  struct ds_series *s;
+  if (len < DS_LINE_MAX && parse_measurement(line, len, &m) &&
+      (s = ds_series(d, m.type, m.loc, m.num)))
+    return ds_add(d, s, m.ms, m.val, line, len);
+  return ds_add_event(d, line, len, 0);
+}
+
+bool ds_add_record(struct downsample *d, const struct segment_record *r, uint64_t i) {
+  struct ds_series *s;
+  d->seq = i;
+  if (r->event == 'M' && (s = ds_series(d, r->type, r->loc, r->num)))
+    return ds_add(d, s, r->epoch_ms, r->val, NULL, 0);
+  return ds_add_event(d, NULL, 0, i);
+}
+
+// Group the nb buckets of s into d->buckets, in place.
+void ds_regroup(struct downsample *d, struct ds_series *s) {
+  size_t want = d->buckets;
+  if (s->nb <= want)
+    return;
+  for (size_t g = 0; g < want; g++) {
+    size_t lo = g * s->nb / want, hi = (g + 1) * s->nb / want;
+    struct ds_bucket b = s->b[lo];
+    for (size_t i = lo + 1; i < hi; i++)
+      ds_merge(&b, &s->b[i]);
+    s->b[g] = b;
+  }
+  s->nb = want;
+}
+
+static inline double ds_area(const struct ds_point *a, const struct ds_point *p,
+                             double cx, double cy) {
+  double area = ((double) a->ms - cx) * ((double) p->val - a->val) -
+    ((double) a->ms - p->ms) * (cy - a->val);
+  return area < 0 ? -area : area;
+}
+
+struct ds_keep {
+  uint64_t seq;
+  const char *line;          // NULL for a record
+};
+
+int ds_keep_compare(const void *a, const void *b) {
+  uint64_t x = ((const struct ds_keep *) a)->seq, y = ((const struct ds_keep *) b)->seq;
+  return x < y ? -1 : x > y;
+}
+
+static inline void ds_keep_point(struct ds_keep *keep, size_t *n, const struct ds_point *p) {
+  keep[(*n)++] = (struct ds_keep) { p->seq, p->line[0] ? p->line : NULL };
+}
+
+// Choose what to keep of every series and render it, with every event,
+// in the order it was logged.
+void ds_render(struct downsample *d, struct segment_chain *seg, int *first,
+               const struct record_filter *f) {
+  size_t n = d->nev;
+  for (int i = 0; i < d->nseries; i++)
+    n += 4 * d->series[i].nb;
+  struct ds_keep *keep = malloc((n ? n : 1) * sizeof *keep);
+  if (!keep)
+    return;
+  n = 0;
+  for (size_t i = 0; i < d->nev; i++)
+    keep[n++] = (struct ds_keep) { d->ev[i].seq, seg ? NULL : d->arena + d->ev[i].ref };
+  for (int i = 0; i < d->nseries; i++) {
+    struct ds_series *s = &d->series[i];
+    if (s->nb == 0)
+      continue;
+    if (s->k == 1 && s->nb <= (size_t) d->points) {
+      for (size_t j = 0; j < s->nb; j++)
+        ds_keep_point(keep, &n, &s->b[j].first);
+      continue;
+    }
+    ds_regroup(d, s);
+    const struct ds_point *a = &s->b[0].first, *end = &s->b[s->nb - 1].last;
+    ds_keep_point(keep, &n, a);
+    ds_keep_point(keep, &n, end);
+    for (size_t j = 0; j < s->nb; j++) {
+      struct ds_bucket *b = &s->b[j];
+      if (d->mode != DS_LTTB) {
+        ds_keep_point(keep, &n, &b->min);
+        ds_keep_point(keep, &n, &b->max);
+        continue;
+      }
+      // The third corner is the mean of the next bucket, or the end.
+      double cx = end->ms, cy = end->val;
+      if (j + 1 < s->nb) {
+        cx = s->b[j + 1].sum_ms / s->b[j + 1].count;
+        cy = s->b[j + 1].sum_val / s->b[j + 1].count;
+      }
+      const struct ds_point *pick = &b->first, *cand[3] = { &b->min, &b->max, &b->last };
+      double best = ds_area(a, pick, cx, cy);
+      for (int c = 0; c < 3; c++) {
+        double area = ds_area(a, cand[c], cx, cy);
+        if (area > best) {
+          best = area;
+          pick = cand[c];
+        }
+      }
+      ds_keep_point(keep, &n, pick);
+      a = pick;
+    }
+  }
+  qsort(keep, n, sizeof *keep, ds_keep_compare);
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0 && keep[i].seq == keep[i - 1].seq)
+      continue;
+    const struct segment_map *m;
+    const struct segment_record *r;
+    if (seg) {
+      if ((r = segment_chain_rec(seg, keep[i].seq, &m)))
+        render_record_filtered(r, m->heap, m->heap_size, 1, first, f);
+    } else
+      render_line_filtered((char *) keep[i].line, 1, first, f);
+  }
+  free(keep);
+}
+
+void ds_free(struct downsample *d) {
+  for (int i = 0; i < d->nseries; i++)
+    free(d->series[i].b);
+  free(d->ev);
+  free(d->arena);
+}
+
+// fields=ms,val and so on; every field if none of them is one we know.
+unsigned parse_fields(const char *query_val) {
+  static const char *names[] = { "event", "type", "loc", "num", "ms", "val", "buff" };
+  unsigned mask = 0;
+  char *decode = urlDecode(query_val), *val = decode;
+  while (*val) {
+    size_t len = strcspn(val, ",");
+    for (int k = 0; k < (int) (sizeof names / sizeof names[0]); k++)
+      if (strlen(names[k]) == len && strncmp(val, names[k], len) == 0)
+        mask |= 1u << k;
+    val += len + (val[len] == ',');
+  }
+  free(decode);
+  return mask ? mask : FIELDS_ALL;
+}
+
+// Whether a tier's buckets cover start_ms..end_ms: the first must start
+// by start_ms and the last written must reach end_ms, or as near now as
+// the logger can have closed a bucket.
+bool rollup_covers(const struct rollup_record *recs, size_t count, int64_t w,
+                   int64_t start_ms, int64_t end_ms) {
+  if (count == 0 || recs[0].start_ms > start_ms)
+    return false;
+  int64_t written = (int64_t) time(NULL) * 1000 - w - ROLLUP_GRACE_MS;
+  return recs[count-1].start_ms + w >= (end_ms < written ? end_ms : written);
+}
 
-          dStr[i] = x;
-        }
-      }
+// A long ?t=...&t_end=...&points=N&event=M query in minmax mode, without
+// n=, can be answered from the logger's rollups (pirds_logger -r) instead
+// of the samples, since they hold nothing but the M measurements:
+// we take the coarsest tier whose buckets are no wider than two points
+// (a bucket gives its min and max) and send, for each bucket in the
+// range, its min at the start of the bucket and its max half way
+// through. A tier is only used if it covers the whole range, up to the
+// buckets that cannot have been written yet: it may have been started
+// (-r) after the data, and rolled parts have no rollups. Returns false,
+// having sent nothing, if no tier fits.
+bool rollup_render(char *ipaddr, time_t t_start, time_t t_end, int points, int *first,
+                   const struct record_filter *f) {
+  int64_t width = (int64_t) (t_end - t_start) * 1000 * 2 / points;
+  const struct rollup_record *recs = NULL;
+  void *base = NULL;
+  size_t size = 0, count = 0;
+  int64_t start_ms = (int64_t) t_start * 1000, end_ms = (int64_t) t_end * 1000;
+  int tier;
+  for (tier = ROLLUP_TIERS - 1; tier >= 0; tier--) {
+    if (rollup_tiers[tier].ms > width)
+      continue;
+    char *fname = NULL;
+    asprintf(&fname, "%s/%s%s", DIR_NAME, rollup_tiers[tier].prefix, ipaddr);
+    base = map_file(fname, &size);
+    free(fname);
+    if (!base)
+      continue;
+    if (size >= SEGMENT_HEADER_SIZE && rollup_header_ok(base)) {
+      recs = (const struct rollup_record *)((char *) base + SEGMENT_HEADER_SIZE);
+      count = (size - SEGMENT_HEADER_SIZE) / sizeof *recs;
+      if (rollup_covers(recs, count, rollup_tiers[tier].ms, start_ms, end_ms))
+        break;
     }
+    munmap(base, size);
+    base = NULL;
   }
-
-  return dStr;
+  if (!base)
+    return false;
+  int64_t w = rollup_tiers[tier].ms;
+
+  // The first bucket that ends after t_start...
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (recs[mid].start_ms + w > start_ms)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  // ...and everything from there that starts by t_end.
+  for (size_t i = lo; i < count && recs[i].start_ms <= end_ms; i++) {
+    const struct rollup_record *b = &recs[i];
+    if (b->start_ms + w <= start_ms)
+      continue;              // out of order, after a clock reset
+    struct segment_record r = {
+      b->start_ms / 1000, b->start_ms, b->min, 'M', b->type, b->loc, b->num, SEGMENT_NO_HEAP
+    };
+    render_record_filtered(&r, NULL, 0, 1, first, f);
+    if (b->max != b->min) {
+      r.epoch_ms = b->start_ms + w / 2;
+      r.val = b->max;
+      render_record_filtered(&r, NULL, 0, 1, first, f);
+    }
+  }
+  munmap(base, size);
+  return true;
 }
 
 void
 dump_data(char *ipaddr, int json) {
   if (json)
-    printf("Content-type: application/json\n");
+    fprintf(cgi_out, "Content-type: application/json\n");
   else
-    printf("Content-type: text/plain\n");
-  printf("Access-Control-Allow-Origin: *\n");
-  printf("\n");
-
-  char *fname = NULL;
-  asprintf(&fname, "%s/0Logfile.%s", DIR_NAME,ipaddr);
-  //  fprintf(stderr,"fname = %s\n",fname);
-  FILE *fp = fopen(fname, "r");
-  if (fname) free(fname);
-  if (!fp) {
-    printf("No such dataset %s\n", ipaddr);
-    return;
+    fprintf(cgi_out, "Content-type: text/plain\n");
+  fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+  fprintf(cgi_out, "\n");
+
+  // If the logger keeps binary segments (-s segment or both) we read
+  // those: positioning is arithmetic and nothing needs tokenizing.
+  struct segment_chain seg;
+  int use_segment = segment_chain_open(&seg, ipaddr);
+  size_t seg_start = 0;
+
+  FILE *fp = NULL;
+  struct dataset *ds = NULL;
+  struct text_chain tc;
+  if (!use_segment) {
+    if (gDAEMON && (ds = dataset_get(ipaddr)))
+      fp = dataset_fdopen(ds);
+    else {
+      char *fname = NULL;
+      asprintf(&fname, "%s/0Logfile.%s", DIR_NAME,ipaddr);
+      //  fprintf(stderr,"fname = %s\n",fname);
+      fp = fopen(fname, "r");
+      if (fname) free(fname);
+    }
+    if (!fp) {
+      fprintf(cgi_out, "No such dataset %s\n", ipaddr);
+      return;
+    }
+    text_chain_open(&tc, ipaddr, fp);
   }
   char *qs = get_envvar("QUERY_STRING");
   int backlines = 0;
 
-  if (qs && strncmp(qs, "n=", 2) == 0) {
-    backlines = atoi(qs+2);
-    if (backlines > 0)
-    find_back_lines(fp, backlines);
-  }
-
   char *query;
   char *tokens;
   char *p;
-  query = strdup (qs);  /* duplicate array, &array is not char** */
+  char *qsave;
+  query = strdup (qs ? qs : "");  /* duplicate array, &array is not char** */
   tokens = query;
   p = query;
-  //  printf("query %s\n",query);
-  struct tm tm = {0};
+  //  fprintf(cgi_out, "query %s\n",query);
   int time_found = 0;
+  time_t epoch_time_start = 0;
+  time_t epoch_time_end = 0;
+  int points = 0;
+  int mode = DS_MINMAX;
+  struct record_filter filter = { 0, 0, 0, -1, FIELDS_ALL };
   while ((p = strsep (&tokens, "&\n"))) {
-    char *var = strtok (p, "="),
+    char *var = strtok_r(p, "=", &qsave),
       *val = NULL;
-    if (var && (val = strtok (NULL, "="))) {
-      //      printf("%s %s\n",var,val);
-      if (!strcmp(var,"t")) {
-        char *decode = urlDecode(val);
-        //               printf("DECODE ==%s\n",decode);
-
-        char *s = strptime(decode, "%a, %d %b %Y %H:%M:%S", &tm);
-        //          printf("First unprocessed |%s|\n",s);
-        //           printf("UTC time: %s", asctime(&tm));
+    if (var && (val = strtok_r(NULL, "=", &qsave))) {
+      //      fprintf(cgi_out, "%s %s\n",var,val);
+      if (!strcmp(var,"n"))
+        backlines = atoi(val);
+      else if (!strcmp(var,"t") || !strcmp(var,"t_start")) {
         time_found = 1;
-        time_t epoch_time_start = timegm ( &tm );
-        //           printf("epoch %ld",(long) epoch_time_start);
-        // This positions in the write spot...
-        find_line_from_time(fp,epoch_time_start);
-        free(decode);
-      }
+        epoch_time_start = parse_query_time(val);
+        //           fprintf(cgi_out, "epoch %ld",(long) epoch_time_start);
+      } else if (!strcmp(var,"t_end"))
+        epoch_time_end = parse_query_time(val);
+      else if (!strcmp(var,"points"))
+        points = atoi(val);
+      else if (!strcmp(var,"mode"))
+        mode = strcmp(val, "lttb") ? DS_MINMAX : DS_LTTB;
+      else if (!strcmp(var,"event"))
+        filter.event = val[0];
+      else if (!strcmp(var,"type"))
+        filter.type = val[0];
+      else if (!strcmp(var,"loc"))
+        filter.loc = val[0];
+      else if (!strcmp(var,"num"))
+        filter.num = atoi(val);
+      else if (!strcmp(var,"fields"))
+        filter.fields = parse_fields(val);
     } else {
       fputs ("<empty field>\n", stderr);
     }
   }
+  // This positions in the write spot...
+  if (backlines > 0) {
+    int found = -1;
+    if (use_segment)
+      seg_start = seg.total > (size_t) backlines ? seg.total - backlines : 0;
+    else if (!(ds && dataset_seek_back_lines(ds, fp, backlines, &found)))
+      found = -1;
+    if (!use_segment)
+      text_chain_seek_back(&tc, backlines, found);
+  }
+  if (time_found) {
+    if (use_segment)
+      seg_start = segment_chain_find_time(&seg, epoch_time_start);
+    else
+      text_chain_seek_time(&tc, ipaddr, epoch_time_start);
+  }
+  // A time window without n= means everything in the window.
+  if ((time_found || epoch_time_end) && backlines <= 0)
+    backlines = INT_MAX;
 
   if ((backlines == 0 || backlines > 1) && json)
-    printf("[\n");
+    fprintf(cgi_out, "[\n");
 
   // in fact from the QUERY_STRING we need to get both n=XX and t=YY
 
@@ -356,93 +1988,329 @@ dump_data(char *ipaddr, int json) {
   char *line = NULL;
   size_t c = 0;
   int line_cnt = 0;
-  while (getline(&line, &c, fp) > 0 &&
-         (line_cnt < backlines)) {
-    line_cnt++;
-    if (!json)
-      printf("%s", line);
+  if (points > 0 && json && mode == DS_MINMAX && time_found && epoch_time_end &&
+      backlines == INT_MAX && filter.event == 'M' &&
+      rollup_render(ipaddr, epoch_time_start, epoch_time_end, points, &first, &filter)) {
+    // answered from the rollups
+  } else if (points > 0 && json) {
+    struct downsample d;
+    ds_init(&d, points, mode);
+    if (use_segment)
+      for (size_t i = seg_start; i < seg.total && line_cnt < backlines; i++, line_cnt++) {
+        const struct segment_map *m;
+        const struct segment_record *r = segment_chain_rec(&seg, i, &m);
+        if (!r)
+          continue;
+        if (epoch_time_end && r->arrival > epoch_time_end)
+          break;
+        if (filter_record(&filter, r) && !ds_add_record(&d, r, i))
+          break;
+      }
     else {
-      char *ptr;
-      if ((ptr = strchr(line, '\r')) || (ptr = strchr(line, '\n')))
-        *ptr = '\0';
-      if (!first)
-        printf(",\n");
-      first = 0;
-      //      printf("{ \"event\": \"M\",");
-      char *v = strtok(line, ":"); // skip timestamp
-      v = strtok(NULL, ":");
-      // Note: This fundamentally should come form our main library to reduce duplication
-      // This part is for back-compatibility;
-      // it should be removed when we have a chance
-      if ((0 == strcmp(v,"P")) ||
-          (0 == strcmp(v,"D")) ||
-          (0 == strcmp(v,"F")) ||
-          (0 == strcmp(v,"H")) ||
-          (0 == strcmp(v,"G")) ||
-          (0 == strcmp(v,"T")) ||
-          (0 == strcmp(v,"A"))
-          ) {
-        printf("{ \"event\": \"M\",");
-        //      v = strtok(NULL, ":");
-        printf(" \"type\": \"%s\",", v);
-        v = strtok(NULL, ":");
-        printf(" \"loc\": \"%s\",", v);
-        v = strtok(NULL, ":");
-        printf(" \"num\": %s,", v);
-        v = strtok(NULL, ":");
-        printf(" \"ms\": %s,", v);
-        v = strtok(NULL, ":");
-        printf(" \"val\": %s }", v);
-      } else if (0 == strcmp(v,"M")) {
-        printf("{ \"event\": \"%s\",",v);
-        v = strtok(NULL, ":");
-        printf(" \"type\": \"%s\",", v);
-        v = strtok(NULL, ":");
-        printf(" \"loc\": \"%s\",", v);
-        v = strtok(NULL, ":");
-        printf(" \"num\": %s,", v);
-        v = strtok(NULL, ":");
-        printf(" \"ms\": %s,", v);
-        v = strtok(NULL, ":");
-        printf(" \"val\": %s }", v);
-      } else if (0 == strcmp(v,"E")) {
-        // The only currently supported other format is "M"
-        v = strtok(NULL, ":");
-        if (0 == strcmp(v,"M")) {
-            printf("{ \"event\": \"%s\",","E");
-            printf(" \"type\": \"M\",");
-            v = strtok(NULL, ":");
-            printf(" \"ms\": %s,", v);
-            v = strtok(NULL, ":");
-            // Note: This string is already double quoted...
-            // this is not good strong typing,
-            // it should be improved.
-            printf(" \"buff\": %s }", v);
-        } else if (0 == strcmp(v,"C")) {
-            printf("{ \"event\": \"%s\",","E");
-            printf(" \"type\": \"C\",");
-            v = strtok(NULL, ":");
-            printf(" \"ms\": %s,", v);
-            // Now get the rest of the string, as it is a complex date
-            v = strtok(NULL, "\0");
-            printf(" \"buff\": %s }", v);
-        } else {
-          printf("\"\"");
-        }
+      ssize_t len;
+      while ((len = text_chain_getline(&tc, &line, &c)) > 0 && line_cnt < backlines &&
+             !(epoch_time_end && strtoll(line, NULL, 10) > epoch_time_end)) {
+        line_cnt++;
+        if (filter_line(&filter, line, len) && !ds_add_line(&d, line, len))
+          break;
       }
     }
+    ds_render(&d, use_segment ? &seg : NULL, &first, &filter);
+    ds_free(&d);
+  } else if (use_segment) {
+    for (size_t i = seg_start; i < seg.total && line_cnt < backlines; i++) {
+      const struct segment_map *m;
+      const struct segment_record *r = segment_chain_rec(&seg, i, &m);
+      if (!r)
+        continue;
+      if (epoch_time_end && r->arrival > epoch_time_end)
+        break;
+      line_cnt++;
+      render_record_filtered(r, m->heap, m->heap_size, json, &first, &filter);
+    }
+  } else {
+    while (text_chain_getline(&tc, &line, &c) > 0 &&
+           (line_cnt < backlines) &&
+           !(epoch_time_end && strtoll(line, NULL, 10) > epoch_time_end)) {
+      line_cnt++;
+      render_line_filtered(line, json, &first, &filter);
+    }
   }
+  out_flush();
   //  if ((backlines == 0 || backlines > 1) && json)
   if ((backlines == 0 || backlines > 1) && json)
-    printf("]\n");
+    fprintf(cgi_out, "]\n");
 
   free (query);
+  free (line);
 
-  fclose(fp);
+  if (use_segment)
+    segment_chain_close(&seg);
+  else
+    text_chain_close(&tc);
 
   return;
 }
 
+// Statistics (/rds/<device>/stats). For every channel (type, loc, num)
+// in a window of arrival time we count, sum and square the values for
+// mean and standard deviation, and put them in a sketch for the
+// percentiles: a histogram with a bucket for every value below
+// SKETCH_LINEAR, which covers what devices send, so those percentiles
+// are exact, and above that logarithmic buckets, each SKETCH_ALPHA wider
+// than the last (after DDSketch), so a percentile is within 0.1% of a
+// value that occurred. Sketches are just arrays of counts, so two of
+// them merge by adding the counts; that is how the channels of several
+// devices (/rds/<d1>,<d2>/stats) are combined. They are big but sparse,
+// and calloc leaves the pages that are never counted in unmapped.
+#define SKETCH_LINEAR 65536
+#define SKETCH_ALPHA 0.001
+// |val| <= 2^31, and log bucket k holds values up to SKETCH_LINEAR * gamma^k
+#define SKETCH_BINS (SKETCH_LINEAR + 5200)
+#define STATS_CHANNELS 256
+
+struct sketch {
+  uint32_t pos[SKETCH_BINS];  // values >= 1
+  uint32_t neg[SKETCH_BINS];  // values <= -1, by magnitude
+  uint64_t zero;
+};
+
+struct channel_stats {
+  char type, loc;
+  unsigned num;
+  uint64_t count;
+  double sum, sumsq;
+  int32_t min, max;
+  struct sketch *sk;
+};
+
+__thread double sketch_ln_gamma = 0;
+
+static inline int sketch_index(uint32_t v) {
+  if (v < SKETCH_LINEAR)
+    return v;
+  if (!sketch_ln_gamma)
+    sketch_ln_gamma = log((1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA));
+  int i = SKETCH_LINEAR + (int) ceil(log((double) v / SKETCH_LINEAR) / sketch_ln_gamma);
+  return i < SKETCH_BINS ? i : SKETCH_BINS - 1;
+}
+
+void sketch_add(struct sketch *sk, int32_t v) {
+  if (v > 0)
+    sk->pos[sketch_index(v)]++;
+  else if (v < 0)
+    sk->neg[sketch_index(-(int64_t) v)]++;
+  else
+    sk->zero++;
+}
+
+void sketch_merge(struct sketch *into, const struct sketch *from) {
+  // Only where there are counts, to leave into's empty pages alone.
+  for (int i = 0; i < SKETCH_BINS; i++) {
+    if (from->pos[i])
+      into->pos[i] += from->pos[i];
+    if (from->neg[i])
+      into->neg[i] += from->neg[i];
+  }
+  into->zero += from->zero;
+}
+
+// The value of bucket i: i itself below SKETCH_LINEAR, else the middle
+// of the log bucket, to within SKETCH_ALPHA of everything in it.
+static inline double sketch_value(int i) {
+  if (i <= SKETCH_LINEAR)
+    return i;
+  double gamma = exp(sketch_ln_gamma);
+  return SKETCH_LINEAR * 2 * pow(gamma, i - SKETCH_LINEAR) / (gamma + 1);
+}
+
+// The q-quantile of the count values in sk.
+double sketch_quantile(const struct sketch *sk, uint64_t count, double q) {
+  uint64_t rank = (uint64_t) (q * (count - 1)), seen = 0;
+  for (int i = SKETCH_BINS - 1; i >= 0; i--)
+    if ((seen += sk->neg[i]) > rank)
+      return -sketch_value(i);
+  if ((seen += sk->zero) > rank)
+    return 0;
+  for (int i = 0; i < SKETCH_BINS; i++)
+    if ((seen += sk->pos[i]) > rank)
+      return sketch_value(i);
+  return 0;
+}
+
+struct stats_query {
+  time_t t_start, t_end;     // 0: open
+  char type, loc;            // 0: any
+  int num;                   // -1: any
+  struct channel_stats ch[STATS_CHANNELS];
+  int nch;
+};
+
+struct channel_stats *stats_channel(struct stats_query *sq, char type, char loc, unsigned num) {
+  for (int i = 0; i < sq->nch; i++)
+    if (sq->ch[i].type == type && sq->ch[i].loc == loc && sq->ch[i].num == num)
+      return &sq->ch[i];
+  if (sq->nch == STATS_CHANNELS)
+    return NULL;
+  struct channel_stats *c = &sq->ch[sq->nch];
+  memset(c, 0, sizeof *c);
+  if (!(c->sk = calloc(1, sizeof *c->sk)))
+    return NULL;
+  sq->nch++;
+  c->type = type;
+  c->loc = loc;
+  c->num = num;
+  c->min = INT32_MAX;
+  c->max = INT32_MIN;
+  return c;
+}
+
+void stats_add(struct stats_query *sq, const struct sample *m) {
+  if ((sq->type && m->type != sq->type) || (sq->loc && m->loc != sq->loc) ||
+      (sq->num >= 0 && m->num != (unsigned) sq->num))
+    return;
+  struct channel_stats *c = stats_channel(sq, m->type, m->loc, m->num);
+  if (!c)
+    return;
+  c->count++;
+  c->sum += m->val;
+  c->sumsq += (double) m->val * m->val;
+  if (m->val < c->min) c->min = m->val;
+  if (m->val > c->max) c->max = m->val;
+  sketch_add(c->sk, m->val);
+}
+
+// Add one device's samples in the window to sq; false if there is no
+// such device.
+bool stats_scan(struct stats_query *sq, char *ipaddr) {
+  struct segment_chain seg;
+  struct sample m;
+  if (segment_chain_open(&seg, ipaddr)) {
+    size_t i = sq->t_start ? segment_chain_find_time(&seg, sq->t_start) : 0;
+    for (; i < seg.total; i++) {
+      const struct segment_map *map;
+      const struct segment_record *r = segment_chain_rec(&seg, i, &map);
+      if (!r || r->event != 'M')
+        continue;
+      if (sq->t_end && r->arrival > sq->t_end)
+        break;
+      m = (struct sample) { r->arrival, r->epoch_ms, r->val, r->type, r->loc, r->num };
+      stats_add(sq, &m);
+    }
+    segment_chain_close(&seg);
+    return true;
+  }
+  char *fname = NULL;
+  asprintf(&fname, "%s/0Logfile.%s", DIR_NAME, ipaddr);
+  FILE *fp = fopen(fname, "r");
+  free(fname);
+  if (!fp)
+    return false;
+  struct text_chain tc;
+  text_chain_open(&tc, ipaddr, fp);
+  if (sq->t_start)
+    text_chain_seek_time(&tc, ipaddr, sq->t_start);
+  else if (tc.nparts)
+    text_chain_start(&tc, 0, text_chain_part(&tc, 0));
+  char *line = NULL;
+  size_t c = 0;
+  ssize_t len;
+  while ((len = text_chain_getline(&tc, &line, &c)) > 0) {
+    if (sq->t_end && strtoll(line, NULL, 10) > sq->t_end)
+      break;
+    if (parse_measurement(line, len, &m))
+      stats_add(sq, &m);
+  }
+  free(line);
+  text_chain_close(&tc);
+  return true;
+}
+
+// /rds/<device>[,<device>...]/stats?t_start=&t_end=&type=&loc=&num=
+void dump_stats(char *ipaddrs) {
+  struct stats_query *sq = calloc(1, sizeof *sq);
+  sq->num = -1;
+  char *qs = get_envvar("QUERY_STRING");
+  char *query = strdup(qs ? qs : "");
+  char *tokens = query, *p, *qsave;
+  while ((p = strsep(&tokens, "&\n"))) {
+    char *var = strtok_r(p, "=", &qsave), *val;
+    if (!var || !(val = strtok_r(NULL, "=", &qsave)))
+      continue;
+    if (!strcmp(var, "t_start") || !strcmp(var, "t"))
+      sq->t_start = parse_query_time(val);
+    else if (!strcmp(var, "t_end"))
+      sq->t_end = parse_query_time(val);
+    else if (!strcmp(var, "type"))
+      sq->type = val[0];
+    else if (!strcmp(var, "loc"))
+      sq->loc = val[0];
+    else if (!strcmp(var, "num"))
+      sq->num = atoi(val);
+  }
+  free(query);
+
+  // Every device is scanned into a query of its own and its channels
+  // are then merged in, as they would be if they came from elsewhere.
+  struct stats_query *one = calloc(1, sizeof *one);
+  char *save, *ipaddr;
+  bool found = false;
+  for (ipaddr = strtok_r(ipaddrs, ",", &save); ipaddr; ipaddr = strtok_r(NULL, ",", &save)) {
+    one->t_start = sq->t_start;
+    one->t_end = sq->t_end;
+    one->type = sq->type;
+    one->loc = sq->loc;
+    one->num = sq->num;
+    one->nch = 0;
+    if (!stats_scan(one, ipaddr))
+      continue;
+    found = true;
+    for (int i = 0; i < one->nch; i++) {
+      struct channel_stats *from = &one->ch[i];
+      struct channel_stats *into = stats_channel(sq, from->type, from->loc, from->num);
+      if (into) {
+        into->count += from->count;
+        into->sum += from->sum;
+        into->sumsq += from->sumsq;
+        if (from->min < into->min) into->min = from->min;
+        if (from->max > into->max) into->max = from->max;
+        sketch_merge(into->sk, from->sk);
+      }
+      free(from->sk);
+    }
+  }
+  free(one);
+
+  fprintf(cgi_out, "Content-type: application/json\n");
+  fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+  fprintf(cgi_out, "\n");
+  if (!found) {
+    fprintf(cgi_out, "No such dataset %s\n", ipaddrs);
+  } else {
+    fprintf(cgi_out, "[\n");
+    for (int i = 0; i < sq->nch; i++) {
+      struct channel_stats *c = &sq->ch[i];
+      double mean = c->sum / c->count;
+      double var = c->sumsq / c->count - mean * mean;
+      double q[3] = { 0.50, 0.95, 0.99 }, v[3];
+      // A percentile is never outside the values we saw.
+      for (int k = 0; k < 3; k++) {
+        v[k] = sketch_quantile(c->sk, c->count, q[k]);
+        v[k] = v[k] < c->min ? c->min : v[k] > c->max ? c->max : v[k];
+      }
+      fprintf(cgi_out, "%s{ \"type\": \"%c\", \"loc\": \"%c\", \"num\": %u, \"count\": %llu, "
+              "\"mean\": %.3f, \"stddev\": %.3f, \"min\": %d, \"max\": %d, "
+              "\"p50\": %.1f, \"p95\": %.1f, \"p99\": %.1f }",
+              i ? ",\n" : "", c->type, c->loc, c->num, (unsigned long long) c->count,
+              mean, var > 0 ? sqrt(var) : 0.0, c->min, c->max, v[0], v[1], v[2]);
+    }
+    fprintf(cgi_out, "\n]\n");
+  }
+  for (int i = 0; i < sq->nch; i++)
+    free(sq->ch[i].sk);
+  free(sq);
+}
+
 // This function copied from: https://stackoverflow.com/questions/9210528/split-string-with-delimiters-in-c
 char** str_split(char* a_str, const char a_delim)
 {
@@ -478,49 +2346,41 @@ char** str_split(char* a_str, const char a_delim)
     if (result)
     {
         size_t idx  = 0;
-        char* token = strtok(a_str, delim);
+        char *save;
+        char* token = strtok_r(a_str, delim, &save);
 
         while (token)
         {
             assert(idx < count);
             *(result + idx++) = strdup(token);
-            token = strtok(0, delim);
+            token = strtok_r(0, delim, &save);
         }
+        *(result + idx) = 0;
     }
 
     return result;
 }
 
 
-int main() {
-  cgienv_parse();
-
+// Route one request, described by evars, and write the response to
+// cgi_out. Returns the exit status for CGI.
+int handle_request() {
   // The script_name in fact is of the form "*/rds" --- and we only want the first part.
   scriptname = get_envvar("SCRIPT_NAME");
   scriptname = get_envvar("SERVER_NAME");
 
   //  fprintf(stderr,"scriptname = %s\n",scriptname);
 
-  // if the "PIRDS_WEBCGI" is set, we want to use it as DIR_NAME.
-  char *pirds_webcgi = get_envvar("PIRDS_WEBCGI");
-  if (strlen(pirds_webcgi)) {
-    // I believe this is okay because these strings are constants
-    DIR_NAME = pirds_webcgi;
-    //    fprintf(stderr,"DIR_NAME = %s\n",DIR_NAME);
-  } else {
-    //    fprintf(stderr,"PIRDS_WEBCGI not found\n");
-  }
-
   char *uri = get_envvar("REQUEST_URI");
 
   char *qs = get_envvar("QUERY_STRING");
 
   if (uri == NULL) {
-    printf("Content-type: text/plain\n");
-    printf("Access-Control-Allow-Origin: *\n");
-    printf("\n");
-    printf("Bad Request");
-    exit(1);
+    fprintf(cgi_out, "Content-type: text/plain\n");
+    fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+    fprintf(cgi_out, "\n");
+    fprintf(cgi_out, "Bad Request");
+    return 1;
   }
 
   // I think I want to make this code more robust so the url can be served
@@ -556,6 +2416,8 @@ int main() {
   } else {
     uri_only[0] = '\0';
   }
+  free(uri_tokens);
+  free(path_for_uri);
 
   char** tokens;
   tokens = str_split(uri_only, '/');
@@ -578,7 +2440,8 @@ int main() {
   char pen_token[256];
   ult_token[0] = '\0';
   pen_token[0] = '\0';
-  if (tokens[1]) {
+  free(tokens[0]);
+  if (tokens[0] && tokens[1]) {
       size_t i;
       for (i = 1; *(tokens + i); i++)
         {
@@ -590,19 +2453,923 @@ int main() {
       if (strlen(ult_token)) {
         if (strlen(pen_token) && strcasecmp(ult_token, "json") == 0) {
           dump_data(pen_token, 1);
+        } else if (strlen(pen_token) && strcasecmp(ult_token, "stats") == 0) {
+          dump_stats(pen_token);
+        } else if (strlen(pen_token) && strcasecmp(ult_token, "stream") == 0) {
+          // Served by http_serve_request() in daemon mode.
+          fprintf(cgi_out, "Content-type: text/plain\n");
+          fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+          fprintf(cgi_out, "\n");
+          fprintf(cgi_out, "Streaming needs pirds_webcgi -l\n");
         } else {
           dump_data(ult_token, 0);
         }
       } else {
-        printf("Content-type: text/plain\n");
-        printf("Access-Control-Allow-Origin: *\n");
-        printf("\n");
-        printf("Bad Request");
-        printf("%s",ult_token);
-        exit(0);
+        fprintf(cgi_out, "Content-type: text/plain\n");
+        fprintf(cgi_out, "Access-Control-Allow-Origin: *\n");
+        fprintf(cgi_out, "\n");
+        fprintf(cgi_out, "Bad Request");
+        fprintf(cgi_out, "%s",ult_token);
+        return 0;
       }
   } else {
+    free(tokens);
     list_datasets();
-    exit(0);
   }
+  return 0;
+}
+
+// Daemon mode (-l port): instead of being started by the web server
+// for every request, pirds_webcgi listens for HTTP itself. The main
+// thread accepts connections and waits for them with epoll; when one
+// has something to read it is queued for a pool of threads, and a
+// thread serves one request from it and gives it back. So connections
+// kept alive between requests (a dashboard polling every second) only
+// hold a thread while a request is being served. A request is turned
+// into the same variables the web server would set for CGI and handled
+// by handle_request(), so the two modes give the same answers.
+#define HTTP_THREADS_DEFAULT 8
+#define HTTP_REQUEST_MAX 8192
+#define HTTP_IDLE_TIMEOUT 30 // seconds
+#define HTTP_CONNS_MAX 1024
+#define HTTP_EVENTS 64
+#define HTTP_LISTENER ((uint32_t) -1)
+
+int gHTTP_THREADS = HTTP_THREADS_DEFAULT;
+
+void set_envvar(char *name, const char *value, size_t len) {
+  for (uint8_t i = 0; evars[i].name != NULL; i++) {
+    if (strcasecmp(name, evars[i].name) == 0) {
+      if (len >= EVARSIZE)
+        len = EVARSIZE - 1;
+      memcpy(evars[i].value, value, len);
+      evars[i].value[len] = '\0';
+      return;
+    }
+  }
+}
+
+int write_all(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+void http_error(int fd, const char *status) {
+  char resp[256];
+  int len = snprintf(resp, sizeof resp,
+                     "HTTP/1.1 %s\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n%s\n",
+                     status, strlen(status) + 1, status);
+  write_all(fd, resp, len);
+}
+
+// Send what handle_request() wrote to cgi_out: CGI header lines, a
+// blank line and the body.
+int http_respond(int fd, char *out, size_t out_len, bool head, bool keep_alive) {
+  char *body = strstr(out, "\n\n");
+  size_t hlen = 0;
+  if (body) {
+    hlen = body + 1 - out;
+    body += 2;
+  } else
+    body = out;
+  size_t blen = out + out_len - body;
+
+  char *resp = NULL;
+  size_t resp_len = 0;
+  FILE *r = open_memstream(&resp, &resp_len);
+  if (!r)
+    return -1;
+  fprintf(r, "HTTP/1.1 200 OK\r\n");
+  for (char *line = out; line < out + hlen; ) {
+    char *nl = memchr(line, '\n', out + hlen - line);
+    fprintf(r, "%.*s\r\n", (int) (nl - line), line);
+    line = nl + 1;
+  }
+  fprintf(r, "Content-Length: %zu\r\n", blen);
+  fprintf(r, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+  fclose(r);
+  int ret = write_all(fd, resp, resp_len);
+  if (ret == 0 && !head)
+    ret = write_all(fd, body, blen);
+  free(resp);
+  return ret;
+}
+
+// Live streams (daemon mode only): /rds/<dataset>/stream sends the
+// records appended to the dataset's text log as Server-Sent Events,
+// each one a JSON object rendered as for /json. ?n=N first sends the
+// last N records.
+//
+// One hub thread watches the data directory with inotify. For every
+// dataset somebody is streaming it keeps a feed: the log open at the
+// offset sent so far and the subscribers' sockets. When the log grows,
+// the new lines are read and rendered once and the result is written
+// to every subscriber. A subscriber whose socket cannot take the data
+// right away is dropped, so that a slow client cannot hold up the rest.
+// A new subscriber's backlog is rendered under the lock but sent without
+// it, with a timeout, and then whatever the hub sent meanwhile. A feed
+// nobody follows any more closes its log and its slot can be reused.
+#define STREAM_FEEDS_MAX 256
+#define STREAM_BACKLOG_MAX 5000
+#define STREAM_HEARTBEAT 15 // seconds; also how dead subscribers are noticed
+#define STREAM_SNDBUF (256*1024)
+#define STREAM_SEND_TIMEOUT 5 // seconds to take a backlog
+
+struct stream_feed {
+  char name[64];             // the dataset
+  int fd;                    // the log, -1 while it does not exist
+  off_t offset;              // everything before this has been sent
+  unsigned long gen;         // changes whenever fd does
+  int *subs;
+  int nsubs, maxsubs;
+  int pending;               // subscribers still being sent their backlog
+};
+
+struct stream_feed feeds[STREAM_FEEDS_MAX];
+int nfeeds = 0;
+pthread_mutex_t feeds_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t stream_once = PTHREAD_ONCE_INIT;
+int stream_inotify = -1;
+
+void stream_open_log(struct stream_feed *f, bool at_end) {
+  char *fname = NULL;
+  asprintf(&fname, "%s/0Logfile.%s", DIR_NAME, f->name);
+  if (f->fd >= 0)
+    close(f->fd);
+  f->fd = fname ? open(fname, O_RDONLY) : -1;
+  f->gen++;
+  f->offset = 0;
+  if (f->fd >= 0 && at_end)
+    f->offset = lseek(f->fd, 0, SEEK_END);
+  free(fname);
+}
+
+static inline bool stream_feed_idle(const struct stream_feed *f) {
+  return f->nsubs == 0 && f->pending == 0;
+}
+
+// Close f's log if nobody follows it any more.
+void stream_release(struct stream_feed *f) {
+  if (stream_feed_idle(f) && f->fd >= 0) {
+    close(f->fd);
+    f->fd = -1;
+    f->gen++;
+  }
+}
+
+void stream_drop(struct stream_feed *f, int i) {
+  close(f->subs[i]);
+  f->subs[i] = f->subs[--f->nsubs];
+  stream_release(f);
+}
+
+// Write data to every subscriber of f, dropping those who can't take it.
+void stream_send(struct stream_feed *f, const char *data, size_t len) {
+  for (int i = 0; i < f->nsubs; ) {
+    ssize_t n = send(f->subs[i], data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n != (ssize_t) len)
+      stream_drop(f, i);
+    else
+      i++;
+  }
+}
+
+// Render the complete lines in buf[0..len) as events to cgi_out.
+size_t stream_render(char *buf, size_t len) {
+  char *p = buf, *end = buf + len, *nl;
+  while ((nl = memchr(p, '\n', end - p))) {
+    *nl = '\0';
+    int first = 1;
+    out_lit("data: ");
+    render_line(p, 1, &first);
+    out_lit("\n\n");
+    p = nl + 1;
+  }
+  out_flush();
+  return p - buf;
+}
+
+// Send whatever has been appended to f's log since the last time.
+void stream_feed_update(struct stream_feed *f) {
+  static char block[64*1024];
+  if (f->fd < 0 || f->nsubs == 0)
+    return;
+  while (1) {
+    ssize_t n = pread(f->fd, block, sizeof block, f->offset);
+    if (n <= 0)
+      return;
+    char *out = NULL;
+    size_t out_len = 0;
+    cgi_out = open_memstream(&out, &out_len);
+    if (!cgi_out)
+      return;
+    size_t used = stream_render(block, n);
+    fclose(cgi_out);
+    cgi_out = NULL;
+    if (out_len)
+      stream_send(f, out, out_len);
+    free(out);
+    if (used == 0) {
+      // A line longer than the block is not a record; skip it.
+      if (n == sizeof block)
+        f->offset += n;
+      return;
+    }
+    f->offset += used;
+  }
+}
+
+// Render the lines of f's log from from up to f->offset, which the hub
+// has already sent to the others, into a new buffer.
+void stream_render_since(struct stream_feed *f, off_t from, char **out, size_t *out_len) {
+  *out = NULL;
+  *out_len = 0;
+  size_t len = f->offset - from;
+  char *buf = malloc(len);
+  if (buf && pread(f->fd, buf, len, from) == (ssize_t) len &&
+      (cgi_out = open_memstream(out, out_len))) {
+    stream_render(buf, len);
+    fclose(cgi_out);
+    cgi_out = NULL;
+  }
+  free(buf);
+}
+
+struct stream_feed *stream_find_feed(const char *name) {
+  for (int i = 0; i < nfeeds; i++)
+    if (strcmp(feeds[i].name, name) == 0)
+      return &feeds[i];
+  return NULL;
+}
+
+void *stream_hub(void *arg) {
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  time_t last_beat = time(NULL);
+
+  while (1) {
+    struct pollfd pfd = { stream_inotify, POLLIN, 0 };
+    int r = poll(&pfd, 1, STREAM_HEARTBEAT * 1000);
+    bool dirty[STREAM_FEEDS_MAX] = { false };
+
+    pthread_mutex_lock(&feeds_lock);
+    if (r > 0) {
+      ssize_t len = read(stream_inotify, events, sizeof events);
+      for (char *p = events; len > 0 && p < events + len; ) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        p += sizeof *ev + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW) {
+          for (int i = 0; i < nfeeds; i++)
+            dirty[i] = true;
+          continue;
+        }
+        if (!ev->len || strncmp(ev->name, "0Logfile.", 9) != 0)
+          continue;
+        struct stream_feed *f = stream_find_feed(ev->name + 9);
+        if (!f || stream_feed_idle(f))
+          continue;
+        if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) {
+          // Saved away (SAVE_LOG_TO_FILE) or removed: send what is left,
+          // then wait for the logger to start a new file.
+          stream_feed_update(f);
+          if (f->fd >= 0) {
+            close(f->fd);
+            f->fd = -1;
+            f->gen++;
+          }
+        } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+          stream_open_log(f, false);
+          dirty[f - feeds] = true;
+        } else
+          dirty[f - feeds] = true;
+      }
+    }
+    for (int i = 0; i < nfeeds; i++)
+      if (dirty[i])
+        stream_feed_update(&feeds[i]);
+
+    time_t now = time(NULL);
+    if (now - last_beat >= STREAM_HEARTBEAT) {
+      for (int i = 0; i < nfeeds; i++)
+        stream_send(&feeds[i], ": keepalive\n\n", 13);
+      last_beat = now;
+    }
+    pthread_mutex_unlock(&feeds_lock);
+  }
+  return NULL;
+}
+
+void stream_start_hub() {
+  stream_inotify = inotify_init1(IN_CLOEXEC);
+  if (stream_inotify < 0) {
+    perror("inotify_init1");
+    return;
+  }
+  if (inotify_add_watch(stream_inotify, DIR_NAME,
+                        IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+    perror("inotify_add_watch");
+    close(stream_inotify);
+    stream_inotify = -1;
+    return;
+  }
+  pthread_t hub;
+  if (pthread_create(&hub, NULL, stream_hub, NULL) != 0) {
+    perror("pthread_create");
+    close(stream_inotify);
+    stream_inotify = -1;
+    return;
+  }
+  pthread_detach(hub);
+}
+
+// Start streaming dataset to the client on fd, which then belongs to
+// the hub. Returns false (and fd is still ours) if we can't.
+bool stream_subscribe(int fd, char *dataset, int backlog) {
+  pthread_once(&stream_once, stream_start_hub);
+  if (stream_inotify < 0 || strlen(dataset) >= sizeof feeds[0].name) {
+    http_error(fd, "503 Service Unavailable");
+    return false;
+  }
+
+  pthread_mutex_lock(&feeds_lock);
+  struct stream_feed *f = stream_find_feed(dataset);
+  for (int i = 0; !f && i < nfeeds; i++)
+    if (stream_feed_idle(&feeds[i])) {
+      f = &feeds[i];
+      strcpy(f->name, dataset);
+    }
+  if (!f && nfeeds < STREAM_FEEDS_MAX) {
+    f = &feeds[nfeeds++];
+    strcpy(f->name, dataset);
+    f->fd = -1;
+    f->subs = NULL;
+    f->nsubs = f->maxsubs = 0;
+  }
+  if (f && stream_feed_idle(f))
+    stream_open_log(f, true);  // nobody was following it; start at the end
+  if (!f || f->fd < 0) {
+    if (f)
+      stream_release(f);
+    pthread_mutex_unlock(&feeds_lock);
+    http_error(fd, f ? "404 Not Found" : "503 Service Unavailable");
+    return false;
+  }
+
+  char *out = NULL;
+  size_t out_len = 0;
+  cgi_out = open_memstream(&out, &out_len);
+  if (!cgi_out) {
+    stream_release(f);
+    pthread_mutex_unlock(&feeds_lock);
+    http_error(fd, "503 Service Unavailable");
+    return false;
+  }
+  out_lit("HTTP/1.1 200 OK\r\n"
+          "Content-Type: text/event-stream\r\n"
+          "Cache-Control: no-cache\r\n"
+          "Access-Control-Allow-Origin: *\r\n"
+          "Connection: keep-alive\r\n\r\n");
+  // The backlog: the last lines before f->offset.
+  if (backlog > 0) {
+    if (backlog > STREAM_BACKLOG_MAX)
+      backlog = STREAM_BACKLOG_MAX;
+    FILE *fp = fdopen(dup(f->fd), "r");
+    if (fp) {
+      char *line = NULL;
+      size_t c = 0;
+      ssize_t len;
+      find_back_lines(fp, backlog);
+      off_t pos = ftello(fp);
+      while (pos < f->offset && (len = getline(&line, &c, fp)) > 0) {
+        pos += len;
+        if (pos <= f->offset && line[len-1] == '\n')
+          stream_render(line, len);
+      }
+      free(line);
+      fclose(fp);
+    }
+  }
+  out_flush();
+  fclose(cgi_out);
+  cgi_out = NULL;
+  off_t sent_to = f->offset;
+  unsigned long gen = f->gen;
+  f->pending++;
+  pthread_mutex_unlock(&feeds_lock);
+
+  // A client that does not take it within STREAM_SEND_TIMEOUT is dropped.
+  struct timeval tv = { STREAM_SEND_TIMEOUT, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+  bool ok = write_all(fd, out, out_len) == 0;
+  free(out);
+  int sndbuf = STREAM_SNDBUF;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+
+  pthread_mutex_lock(&feeds_lock);
+  f->pending--;
+  // What the hub has sent the others meanwhile, without waiting, as the
+  // hub would. If the log was saved away meanwhile, that part is lost.
+  if (ok && f->gen == gen && f->fd >= 0 && f->offset > sent_to) {
+    stream_render_since(f, sent_to, &out, &out_len);
+    ok = send(fd, out, out_len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) out_len;
+    free(out);
+  }
+  if (ok && f->nsubs == f->maxsubs) {
+    int max = f->maxsubs ? 2 * f->maxsubs : 16;
+    int *subs = realloc(f->subs, max * sizeof(int));
+    if (subs) {
+      f->subs = subs;
+      f->maxsubs = max;
+    } else
+      ok = false;
+  }
+  if (ok)
+    f->subs[f->nsubs++] = fd;
+  else
+    stream_release(f);
+  pthread_mutex_unlock(&feeds_lock);
+  if (!ok)
+    close(fd);
+  return true;
+}
+
+// A connection, from a fixed pool like the logger's TCP connections.
+// One that waits for its next request is on the idle list, ordered by
+// last activity, and armed in epoll; one that has something to read is
+// on the work queue or with a thread, and belongs to that thread.
+struct http_conn {
+  int fd;                    // -1 when the slot is free
+  struct sockaddr_in peer;
+  time_t last_active;
+  int prev, next;            // idle list, or work queue / free list through next
+  char *req;                 // HTTP_REQUEST_MAX + 1 bytes
+  size_t have;               // bytes of the next request already read
+};
+
+struct http_conn http_conns[HTTP_CONNS_MAX];
+int http_idle_head = -1, http_idle_tail = -1;
+int http_queue_head = -1, http_queue_tail = -1;
+int http_free = -1;
+int http_epfd = -1;
+pthread_mutex_t http_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t http_ready = PTHREAD_COND_INITIALIZER;
+
+// What serving a connection left it as.
+#define HTTP_CLOSE 0          // done with; close it
+#define HTTP_WAIT 1           // waiting for the client to send (more of) a request
+#define HTTP_SERVED 2         // served a request; keep it alive
+#define HTTP_STREAMED 3       // handed to the stream hub
+
+// The lists below are all under http_lock.
+void http_idle_unlink(int i) {
+  struct http_conn *c = &http_conns[i];
+  if (c->prev != -1) http_conns[c->prev].next = c->next; else http_idle_head = c->next;
+  if (c->next != -1) http_conns[c->next].prev = c->prev; else http_idle_tail = c->prev;
+}
+
+void http_idle_append(int i) {
+  struct http_conn *c = &http_conns[i];
+  c->prev = http_idle_tail;
+  c->next = -1;
+  if (http_idle_tail != -1) http_conns[http_idle_tail].next = i; else http_idle_head = i;
+  http_idle_tail = i;
+}
+
+void http_enqueue(int i) {
+  http_conns[i].next = -1;
+  if (http_queue_tail != -1) http_conns[http_queue_tail].next = i; else http_queue_head = i;
+  http_queue_tail = i;
+  pthread_cond_signal(&http_ready);
+}
+
+// Wait for the client on i again.
+void http_arm(int i) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.u32 = i;
+  epoll_ctl(http_epfd, EPOLL_CTL_MOD, http_conns[i].fd, &ev);
+  http_conns[i].last_active = time(NULL);
+  http_idle_append(i);
+}
+
+// Free slot i, closing its socket unless the stream hub has it. It must
+// not be on the idle list or the work queue.
+void http_release(int i, bool close_fd) {
+  struct http_conn *c = &http_conns[i];
+  if (close_fd) {
+    epoll_ctl(http_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+  }
+  c->fd = -1;
+  free(c->req);
+  c->req = NULL;
+  c->next = http_free;
+  http_free = i;
+}
+
+void http_accept(int listenfd) {
+  while (1) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof peer;
+    int fd = accept(listenfd, (struct sockaddr *) &peer, &len);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        perror("accept");
+      return;
+    }
+    // Reads never block (see http_serve_request); a client that does
+    // not take a response gives up its thread after HTTP_IDLE_TIMEOUT.
+    struct timeval tv = { HTTP_IDLE_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    pthread_mutex_lock(&http_lock);
+    char *req = http_free == -1 ? NULL : malloc(HTTP_REQUEST_MAX + 1);
+    if (!req) {
+      pthread_mutex_unlock(&http_lock);
+      http_error(fd, "503 Service Unavailable");
+      close(fd);
+      continue;
+    }
+    int i = http_free;
+    struct http_conn *c = &http_conns[i];
+    http_free = c->next;
+    c->fd = fd;
+    c->peer = peer;
+    c->req = req;
+    c->have = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.u32 = i;
+    epoll_ctl(http_epfd, EPOLL_CTL_ADD, fd, &ev);
+    c->last_active = time(NULL);
+    http_idle_append(i);
+    pthread_mutex_unlock(&http_lock);
+  }
+}
+
+// Serve the next request on c, reading only what the client has sent:
+// HTTP_WAIT if it has not sent all of it yet.
+int http_serve_request(struct http_conn *c) {
+  char *req = c->req;
+
+  // Read until we have the complete request head.
+  char *end;
+  req[c->have] = '\0';
+  while (!(end = strstr(req, "\r\n\r\n"))) {
+    if (c->have == HTTP_REQUEST_MAX) {
+      http_error(c->fd, "431 Request Header Fields Too Large");
+      return HTTP_CLOSE;
+    }
+    ssize_t n = recv(c->fd, req + c->have, HTTP_REQUEST_MAX - c->have, MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return HTTP_WAIT;
+    if (n <= 0)
+      return HTTP_CLOSE;
+    c->have += n;
+    req[c->have] = '\0';
+  }
+  *end = '\0';
+  size_t used = end + 4 - req;
+
+  for (uint8_t i = 0; evars[i].name != NULL; i++)
+    evars[i].value[0] = '\0';
+  char addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &c->peer.sin_addr, addr, sizeof addr);
+  set_envvar("GATEWAY_INTERFACE", "CGI/1.1", 7);
+  set_envvar("REMOTE_ADDR", addr, strlen(addr));
+
+  // The request line: METHOD URI VERSION
+  char *save;
+  char *method = strtok_r(req, " ", &save);
+  char *uri = strtok_r(NULL, " ", &save);
+  char *version = strtok_r(NULL, "\r", &save);
+  if (!method || !uri || !version || uri[0] != '/' || strlen(uri) >= 256) {
+    http_error(c->fd, "400 Bad Request");
+    return HTTP_CLOSE;
+  }
+  char *q = strchr(uri, '?');
+  if (q && strchr(q + 1, '?')) {
+    http_error(c->fd, "400 Bad Request");
+    return HTTP_CLOSE;
+  }
+  bool head = strcmp(method, "HEAD") == 0;
+  if (!head && strcmp(method, "GET") != 0) {
+    http_error(c->fd, "405 Method Not Allowed");
+    return HTTP_CLOSE;
+  }
+  set_envvar("REQUEST_METHOD", method, strlen(method));
+  set_envvar("REQUEST_URI", uri, strlen(uri));
+  set_envvar("QUERY_STRING", q ? q + 1 : "", q ? strlen(q + 1) : 0);
+  set_envvar("SERVER_PROTOCOL", version, strlen(version));
+
+  // /rds/<dataset>/stream[?n=N]
+  size_t path_len = q ? (size_t)(q - uri) : strlen(uri);
+  if (path_len > 7 && strncmp(uri + path_len - 7, "/stream", 7) == 0 && !head) {
+    char dataset[64];
+    char *start = uri + path_len - 7;
+    while (start > uri && start[-1] != '/')
+      start--;
+    size_t dlen = uri + path_len - 7 - start;
+    if (dlen > 0 && dlen < sizeof dataset) {
+      memcpy(dataset, start, dlen);
+      dataset[dlen] = '\0';
+      int backlog = (q && strncmp(q + 1, "n=", 2) == 0) ? atoi(q + 3) : 0;
+      // Out of epoll before the hub has it: once the hub closes it, its
+      // number may be reused by the next connection.
+      epoll_ctl(http_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+      return stream_subscribe(c->fd, dataset, backlog) ? HTTP_STREAMED : HTTP_CLOSE;
+    }
+  }
+
+  bool keep_alive = strcmp(version, "HTTP/1.1") == 0;
+
+  // Headers we pass on, and Connection
+  char *line;
+  while ((line = strtok_r(NULL, "\r\n", &save))) {
+    char *colon = strchr(line, ':');
+    if (!colon)
+      continue;
+    *colon = '\0';
+    char *value = colon + 1;
+    while (*value == ' ')
+      value++;
+    if (strcasecmp(line, "Connection") == 0)
+      keep_alive = strcasecmp(value, "close") != 0 &&
+        (keep_alive || strcasecmp(value, "keep-alive") == 0);
+    else if (strcasecmp(line, "User-Agent") == 0)
+      set_envvar("HTTP_USER_AGENT", value, strlen(value));
+    else if (strcasecmp(line, "Referer") == 0)
+      set_envvar("HTTP_REFERER", value, strlen(value));
+    else if (strcasecmp(line, "Accept") == 0)
+      set_envvar("HTTP_ACCEPT", value, strlen(value));
+  }
+
+  char *out = NULL;
+  size_t out_len = 0;
+  cgi_out = open_memstream(&out, &out_len);
+  if (!cgi_out) {
+    http_error(c->fd, "500 Internal Server Error");
+    return HTTP_CLOSE;
+  }
+  handle_request();
+  fclose(cgi_out);
+  cgi_out = NULL;
+  int ret = http_respond(c->fd, out, out_len, head, keep_alive);
+  free(out);
+  if (ret != 0 || !keep_alive)
+    return HTTP_CLOSE;
+
+  // Keep whatever the client has already sent of the next request.
+  memmove(req, req + used, c->have - used);
+  c->have -= used;
+  return HTTP_SERVED;
+}
+
+void *http_worker(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&http_lock);
+    while (http_queue_head == -1)
+      pthread_cond_wait(&http_ready, &http_lock);
+    int i = http_queue_head;
+    http_queue_head = http_conns[i].next;
+    if (http_queue_head == -1)
+      http_queue_tail = -1;
+    pthread_mutex_unlock(&http_lock);
+
+    struct http_conn *c = &http_conns[i];
+    int r = http_serve_request(c);
+
+    pthread_mutex_lock(&http_lock);
+    if (r == HTTP_CLOSE || r == HTTP_STREAMED)
+      http_release(i, r == HTTP_CLOSE);
+    else if (r == HTTP_SERVED && c->have > 0)
+      http_enqueue(i);        // the next request may already be here
+    else
+      http_arm(i);
+    pthread_mutex_unlock(&http_lock);
+  }
+  return NULL;
+}
+
+int serve_http(char *port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(atoi(port));
+
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenfd < 0) {
+    perror("socket");
+    return 1;
+  }
+  int one = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (bind(listenfd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+      listen(listenfd, 128) < 0) {
+    perror("bind");
+    return 1;
+  }
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+  http_epfd = epoll_create1(0);
+  if (http_epfd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = HTTP_LISTENER;
+  epoll_ctl(http_epfd, EPOLL_CTL_ADD, listenfd, &ev);
+  for (int i = 0; i < HTTP_CONNS_MAX; i++) {
+    http_conns[i].fd = -1;
+    http_conns[i].next = i + 1 < HTTP_CONNS_MAX ? i + 1 : -1;
+  }
+  http_free = 0;
+
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "pirds_webcgi serving %s on port %s with %d threads\n",
+          DIR_NAME, port, gHTTP_THREADS);
+
+  for (int i = 0; i < gHTTP_THREADS; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, http_worker, NULL) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+
+  struct epoll_event events[HTTP_EVENTS];
+  while (1) {
+    // Wake up at least once a second to close idle connections.
+    int n = epoll_wait(http_epfd, events, HTTP_EVENTS, 1000);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return 1;
+    }
+    for (int e = 0; e < n; e++) {
+      uint32_t i = events[e].data.u32;
+      if (i == HTTP_LISTENER) {
+        http_accept(listenfd);
+        continue;
+      }
+      pthread_mutex_lock(&http_lock);
+      http_idle_unlink(i);
+      http_enqueue(i);
+      pthread_mutex_unlock(&http_lock);
+    }
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&http_lock);
+    while (http_idle_head != -1 &&
+           now - http_conns[http_idle_head].last_active >= HTTP_IDLE_TIMEOUT) {
+      int i = http_idle_head;
+      http_idle_unlink(i);
+      http_release(i, true);
+    }
+    pthread_mutex_unlock(&http_lock);
+  }
+  return 0;
+}
+
+// -B dataset [n]: render the last n lines (default 100000) of a
+// dataset with both render_line_legacy() and render_line(), check that
+// the output is byte for byte the same, and report how long each took.
+#define BENCH_RUNS 5
+
+double bench_pass(char **lines, size_t *lens, int count, char *scratch, int json,
+                  bool legacy, char **out, size_t *out_len) {
+  struct timespec t0, t1;
+  cgi_out = open_memstream(out, out_len);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int first = 1;
+  for (int i = 0; i < count; i++) {
+    memcpy(scratch, lines[i], lens[i] + 1);
+    if (legacy)
+      render_line_legacy(scratch, json, &first);
+    else
+      render_line(scratch, json, &first);
+  }
+  out_flush();
+  fflush(cgi_out);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fclose(cgi_out);
+  cgi_out = stdout;
+  return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int bench_render(char *dataset, int count) {
+  char *fname = NULL;
+  asprintf(&fname, "%s/0Logfile.%s", DIR_NAME, dataset);
+  FILE *fp = fopen(fname, "r");
+  free(fname);
+  if (!fp) {
+    fprintf(stderr, "No such dataset %s\n", dataset);
+    return 1;
+  }
+  find_back_lines(fp, count);
+  char **lines = malloc(count * sizeof(char *));
+  size_t *lens = malloc(count * sizeof(size_t));
+  size_t c = 0, longest = 0;
+  ssize_t len;
+  int n = 0;
+  lines[0] = NULL;
+  while (n < count && (len = getline(&lines[n], &c, fp)) > 0) {
+    lens[n] = len;
+    if ((size_t) len > longest)
+      longest = len;
+    n++;
+    c = 0;
+    if (n < count)
+      lines[n] = NULL;
+  }
+  fclose(fp);
+  char *scratch = malloc(longest + 1);
+  int status = 0;
+
+  for (int json = 0; json <= 1; json++) {
+    double best[2] = { 1e9, 1e9 };
+    char *out[2] = { NULL, NULL };
+    size_t out_len[2] = { 0, 0 };
+    for (int run = 0; run < BENCH_RUNS; run++) {
+      for (int legacy = 1; legacy >= 0; legacy--) {
+        free(out[legacy]);
+        out[legacy] = NULL;
+        double t = bench_pass(lines, lens, n, scratch, json, legacy, &out[legacy], &out_len[legacy]);
+        if (t < best[legacy])
+          best[legacy] = t;
+      }
+    }
+    bool same = out_len[0] == out_len[1] && memcmp(out[0], out[1], out_len[0]) == 0;
+    printf("%s: %d lines, %zu bytes, legacy %.2f ms, buffered %.2f ms (%.1fx), output %s\n",
+           json ? "json" : "raw", n, out_len[1], best[1] * 1e3, best[0] * 1e3,
+           best[0] > 0 ? best[1] / best[0] : 0.0, same ? "identical" : "DIFFERS");
+    if (!same)
+      status = 1;
+    free(out[0]);
+    free(out[1]);
+  }
+  for (int i = 0; i < n; i++)
+    free(lines[i]);
+  free(lines);
+  free(lens);
+  free(scratch);
+  return status;
+}
+
+int main(int argc, char* argv[]) {
+  char *port = NULL;
+  char *bench = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:j:B:")) != -1) {
+    switch (opt) {
+    case 'l': port = optarg; break;
+    case 'j': gHTTP_THREADS = atoi(optarg); break;
+    case 'B': bench = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-l port [-j threads]] [-B dataset [lines]]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  cgi_out = stdout;
+  cgienv_parse();
+
+  // if the "PIRDS_WEBCGI" is set, we want to use it as DIR_NAME.
+  char *pirds_webcgi = get_envvar("PIRDS_WEBCGI");
+  if (strlen(pirds_webcgi)) {
+    // evars belongs to this thread, so keep a copy
+    DIR_NAME = strdup(pirds_webcgi);
+    //    fprintf(stderr,"DIR_NAME = %s\n",DIR_NAME);
+  } else {
+    //    fprintf(stderr,"PIRDS_WEBCGI not found\n");
+  }
+
+  if (bench) {
+    int count = optind < argc ? atoi(argv[optind]) : 100000;
+    if (count < 1) {
+      fprintf(stderr, "-B needs at least 1 line\n");
+      exit(1);
+    }
+    return bench_render(bench, count);
+  }
+  if (port) {
+    if (gHTTP_THREADS < 1)
+      gHTTP_THREADS = 1;
+    gDAEMON = 1;
+    return serve_http(port);
+  }
+  return handle_request();
 }